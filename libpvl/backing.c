@@ -0,0 +1,248 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * File-backed main block for libpvl (POSIX, implementation)
+ */
+
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "backing.h"
+
+struct pvl_backing {
+	int data_fd;
+	int log_fd;
+	char *main;
+	size_t length;
+	size_t staging_size;
+	unsigned char *staging;
+	size_t fill;
+	/* the redo log - its end and the start of the change being written */
+	off_t log_size;
+	off_t change_start;
+	_Bool in_change;
+	/* the loaded changes have been synced to the data file and the log emptied */
+	_Bool recycled;
+	_Bool failed;
+	off_t read_pos;
+};
+
+static int pvl_backing_recycle(struct pvl_backing *backing);
+static int pvl_backing_empty(struct pvl_backing *backing);
+static int pvl_backing_flush(struct pvl_backing *backing);
+static int pvl_backing_pwrite(int fd, const void *from, size_t length, off_t position);
+
+size_t pvl_backing_sizeof(size_t staging_size) {
+	return sizeof(struct pvl_backing) + staging_size;
+}
+
+struct pvl_backing *pvl_backing_open(char *at, const char *data_path, const char *log_path, size_t length,
+		size_t staging_size) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if ((data_path == NULL) || (log_path == NULL) || (length == 0) || (staging_size == 0)) {
+		return NULL;
+	}
+
+	struct pvl_backing *backing = (struct pvl_backing*) at;
+	memset(backing, 0, sizeof(struct pvl_backing));
+	backing->length = length;
+	backing->staging_size = staging_size;
+	backing->staging = (unsigned char*) (at + sizeof(struct pvl_backing));
+
+	backing->data_fd = open(data_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	struct stat st;
+	backing->main = ((backing->data_fd < 0) || fstat(backing->data_fd, &st)
+			|| (((size_t) st.st_size < length) && posix_fallocate(backing->data_fd, 0, (off_t) length)))
+		? MAP_FAILED : mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, backing->data_fd, 0);
+	if (backing->main == MAP_FAILED) {
+		close(backing->data_fd); /* fails harmlessly when the open did */
+		return NULL;
+	}
+
+	backing->log_fd = open(log_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if ((backing->log_fd < 0) || fstat(backing->log_fd, &st)) {
+		close(backing->log_fd); /* fails harmlessly when the open did */
+		munmap(backing->main, length);
+		close(backing->data_fd);
+		return NULL;
+	}
+	backing->log_size = st.st_size;
+	return backing;
+}
+
+char *pvl_backing_main(struct pvl_backing *backing) {
+	if (backing == NULL) {
+		return NULL;
+	}
+	return backing->main;
+}
+
+int pvl_backing_close(struct pvl_backing *backing) {
+	if (backing == NULL) {
+		return 1;
+	}
+	/* Complete a load that was not followed by a commit */
+	int result = 0;
+	if ((! backing->recycled) && (backing->read_pos > 0)) {
+		result |= pvl_backing_recycle(backing);
+	}
+	result |= munmap(backing->main, backing->length) != 0;
+	result |= close(backing->log_fd) != 0;
+	result |= close(backing->data_fd) != 0;
+	return result;
+}
+
+int pvl_backing_write(void *ctx, void *from, size_t length, size_t remaining) {
+	if ((ctx == NULL) || (from == NULL) || (length == 0)) {
+		return 1;
+	}
+	struct pvl_backing *backing = (struct pvl_backing*)(ctx);
+	if (backing->failed) {
+		return 1;
+	}
+	if ((! backing->recycled) && pvl_backing_recycle(backing)) {
+		return 1;
+	}
+	if (! backing->in_change) {
+		backing->change_start = backing->log_size;
+		backing->in_change = 1;
+	}
+
+	/* Gather the change in the staging buffer */
+	const unsigned char *bytes = (const unsigned char*) from;
+	int result = 0;
+	while (length && (result == 0)) {
+		size_t chunk = backing->staging_size - backing->fill;
+		if (chunk > length) {
+			chunk = length;
+		}
+		memcpy(backing->staging + backing->fill, bytes, chunk);
+		backing->fill += chunk;
+		bytes += chunk;
+		length -= chunk;
+		if (backing->fill == backing->staging_size) {
+			result = pvl_backing_flush(backing);
+		}
+	}
+
+	/* The change is committed once the redo log is synced */
+	if ((result == 0) && (remaining == 0)) {
+		result = pvl_backing_flush(backing) || fdatasync(backing->log_fd);
+		backing->in_change = 0;
+	}
+	if (result) {
+		/* Drop the partial change, the commit is retried */
+		backing->fill = 0;
+		backing->log_size = backing->change_start;
+		backing->in_change = 0;
+		if (ftruncate(backing->log_fd, backing->change_start)) {
+			backing->failed = 1; /* the partial change stays in the redo log */
+		}
+		return 1;
+	}
+	return 0;
+}
+
+int pvl_backing_read(void *ctx, void *to, size_t length, size_t remaining) {
+	if (ctx == NULL) {
+		return 1;
+	}
+	struct pvl_backing *backing = (struct pvl_backing*)(ctx);
+
+	/* Check that the rest of the change is present */
+	if (to == NULL) {
+		return (backing->read_pos + (off_t) remaining) > backing->log_size;
+	}
+
+	if ((backing->read_pos + (off_t) length) > backing->log_size) {
+		return (backing->read_pos == backing->log_size) ? EOF : 1;
+	}
+	unsigned char *bytes = (unsigned char*) to;
+	off_t position = backing->read_pos;
+	while (length) {
+		ssize_t done = pread(backing->log_fd, bytes, length, position);
+		if (done <= 0) {
+			return 1;
+		}
+		bytes += done;
+		length -= (size_t) done;
+		position += done;
+	}
+	backing->read_pos = position;
+	return 0;
+}
+
+int pvl_backing_apply(void *ctx, size_t offset, const char *from, size_t length, size_t remaining) {
+	if ((ctx == NULL) || (from == NULL)) {
+		return 1;
+	}
+	struct pvl_backing *backing = (struct pvl_backing*)(ctx);
+	if ((offset >= backing->length) || (length > (backing->length - offset))) {
+		return 1; /* only the first region is backed */
+	}
+	if (pvl_backing_pwrite(backing->data_fd, from, length, (off_t) offset)) {
+		return 1;
+	}
+
+	/* A committed change is in the data file once synced and the redo log is emptied.
+	   Loaded changes are synced when the log is recycled, after all of them are replayed. */
+	if ((remaining == 0) && backing->recycled) {
+		return pvl_backing_empty(backing);
+	}
+	return 0;
+}
+
+/* Sync the replayed changes to the data file and empty the redo log */
+static int pvl_backing_recycle(struct pvl_backing *backing) {
+	if ((backing->log_size > 0) && (backing->read_pos == 0)) {
+		return 1; /* the redo log must be loaded first */
+	}
+	backing->recycled = (pvl_backing_empty(backing) == 0);
+	return ! backing->recycled;
+}
+
+/* Sync the data file and empty the redo log */
+static int pvl_backing_empty(struct pvl_backing *backing) {
+	if (fdatasync(backing->data_fd) || ftruncate(backing->log_fd, 0)) {
+		return 1;
+	}
+	backing->log_size = 0;
+	return 0;
+}
+
+/* Append the staged part of the change to the redo log */
+static int pvl_backing_flush(struct pvl_backing *backing) {
+	if (pvl_backing_pwrite(backing->log_fd, backing->staging, backing->fill, backing->log_size)) {
+		return 1;
+	}
+	backing->log_size += (off_t) backing->fill;
+	backing->fill = 0;
+	return 0;
+}
+
+static int pvl_backing_pwrite(int fd, const void *from, size_t length, off_t position) {
+	const unsigned char *bytes = (const unsigned char*) from;
+	while (length) {
+		ssize_t done = pwrite(fd, bytes, length, position);
+		if (done <= 0) {
+			return 1;
+		}
+		bytes += done;
+		length -= (size_t) done;
+		position += done;
+	}
+	return 0;
+}
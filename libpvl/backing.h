@@ -0,0 +1,64 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * File-backed main block for libpvl (POSIX)
+ *
+ * Instead of replaying a journal from its start, main is mapped from a data
+ * file that holds the committed state. A commit writes its change to a small
+ * redo log and syncs it, writes the committed spans to the data file and
+ * syncs them, then empties the log. Loading replays at most the change that
+ * was in flight when the process stopped.
+ *
+ * The data file is mapped with MAP_PRIVATE. With MAP_SHARED the kernel may
+ * write back changes to main that were not committed yet, and a crash
+ * would leave them in the data file without a redo log record to complete
+ * or undo them. Pages of main that are written to are therefore held in
+ * memory as well as in the page cache.
+ *
+ * Pass the backing to pvl_set_apply_cb with pvl_backing_apply, to
+ * pvl_set_read_cb with pvl_backing_read and to pvl_set_write_cb with
+ * pvl_backing_write, in that order. Only a single region is supported.
+ */
+#pragma once
+
+#include <stddef.h>
+
+struct pvl_backing;
+
+/* Returns the size of a backing with a staging buffer of staging_size bytes */
+size_t pvl_backing_sizeof(size_t staging_size);
+
+/*
+ * Open a backing at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the backing should be initialized
+ * data_path          - Path to the data file, created and extended to length if needed
+ * log_path           - Path to the redo log, created if missing
+ * length             - The length of main
+ * staging_size       - The size of the buffer that redo log writes are gathered in
+ *
+ * Returns
+ * pvl_backing*       - A valid pointer in the case of success, NULL otherwise.
+ */
+struct pvl_backing *pvl_backing_open(char *at, const char *data_path, const char *log_path, size_t length,
+		size_t staging_size);
+
+/* Returns main, the mapping of the data file */
+char *pvl_backing_main(struct pvl_backing *backing);
+
+/* Release main and close the files */
+int pvl_backing_close(struct pvl_backing *backing);
+
+/* Write handler for the redo log, see write_callback in pvl.h */
+int pvl_backing_write(void *ctx, void *from, size_t length, size_t remaining);
+
+/* Read handler for the redo log, see read_callback in pvl.h */
+int pvl_backing_read(void *ctx, void *to, size_t length, size_t remaining);
+
+/* Apply handler that writes spans to the data file, see apply_callback in pvl.h */
+int pvl_backing_apply(void *ctx, size_t offset, const char *from, size_t length, size_t remaining);
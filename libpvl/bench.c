@@ -0,0 +1,332 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Benchmarks for libpvl
+ *
+ * Measures pvl_mark(), pvl_mark_many() and pvl_mark_view() throughput across mark sizes and span counts, pvl_commit()
+ * latency versus the dirty fraction of the block, the cost of leak detection
+ * and the replay throughput of pvl_load(), span by span and with a load buffer,
+ * using in-memory and file sinks.
+ *
+ * Results are printed as CSV (default) or JSON when "json" is passed as the
+ * first argument. Latencies are in nanoseconds per operation.
+ */
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "journal.h"
+#include "pvl.h"
+
+#define BENCH_BLOCK_SIZE ((size_t)4 << 20)
+#define BENCH_SAMPLES 64
+#define BENCH_MARK_BATCH 1024
+#define BENCH_LOAD_CHANGES 16
+#define BENCH_LOAD_BUFFER (BENCH_BLOCK_SIZE / 8)
+
+struct bench_sink {
+	/* memory sink */
+	char *buffer;
+	size_t capacity;
+	size_t pos;
+	size_t len;
+	/* file sink, used when file.destination is set */
+	struct pvl_journal_config file;
+};
+
+struct bench_result {
+	const char *name;
+	const char *sink;
+	size_t span_count;
+	const char *param;
+	size_t value;
+	/* bytes processed per operation, used for throughput */
+	size_t bytes;
+	uint64_t samples[BENCH_SAMPLES];
+};
+
+static _Bool bench_json;
+static _Bool bench_first = 1;
+static uint64_t bench_state = 0x9E3779B97F4A7C15u;
+
+static const size_t bench_span_counts[] = {64, 1024, 16384, 262144};
+static const size_t bench_mark_sizes[] = {8, 64, 4096, 65536};
+/* Dirty fractions in parts per ten thousand */
+static const size_t bench_dirty[] = {1, 10, 100, 1000, 5000, 10000};
+
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000u) + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64, deterministic across runs */
+static size_t bench_random(size_t bound) {
+	bench_state ^= bench_state << 13;
+	bench_state ^= bench_state >> 7;
+	bench_state ^= bench_state << 17;
+	return (size_t)(bench_state % bound);
+}
+
+static int bench_compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int bench_write(void *ctx, void *from, size_t length, size_t remaining) {
+	struct bench_sink *sink = (struct bench_sink*) ctx;
+	if (sink->file.destination) {
+		return pvl_journal_write(&sink->file, from, length, remaining);
+	}
+	if ((sink->pos + length) > sink->capacity) {
+		return 1;
+	}
+	memcpy(sink->buffer + sink->pos, from, length);
+	sink->pos += length;
+	sink->len = sink->pos;
+	return 0;
+}
+
+static int bench_read(void *ctx, void *to, size_t length, size_t remaining) {
+	struct bench_sink *sink = (struct bench_sink*) ctx;
+	if (sink->file.destination) {
+		return pvl_journal_read(&sink->file, to, length, remaining);
+	}
+	if (to == NULL) {
+		return (sink->pos + remaining) > sink->len;
+	}
+	if ((sink->pos + length) > sink->len) {
+		return EOF;
+	}
+	memcpy(to, sink->buffer + sink->pos, length);
+	sink->pos += length;
+	return 0;
+}
+
+static void bench_leak(void *ctx, void *start, size_t length) {
+	(void)(start);
+	*(size_t*)ctx += length;
+}
+
+static void bench_rewind(struct bench_sink *sink) {
+	sink->pos = 0;
+	if (sink->file.destination) {
+		rewind(sink->file.destination);
+	}
+}
+
+static void bench_truncate(struct bench_sink *sink) {
+	sink->pos = 0;
+	sink->len = 0;
+	if (sink->file.destination) {
+		fclose(sink->file.destination);
+		sink->file.destination = tmpfile();
+	}
+}
+
+static void bench_report(struct bench_result *result) {
+	qsort(result->samples, BENCH_SAMPLES, sizeof(uint64_t), bench_compare);
+	uint64_t p50 = result->samples[BENCH_SAMPLES / 2];
+	uint64_t p90 = result->samples[(BENCH_SAMPLES * 90) / 100];
+	uint64_t p99 = result->samples[(BENCH_SAMPLES * 99) / 100];
+	uint64_t max = result->samples[BENCH_SAMPLES - 1];
+	double mbps = p50 ? ((double)result->bytes * 1000.0) / (double)p50 : 0.0;
+
+	if (bench_json) {
+		printf("%s\n  {\"benchmark\": \"%s\", \"sink\": \"%s\", \"span_count\": %zu, "
+				"\"%s\": %zu, \"samples\": %d, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+				"\"p99_ns\": %llu, \"max_ns\": %llu, \"mb_per_s\": %.2f}",
+				bench_first ? "[" : ",", result->name, result->sink, result->span_count,
+				result->param, result->value, BENCH_SAMPLES, (unsigned long long)p50,
+				(unsigned long long)p90, (unsigned long long)p99, (unsigned long long)max, mbps);
+	} else {
+		if (bench_first) {
+			printf("benchmark,sink,span_count,param,value,samples,p50_ns,p90_ns,p99_ns,max_ns,mb_per_s\n");
+		}
+		printf("%s,%s,%zu,%s,%zu,%d,%llu,%llu,%llu,%llu,%.2f\n", result->name, result->sink,
+				result->span_count, result->param, result->value, BENCH_SAMPLES,
+				(unsigned long long)p50, (unsigned long long)p90, (unsigned long long)p99,
+				(unsigned long long)max, mbps);
+	}
+	bench_first = 0;
+}
+
+/* Mark random spans until the given fraction of the block is marked */
+static void bench_dirty_block(struct pvl *pvl, char *main, size_t span_count, size_t dirty) {
+	size_t span_length = BENCH_BLOCK_SIZE / span_count;
+	size_t spans = (span_count * dirty) / 10000;
+	if (spans == 0) {
+		spans = 1;
+	}
+	if (spans == span_count) {
+		memset(main, (int)bench_random(256), BENCH_BLOCK_SIZE);
+		pvl_mark(pvl, main, BENCH_BLOCK_SIZE);
+		return;
+	}
+	for (size_t i = 0; i < spans; i++) {
+		char *at = main + (bench_random(span_count) * span_length);
+		at[0]++;
+		pvl_mark(pvl, at, span_length);
+	}
+}
+
+static void bench_mark(char *pvl_at, char *main, struct bench_sink *sink, const char *series) {
+	for (size_t i = 0; i < sizeof(bench_span_counts)/sizeof(size_t); i++) {
+		for (size_t j = 0; j < sizeof(bench_mark_sizes)/sizeof(size_t); j++) {
+			struct bench_result result = {series, "none", bench_span_counts[i],
+				"mark_size", bench_mark_sizes[j], bench_mark_sizes[j], {0}};
+			struct pvl *pvl = pvl_init(pvl_at, main, BENCH_BLOCK_SIZE, bench_span_counts[i]);
+			pvl_set_write_cb(pvl, sink, bench_write);
+			struct pvl_view view;
+			pvl_get_view(pvl, &view);
+
+			for (size_t s = 0; s < BENCH_SAMPLES; s++) {
+				struct pvl_range ranges[BENCH_MARK_BATCH];
+				for (size_t k = 0; k < BENCH_MARK_BATCH; k++) {
+					ranges[k].start = main + bench_random(BENCH_BLOCK_SIZE - bench_mark_sizes[j]);
+					ranges[k].length = bench_mark_sizes[j];
+				}
+				uint64_t start = bench_now();
+				if (strcmp(series, "mark_many") == 0) {
+					pvl_mark_many(pvl, ranges, BENCH_MARK_BATCH);
+				} else if (strcmp(series, "mark_view") == 0) {
+					for (size_t k = 0; k < BENCH_MARK_BATCH; k++) {
+						pvl_mark_view(&view, ranges[k].start, ranges[k].length);
+					}
+				} else {
+					for (size_t k = 0; k < BENCH_MARK_BATCH; k++) {
+						pvl_mark(pvl, ranges[k].start, ranges[k].length);
+					}
+				}
+				result.samples[s] = (bench_now() - start) / BENCH_MARK_BATCH;
+
+				/* Clear the marks */
+				bench_truncate(sink);
+				pvl_commit(pvl);
+			}
+			bench_report(&result);
+		}
+	}
+}
+
+static void bench_commit(char *pvl_at, char *main, char *mirror, struct bench_sink *sink,
+		const char *sink_name, _Bool leaks) {
+	size_t leaked = 0;
+	for (size_t i = 0; i < sizeof(bench_span_counts)/sizeof(size_t); i++) {
+		for (size_t j = 0; j < sizeof(bench_dirty)/sizeof(size_t); j++) {
+			struct bench_result result = {leaks ? "commit_leak_detection" : "commit", sink_name,
+				bench_span_counts[i], "dirty_bp", bench_dirty[j], 0, {0}};
+			memset(main, 0, BENCH_BLOCK_SIZE);
+			struct pvl *pvl = pvl_init(pvl_at, main, BENCH_BLOCK_SIZE, bench_span_counts[i]);
+			if (leaks) {
+				memset(mirror, 0, BENCH_BLOCK_SIZE);
+				pvl_set_mirror(pvl, mirror);
+				pvl_set_leak_cb(pvl, &leaked, bench_leak);
+			}
+			pvl_set_write_cb(pvl, sink, bench_write);
+
+			size_t bytes = 0;
+			for (size_t s = 0; s < BENCH_SAMPLES; s++) {
+				bench_truncate(sink);
+				bench_dirty_block(pvl, main, bench_span_counts[i], bench_dirty[j]);
+				uint64_t start = bench_now();
+				pvl_commit(pvl);
+				/* Time handing the change to the kernel, not only stdio buffering */
+				if (sink->file.destination) {
+					fflush(sink->file.destination);
+				}
+				result.samples[s] = bench_now() - start;
+				bytes += sink->file.destination ? (size_t)ftell(sink->file.destination) : sink->len;
+			}
+			result.bytes = bytes / BENCH_SAMPLES;
+			bench_report(&result);
+		}
+	}
+}
+
+static void bench_load(char *pvl_at, char *main, struct bench_sink *sink, const char *sink_name,
+		char *load_buffer) {
+	for (size_t i = 0; i < sizeof(bench_span_counts)/sizeof(size_t); i++) {
+		struct bench_result result = {load_buffer ? "load_buffered" : "load", sink_name, bench_span_counts[i], "changes",
+			BENCH_LOAD_CHANGES, 0, {0}};
+
+		/* Persist a journal of changes with one percent of the block dirty each */
+		bench_truncate(sink);
+		struct pvl *pvl = pvl_init(pvl_at, main, BENCH_BLOCK_SIZE, bench_span_counts[i]);
+		pvl_set_write_cb(pvl, sink, bench_write);
+		for (size_t c = 0; c < BENCH_LOAD_CHANGES; c++) {
+			bench_dirty_block(pvl, main, bench_span_counts[i], 100);
+			pvl_commit(pvl);
+		}
+		if (sink->file.destination) {
+			fflush(sink->file.destination);
+			result.bytes = (size_t)ftell(sink->file.destination);
+		} else {
+			result.bytes = sink->len;
+		}
+
+		for (size_t s = 0; s < BENCH_SAMPLES; s++) {
+			bench_rewind(sink);
+			uint64_t start = bench_now();
+			pvl = pvl_init(pvl_at, main, BENCH_BLOCK_SIZE, bench_span_counts[i]);
+			if (load_buffer) {
+				pvl_set_load_buffer(pvl, load_buffer, BENCH_LOAD_BUFFER);
+			}
+			pvl_set_read_cb(pvl, sink, bench_read);
+			result.samples[s] = bench_now() - start;
+		}
+		bench_report(&result);
+	}
+}
+
+int main(int argc, char **argv) {
+	bench_json = (argc > 1) && (strcmp(argv[1], "json") == 0);
+
+	size_t max_spans = bench_span_counts[(sizeof(bench_span_counts)/sizeof(size_t)) - 1];
+	size_t pvl_size = pvl_sizeof(max_spans);
+	pvl_size += (alignof(max_align_t) - (pvl_size % alignof(max_align_t))) % alignof(max_align_t);
+	char *pvl_at = aligned_alloc(alignof(max_align_t), pvl_size);
+	char *main_block = malloc(BENCH_BLOCK_SIZE);
+	char *mirror = malloc(BENCH_BLOCK_SIZE);
+	char *load_buffer = malloc(BENCH_LOAD_BUFFER);
+	struct bench_sink memory = {0};
+	memory.capacity = BENCH_BLOCK_SIZE * (BENCH_LOAD_CHANGES + 2);
+	memory.buffer = malloc(memory.capacity);
+	struct bench_sink file = {0};
+	file.file.destination = tmpfile();
+	if (!pvl_at || !main_block || !mirror || !load_buffer || !memory.buffer || !file.file.destination) {
+		fprintf(stderr, "bench: cannot allocate buffers\n");
+		return 1;
+	}
+	memset(main_block, 0, BENCH_BLOCK_SIZE);
+
+	bench_mark(pvl_at, main_block, &memory, "mark");
+	bench_mark(pvl_at, main_block, &memory, "mark_many");
+	bench_mark(pvl_at, main_block, &memory, "mark_view");
+	bench_commit(pvl_at, main_block, mirror, &memory, "memory", 0);
+	bench_commit(pvl_at, main_block, mirror, &file, "file", 0);
+	bench_commit(pvl_at, main_block, mirror, &memory, "memory", 1);
+	bench_load(pvl_at, main_block, &memory, "memory", NULL);
+	bench_load(pvl_at, main_block, &file, "file", NULL);
+	bench_load(pvl_at, main_block, &memory, "memory", load_buffer);
+	bench_load(pvl_at, main_block, &file, "file", load_buffer);
+	if (bench_json) {
+		printf("\n]\n");
+	}
+
+	fclose(file.file.destination);
+	free(memory.buffer);
+	free(load_buffer);
+	free(mirror);
+	free(main_block);
+	free(pvl_at);
+	return 0;
+}
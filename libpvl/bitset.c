@@ -8,6 +8,7 @@
 
 #include <limits.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "bitset.h"
 
@@ -25,9 +26,8 @@ void bitset_set_range(unsigned char *bitset, size_t from_pos, size_t to_pos) {
 		bitset[from_bucket] |= (size_t)(cbits[to_index - from_index]) << from_index;
 	} else {
 		bitset[from_bucket] |= (size_t)(cbits[7u - from_index]) << from_index;
-		for (size_t i = from_bucket+1; i < to_bucket; i++) {
-			bitset[i] = 255u;
-		}
+		/* Fill whole buckets at once */
+		memset(bitset + from_bucket + 1, 255, to_bucket - from_bucket - 1);
 		bitset[to_bucket] |= cbits[to_index];
 	}
 }
@@ -39,12 +39,10 @@ void bitset_clear_range(unsigned char *bitset, size_t from_pos, size_t to_pos) {
     size_t to_bucket = to_pos / CHAR_BIT;
     size_t to_index = to_pos % CHAR_BIT;
     if (from_bucket == to_bucket) {
-		bitset[from_bucket] &= ~(size_t)(cbits[to_index - from_index]) << from_index;
+		bitset[from_bucket] &= ~((size_t)(cbits[to_index - from_index]) << from_index);
 	} else {
-		bitset[from_bucket] &= ~(size_t)(cbits[7u - from_index]) << from_index;
-		for (size_t i = from_bucket+1; i < to_bucket; i++) {
-			bitset[i] = 0u;
-		}
+		bitset[from_bucket] &= ~((size_t)(cbits[7u - from_index]) << from_index);
+		memset(bitset + from_bucket + 1, 0, to_bucket - from_bucket - 1);
 		bitset[to_bucket] &= ~(size_t)cbits[to_index];
 	}
 }
@@ -0,0 +1,314 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * O_DIRECT journal handlers for libpvl (Linux, implementation)
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "direct.h"
+
+struct pvl_direct {
+	int fd;
+	size_t block_size;
+	size_t staging_size;
+	unsigned char *staging[2];
+	/* writing - the buffer being filled and the file offset it starts at */
+	size_t current;
+	size_t fill;
+	off_t offset;
+	off_t change_start;
+	_Bool in_change;
+	_Bool positioned;
+	/* background writer state, guarded by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t thread;
+	_Bool pending;
+	_Bool stopping;
+	size_t pending_buffer;
+	size_t pending_length;
+	off_t pending_offset;
+	int failed;
+	/* reading - the first staging buffer caches the file around read_pos */
+	off_t size;
+	off_t read_pos;
+	_Bool read_boundary;
+	off_t cache_offset;
+	size_t cache_length;
+};
+
+static off_t pvl_direct_align(struct pvl_direct *direct, off_t position);
+static int pvl_direct_pwrite(int fd, const unsigned char *from, size_t length, off_t position);
+static int pvl_direct_submit(struct pvl_direct *direct);
+static int pvl_direct_wait(struct pvl_direct *direct);
+static int pvl_direct_abort(struct pvl_direct *direct);
+static void *pvl_direct_writer(void *arg);
+
+size_t pvl_direct_sizeof(size_t staging_size) {
+	/* Two staging buffers and the slack for aligning them */
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	return sizeof(struct pvl_direct) + (2 * staging_size) + page_size;
+}
+
+struct pvl_direct *pvl_direct_open(char *at, const char *path, size_t block_size, size_t staging_size,
+		_Bool dsync) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	if ((path == NULL) || (block_size == 0) || (block_size & (block_size - 1))) {
+		return NULL;
+	}
+	if ((staging_size == 0) || (staging_size % block_size) || (staging_size % page_size)) {
+		return NULL; /* O_DIRECT transfers whole, aligned blocks */
+	}
+
+	struct pvl_direct *direct = (struct pvl_direct*) at;
+	memset(direct, 0, sizeof(struct pvl_direct));
+	direct->block_size = block_size;
+	direct->staging_size = staging_size;
+	uintptr_t buffers = (uintptr_t) (at + sizeof(struct pvl_direct));
+	buffers += (page_size - (buffers % page_size)) % page_size;
+	direct->staging[0] = (unsigned char*) buffers;
+	direct->staging[1] = direct->staging[0] + staging_size;
+	direct->read_boundary = 1;
+
+	pthread_mutex_init(&direct->lock, NULL);
+	pthread_cond_init(&direct->work, NULL);
+	pthread_cond_init(&direct->done, NULL);
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC | O_DIRECT | (dsync ? O_DSYNC : 0);
+	direct->fd = open(path, flags, 0600);
+	struct stat st;
+	if ((direct->fd < 0) || fstat(direct->fd, &st)
+			|| pthread_create(&direct->thread, NULL, pvl_direct_writer, direct)) {
+		pthread_cond_destroy(&direct->done);
+		pthread_cond_destroy(&direct->work);
+		pthread_mutex_destroy(&direct->lock);
+		close(direct->fd); /* fails harmlessly when the open did */
+		return NULL;
+	}
+	/* Append after the existing changes unless they are read first */
+	direct->size = st.st_size;
+	direct->offset = pvl_direct_align(direct, st.st_size);
+	return direct;
+}
+
+int pvl_direct_close(struct pvl_direct *direct) {
+	if (direct == NULL) {
+		return 1;
+	}
+	int result = pvl_direct_wait(direct);
+	pthread_mutex_lock(&direct->lock);
+	direct->stopping = 1;
+	pthread_cond_broadcast(&direct->work);
+	pthread_mutex_unlock(&direct->lock);
+	pthread_join(direct->thread, NULL);
+	pthread_cond_destroy(&direct->done);
+	pthread_cond_destroy(&direct->work);
+	pthread_mutex_destroy(&direct->lock);
+	result |= close(direct->fd) != 0;
+	return result;
+}
+
+int pvl_direct_write(void *ctx, void *from, size_t length, size_t remaining) {
+	if ((ctx == NULL) || (from == NULL) || (length == 0)) {
+		return 1;
+	}
+	struct pvl_direct *direct = (struct pvl_direct*)(ctx);
+
+	if (! direct->in_change) {
+		/* Discard anything past the last change that was read */
+		if (! direct->positioned) {
+			if (ftruncate(direct->fd, direct->offset)) {
+				return 1;
+			}
+			direct->positioned = 1;
+		}
+		direct->change_start = direct->offset;
+		direct->in_change = 1;
+	}
+
+	/* Pack the record into the staging buffers */
+	const unsigned char *bytes = (const unsigned char*) from;
+	while (length) {
+		size_t chunk = direct->staging_size - direct->fill;
+		if (chunk > length) {
+			chunk = length;
+		}
+		memcpy(direct->staging[direct->current] + direct->fill, bytes, chunk);
+		direct->fill += chunk;
+		bytes += chunk;
+		length -= chunk;
+		if ((direct->fill == direct->staging_size) && pvl_direct_submit(direct)) {
+			return pvl_direct_abort(direct);
+		}
+	}
+	if (remaining) {
+		return 0;
+	}
+
+	/* Pad the change to the block size and write it out before returning */
+	size_t padded = (size_t) pvl_direct_align(direct, (off_t) direct->fill);
+	memset(direct->staging[direct->current] + direct->fill, 0, padded - direct->fill);
+	direct->fill = padded;
+	if (pvl_direct_submit(direct) || pvl_direct_wait(direct)) {
+		return pvl_direct_abort(direct);
+	}
+	direct->in_change = 0;
+	return 0;
+}
+
+int pvl_direct_read(void *ctx, void *to, size_t length, size_t remaining) {
+	if (ctx == NULL) {
+		return 1;
+	}
+	struct pvl_direct *direct = (struct pvl_direct*)(ctx);
+
+	/* Check that the rest of the change is present */
+	if (to == NULL) {
+		return (direct->read_pos + (off_t) remaining) > direct->size;
+	}
+
+	/* Each change starts on a block boundary, appending resumes at the last one */
+	_Bool header = direct->read_boundary;
+	if (header) {
+		direct->read_pos = pvl_direct_align(direct, direct->read_pos);
+		direct->offset = direct->read_pos;
+		direct->read_boundary = 0;
+	}
+	if ((direct->read_pos + (off_t) length) > direct->size) {
+		return header ? EOF : 1;
+	}
+
+	unsigned char *bytes = (unsigned char*) to;
+	while (length) {
+		if ((direct->read_pos < direct->cache_offset)
+				|| (direct->read_pos >= (direct->cache_offset + (off_t) direct->cache_length))) {
+			off_t aligned = direct->read_pos - (direct->read_pos % (off_t) direct->block_size);
+			ssize_t done = pread(direct->fd, direct->staging[0], direct->staging_size, aligned);
+			if (done <= (ssize_t) (direct->read_pos - aligned)) {
+				return 1; /* the file shrank since it was opened */
+			}
+			direct->cache_offset = aligned;
+			direct->cache_length = (size_t) done;
+		}
+		size_t available = (size_t) (direct->cache_offset + (off_t) direct->cache_length - direct->read_pos);
+		size_t chunk = (available < length) ? available : length;
+		memcpy(bytes, direct->staging[0] + (direct->read_pos - direct->cache_offset), chunk);
+		bytes += chunk;
+		length -= chunk;
+		direct->read_pos += (off_t) chunk;
+	}
+
+	/* The last read of a change is followed by the padding and the next change */
+	if ((! header) && (remaining == 0)) {
+		direct->read_boundary = 1;
+	}
+	return 0;
+}
+
+/* Round a position up to the block size */
+static off_t pvl_direct_align(struct pvl_direct *direct, off_t position) {
+	off_t block = (off_t) direct->block_size;
+	return ((position + block - 1) / block) * block;
+}
+
+static int pvl_direct_pwrite(int fd, const unsigned char *from, size_t length, off_t position) {
+	while (length) {
+		ssize_t done = pwrite(fd, from, length, position);
+		if (done <= 0) {
+			return 1;
+		}
+		from += done;
+		length -= (size_t) done;
+		position += done;
+	}
+	return 0;
+}
+
+/* Hand the filled part of the current buffer to the writer and switch buffers */
+static int pvl_direct_submit(struct pvl_direct *direct) {
+	if (direct->fill == 0) {
+		return 0;
+	}
+	/* Only one buffer is written at a time */
+	if (pvl_direct_wait(direct)) {
+		return 1;
+	}
+	pthread_mutex_lock(&direct->lock);
+	direct->pending = 1;
+	direct->pending_buffer = direct->current;
+	direct->pending_length = direct->fill;
+	direct->pending_offset = direct->offset;
+	pthread_cond_broadcast(&direct->work);
+	pthread_mutex_unlock(&direct->lock);
+
+	direct->offset += (off_t) direct->fill;
+	direct->current ^= 1;
+	direct->fill = 0;
+	return 0;
+}
+
+/* Wait for the pending write and return its result */
+static int pvl_direct_wait(struct pvl_direct *direct) {
+	pthread_mutex_lock(&direct->lock);
+	while (direct->pending) {
+		pthread_cond_wait(&direct->done, &direct->lock);
+	}
+	int failed = direct->failed;
+	direct->failed = 0;
+	pthread_mutex_unlock(&direct->lock);
+	return failed;
+}
+
+/* Drop a failed change so that it is written anew from its start */
+static int pvl_direct_abort(struct pvl_direct *direct) {
+	pvl_direct_wait(direct);
+	if (ftruncate(direct->fd, direct->change_start) == 0) {
+		direct->positioned = 1;
+	}
+	direct->offset = direct->change_start;
+	direct->fill = 0;
+	direct->in_change = 0;
+	return 1;
+}
+
+static void *pvl_direct_writer(void *arg) {
+	struct pvl_direct *direct = (struct pvl_direct*) arg;
+	pthread_mutex_lock(&direct->lock);
+	while (1) {
+		while ((! direct->pending) && (! direct->stopping)) {
+			pthread_cond_wait(&direct->work, &direct->lock);
+		}
+		if (! direct->pending) {
+			break;
+		}
+		const unsigned char *from = direct->staging[direct->pending_buffer];
+		size_t length = direct->pending_length;
+		off_t offset = direct->pending_offset;
+		pthread_mutex_unlock(&direct->lock);
+		int result = pvl_direct_pwrite(direct->fd, from, length, offset);
+		pthread_mutex_lock(&direct->lock);
+		direct->failed |= result;
+		direct->pending = 0;
+		pthread_cond_broadcast(&direct->done);
+	}
+	pthread_mutex_unlock(&direct->lock);
+	return NULL;
+}
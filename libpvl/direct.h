@@ -0,0 +1,55 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * O_DIRECT journal handlers for libpvl (Linux)
+ *
+ * The FILE journal handlers go through the page cache, whose writeback
+ * competes with the pvl-managed memory under memory pressure. The direct
+ * journal opens its file with O_DIRECT and packs changes into page-aligned
+ * staging buffers. A full buffer is written by a background thread while the
+ * other one is filled, and each change is padded to the block size and
+ * written before its commit completes. Reading skips the padding.
+ *
+ * Pass the same direct journal to pvl_set_read_cb with pvl_direct_read and
+ * to pvl_set_write_cb with pvl_direct_write. Appending starts after the last
+ * change that was read, discarding anything past it.
+ */
+#pragma once
+
+#include <stddef.h>
+
+struct pvl_direct;
+
+/* Returns the size of a direct journal with staging buffers of staging_size bytes */
+size_t pvl_direct_sizeof(size_t staging_size);
+
+/*
+ * Open a direct journal at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the direct journal should be initialized
+ * path               - Path to the journal file, created if missing
+ * block_size         - The block size of the device, a power of two that
+ *                      changes are padded to
+ * staging_size       - The size of each staging buffer, a multiple of
+ *                      block_size and of the page size
+ * dsync              - Open with O_DSYNC so that commits are durable on return
+ *
+ * Returns
+ * pvl_direct*        - A valid pointer in the case of success, NULL otherwise.
+ */
+struct pvl_direct *pvl_direct_open(char *at, const char *path, size_t block_size, size_t staging_size,
+		_Bool dsync);
+
+/* Stop the background writer and close the journal file */
+int pvl_direct_close(struct pvl_direct *direct);
+
+/* Write handler, see write_callback in pvl.h */
+int pvl_direct_write(void *ctx, void *from, size_t length, size_t remaining);
+
+/* Read handler, see read_callback in pvl.h */
+int pvl_direct_read(void *ctx, void *to, size_t length, size_t remaining);
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Background flusher for libpvl (implementation)
+ */
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "flusher.h"
+#include "pvl.h"
+
+struct pvl_flusher {
+	struct pvl *pvl;
+	pthread_t thread;
+	uint64_t interval;
+	/* background thread state, guarded by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	_Bool started;
+	_Bool stopping;
+	int failed;
+};
+
+static void *pvl_flusher_worker(void *arg);
+
+size_t pvl_flusher_sizeof(void) {
+	return sizeof(struct pvl_flusher);
+}
+
+struct pvl_flusher *pvl_flusher_init(char *at, struct pvl *pvl) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if (pvl == NULL) {
+		return NULL;
+	}
+
+	struct pvl_flusher *flusher = (struct pvl_flusher*) at;
+	memset(flusher, 0, sizeof(struct pvl_flusher));
+	flusher->pvl = pvl;
+
+	/* Timed waits use the monotonic clock like pvl_tick */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&flusher->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&flusher->lock, NULL);
+	return flusher;
+}
+
+int pvl_flusher_start(struct pvl_flusher *flusher, uint64_t interval) {
+	if (flusher == NULL) {
+		return 1;
+	}
+	if (flusher->started || (interval == 0)) {
+		return 1;
+	}
+	flusher->interval = interval;
+	flusher->started = pthread_create(&flusher->thread, NULL, pvl_flusher_worker, flusher) == 0;
+	return ! flusher->started;
+}
+
+int pvl_flusher_stop(struct pvl_flusher *flusher) {
+	if (flusher == NULL) {
+		return 1;
+	}
+	pthread_mutex_lock(&flusher->lock);
+	flusher->stopping = 1;
+	pthread_cond_broadcast(&flusher->wake);
+	pthread_mutex_unlock(&flusher->lock);
+	if (flusher->started) {
+		pthread_join(flusher->thread, NULL);
+	}
+	flusher->started = 0;
+	pthread_cond_destroy(&flusher->wake);
+	pthread_mutex_destroy(&flusher->lock);
+	return flusher->failed;
+}
+
+void pvl_flusher_lock(struct pvl_flusher *flusher) {
+	pthread_mutex_lock(&flusher->lock);
+}
+
+void pvl_flusher_unlock(struct pvl_flusher *flusher) {
+	pthread_mutex_unlock(&flusher->lock);
+}
+
+int pvl_flusher_mark(struct pvl_flusher *flusher, const char *start, size_t length) {
+	if (flusher == NULL) {
+		return 1;
+	}
+	pthread_mutex_lock(&flusher->lock);
+	int result = pvl_mark(flusher->pvl, start, length);
+	pthread_mutex_unlock(&flusher->lock);
+	return result;
+}
+
+int pvl_flusher_commit(struct pvl_flusher *flusher) {
+	if (flusher == NULL) {
+		return 1;
+	}
+	pthread_mutex_lock(&flusher->lock);
+	int result = pvl_commit(flusher->pvl);
+	pthread_mutex_unlock(&flusher->lock);
+	return result;
+}
+
+static void *pvl_flusher_worker(void *arg) {
+	struct pvl_flusher *flusher = (struct pvl_flusher*) arg;
+	pthread_mutex_lock(&flusher->lock);
+	while (! flusher->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		uint64_t nsec = (uint64_t)deadline.tv_nsec + flusher->interval;
+		deadline.tv_sec += (time_t)(nsec / 1000000000u);
+		deadline.tv_nsec = (long)(nsec % 1000000000u);
+		pthread_cond_timedwait(&flusher->wake, &flusher->lock, &deadline);
+		flusher->failed |= pvl_tick(flusher->pvl);
+	}
+	pthread_mutex_unlock(&flusher->lock);
+	return NULL;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Background flusher for libpvl
+ *
+ * A pvl instance with an auto-commit max age only commits aged marks when
+ * pvl_tick is called. The flusher calls it from a background thread at a
+ * fixed interval so that the loss window is bounded without domain code
+ * having to poll.
+ *
+ * A pvl instance is not thread-safe. Once the flusher is started mark and
+ * commit through it, or hold its lock around any other use of the instance.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pvl.h"
+
+struct pvl_flusher;
+
+/* Returns the size of a flusher */
+size_t pvl_flusher_sizeof(void);
+
+/*
+ * Initialize a flusher for a pvl instance at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ */
+struct pvl_flusher *pvl_flusher_init(char *at, struct pvl *pvl);
+
+/* Start the background thread, calling pvl_tick every interval nanoseconds */
+int pvl_flusher_start(struct pvl_flusher *flusher, uint64_t interval);
+
+/*
+ * Stop the background thread and release its resources.
+ *
+ * Returns non-zero if a background commit has failed.
+ */
+int pvl_flusher_stop(struct pvl_flusher *flusher);
+
+/*
+ * Hold the flusher's lock for using the pvl instance directly. Marks made
+ * while holding it are not split by a background commit.
+ */
+void pvl_flusher_lock(struct pvl_flusher *flusher);
+
+/* Release the flusher's lock */
+void pvl_flusher_unlock(struct pvl_flusher *flusher);
+
+/* Mark a span of memory with the flusher's lock held */
+int pvl_flusher_mark(struct pvl_flusher *flusher, const char *start, size_t length);
+
+/* Commit with the flusher's lock held */
+int pvl_flusher_commit(struct pvl_flusher *flusher);
@@ -40,8 +40,29 @@ int pvl_journal_read(void *ctx, void *to, size_t length, size_t remaining) {
 	if (! config->destination) {
 		return 1;
 	}
-	(void)(to);
-	(void)(length);
-	(void)(remaining);
+
+	/* Check that the rest of the change is present */
+	if (to == NULL) {
+		long position = ftell(config->destination);
+		long end = -1;
+		if ((position >= 0) && (fseek(config->destination, 0, SEEK_END) == 0)) {
+			end = ftell(config->destination);
+		}
+		if ((end < 0) || fseek(config->destination, position, SEEK_SET)) {
+			return 1; /* e.g. a pipe */
+		}
+		return (size_t)(end - position) < remaining;
+	}
+
+	/* Rewind a partial read so that a journal that is being appended to can be polled */
+	size_t done = fread(to, 1, length, config->destination);
+	if (done != length) {
+		int result = feof(config->destination) ? EOF : 1;
+		clearerr(config->destination);
+		if (done && fseek(config->destination, -(long) done, SEEK_CUR)) {
+			return 1;
+		}
+		return result;
+	}
 	return 0;
 }
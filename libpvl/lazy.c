@@ -0,0 +1,280 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Lazy restore for libpvl (Linux, implementation)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "lazy.h"
+
+/* A byte range of main and where its newest contents live */
+struct pvl_lazy_piece {
+	size_t start;
+	size_t end;
+	size_t origin; /* the offset that source and pattern are relative to */
+	off_t source; /* journal position of the content at origin */
+	unsigned char pattern[sizeof(uint64_t)];
+	size_t pattern_size; /* zero for content in the journal */
+};
+
+struct pvl_lazy {
+	FILE *journal;
+	char *main;
+	size_t length;
+	size_t page_size;
+	/* page buffer of the restoring thread */
+	unsigned char *page;
+	int uffd;
+	pthread_t worker;
+	_Bool started;
+	atomic_int failed;
+	/* sorted, disjoint pieces */
+	size_t capacity;
+	size_t count;
+	struct pvl_lazy_piece pieces[];
+};
+
+static size_t pvl_lazy_find(struct pvl_lazy *lazy, size_t offset);
+static int pvl_lazy_insert(struct pvl_lazy *lazy, struct pvl_lazy_piece piece);
+static int pvl_lazy_pread(int fd, unsigned char *to, size_t length, off_t position);
+static void pvl_lazy_fill(struct pvl_lazy *lazy, size_t offset, unsigned char *page);
+static void *pvl_lazy_worker(void *arg);
+
+size_t pvl_lazy_sizeof(size_t capacity) {
+	/* A page buffer and the slack for aligning it */
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	return sizeof(struct pvl_lazy) + (capacity * sizeof(struct pvl_lazy_piece)) + (2 * page_size);
+}
+
+struct pvl_lazy *pvl_lazy_init(char *at, size_t capacity, FILE *journal, char *main, size_t length) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if ((journal == NULL) || (main == NULL) || (length == 0)) {
+		return NULL;
+	}
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	if ((((uintptr_t) main) % page_size) || (length % page_size)) {
+		return NULL; /* userfaultfd works on whole pages */
+	}
+
+	struct pvl_lazy *lazy = (struct pvl_lazy*) at;
+	memset(lazy, 0, sizeof(struct pvl_lazy));
+	lazy->journal = journal;
+	lazy->main = main;
+	lazy->length = length;
+	lazy->page_size = page_size;
+	lazy->capacity = capacity;
+	lazy->uffd = -1;
+	atomic_init(&lazy->failed, 0);
+
+	uintptr_t page = (uintptr_t) &lazy->pieces[capacity];
+	lazy->page = (unsigned char*) (page + ((page_size - (page % page_size)) % page_size));
+	return lazy;
+}
+
+int pvl_lazy_index(void *ctx, size_t offset, size_t length, const unsigned char *pattern,
+		size_t pattern_size, size_t remaining) {
+	(void)(remaining);
+	struct pvl_lazy *lazy = (struct pvl_lazy*) ctx;
+	if (lazy == NULL) {
+		return 1;
+	}
+	if ((offset >= lazy->length) || (length > (lazy->length - offset))) {
+		return 1; /* only the first region is restored */
+	}
+	if (pattern_size > sizeof(uint64_t)) {
+		return 1;
+	}
+
+	struct pvl_lazy_piece piece = {offset, offset + length, offset, 0, {0}, pattern_size};
+	if (pattern) {
+		memcpy(piece.pattern, pattern, pattern_size);
+		return pvl_lazy_insert(lazy, piece);
+	}
+
+	/* Remember where the content is and skip over it */
+	off_t position = ftello(lazy->journal);
+	if ((position < 0) || fseeko(lazy->journal, (off_t) length, SEEK_CUR)) {
+		return 1;
+	}
+	piece.source = position;
+	return pvl_lazy_insert(lazy, piece);
+}
+
+int pvl_lazy_start(struct pvl_lazy *lazy) {
+	if (lazy == NULL) {
+		return 1;
+	}
+	if (lazy->uffd >= 0) {
+		return 1; /* already started, or failed to start */
+	}
+
+	/* The userfaultfd is closed by pvl_lazy_stop, which releases the faults that are not served */
+	lazy->uffd = (int) syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	struct uffdio_api api = {.api = UFFD_API, .features = 0};
+	struct uffdio_register reg = {
+		.range = {.start = (uintptr_t) lazy->main, .len = lazy->length},
+		.mode = UFFDIO_REGISTER_MODE_MISSING
+	};
+	if ((lazy->uffd < 0) || ioctl(lazy->uffd, UFFDIO_API, &api) || ioctl(lazy->uffd, UFFDIO_REGISTER, &reg)) {
+		return 1;
+	}
+	lazy->started = pthread_create(&lazy->worker, NULL, pvl_lazy_worker, lazy) == 0;
+	return ! lazy->started;
+}
+
+int pvl_lazy_stop(struct pvl_lazy *lazy) {
+	if (lazy == NULL) {
+		return 1;
+	}
+	if (lazy->started) {
+		pthread_join(lazy->worker, NULL);
+		lazy->started = 0;
+	}
+	if (lazy->uffd >= 0) {
+		close(lazy->uffd);
+		lazy->uffd = -1;
+	}
+	return atomic_load(&lazy->failed);
+}
+
+/* Returns the index of the first piece that ends after offset */
+static size_t pvl_lazy_find(struct pvl_lazy *lazy, size_t offset) {
+	size_t low = 0;
+	size_t high = lazy->count;
+	while (low < high) {
+		size_t mid = low + ((high - low) / 2);
+		if (lazy->pieces[mid].end > offset) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return low;
+}
+
+/* Insert a piece over the older pieces it overlaps, keeping their non-overlapped parts */
+static int pvl_lazy_insert(struct pvl_lazy *lazy, struct pvl_lazy_piece piece) {
+	size_t first = pvl_lazy_find(lazy, piece.start);
+	size_t last = first;
+	while ((last < lazy->count) && (lazy->pieces[last].start < piece.end)) {
+		last++;
+	}
+
+	struct pvl_lazy_piece left = {0};
+	struct pvl_lazy_piece right = {0};
+	_Bool has_left = 0;
+	_Bool has_right = 0;
+	if (last > first) {
+		left = lazy->pieces[first];
+		right = lazy->pieces[last - 1];
+		has_left = left.start < piece.start;
+		has_right = right.end > piece.end;
+	}
+	size_t inserted = 1 + has_left + has_right;
+	if ((lazy->count - (last - first) + inserted) > lazy->capacity) {
+		return 1; /* index is full */
+	}
+
+	memmove(&lazy->pieces[first + inserted], &lazy->pieces[last],
+			(lazy->count - last) * sizeof(struct pvl_lazy_piece));
+	lazy->count = lazy->count - (last - first) + inserted;
+	if (has_left) {
+		left.end = piece.start;
+		lazy->pieces[first++] = left;
+	}
+	lazy->pieces[first++] = piece;
+	if (has_right) {
+		right.start = piece.end;
+		lazy->pieces[first] = right;
+	}
+	return 0;
+}
+
+static int pvl_lazy_pread(int fd, unsigned char *to, size_t length, off_t position) {
+	while (length) {
+		ssize_t done;
+		do {
+			done = pread(fd, to, length, position);
+		} while ((done < 0) && (errno == EINTR));
+		if (done <= 0) {
+			return 1;
+		}
+		to += done;
+		length -= (size_t) done;
+		position += done;
+	}
+	return 0;
+}
+
+/* Assemble the page at offset from the index and copy it into main */
+static void pvl_lazy_fill(struct pvl_lazy *lazy, size_t offset, unsigned char *page) {
+	size_t page_end = offset + lazy->page_size;
+	int fd = fileno(lazy->journal);
+	_Bool failed = 0;
+	memset(page, 0, lazy->page_size);
+	for (size_t i = pvl_lazy_find(lazy, offset); (i < lazy->count) && (lazy->pieces[i].start < page_end); i++) {
+		struct pvl_lazy_piece *piece = &lazy->pieces[i];
+		size_t from = (piece->start > offset) ? piece->start : offset;
+		size_t to = (piece->end < page_end) ? piece->end : page_end;
+		unsigned char *at = page + (from - offset);
+		if (piece->pattern_size) {
+			for (size_t k = from; k < to; k++) {
+				at[k - from] = piece->pattern[(k - piece->origin) % piece->pattern_size];
+			}
+		} else {
+			failed |= pvl_lazy_pread(fd, at, to - from, piece->source + (off_t) (from - piece->origin)) != 0;
+		}
+	}
+
+	/* The page may have already been restored on its first access */
+	struct uffdio_copy copy = {
+		.dst = (uintptr_t) (lazy->main + offset),
+		.src = (uintptr_t) page,
+		.len = lazy->page_size,
+		.mode = 0
+	};
+	failed |= ioctl(lazy->uffd, UFFDIO_COPY, &copy) && (errno != EEXIST);
+	if (failed) {
+		atomic_store(&lazy->failed, 1);
+	}
+}
+
+/* Serve page faults on main and restore the other pages in order until every page is restored */
+static void *pvl_lazy_worker(void *arg) {
+	struct pvl_lazy *lazy = (struct pvl_lazy*) arg;
+	size_t next = 0;
+	while (next < lazy->length) {
+		/* Pending faults come first */
+		struct pollfd pfd = {.fd = lazy->uffd, .events = POLLIN, .revents = 0};
+		struct uffd_msg msg;
+		if ((poll(&pfd, 1, 0) > 0) && (read(lazy->uffd, &msg, sizeof(msg)) == (ssize_t) sizeof(msg))
+				&& (msg.event == UFFD_EVENT_PAGEFAULT)) {
+			size_t offset = (size_t) (msg.arg.pagefault.address - (uintptr_t) lazy->main);
+			pvl_lazy_fill(lazy, offset - (offset % lazy->page_size), lazy->page);
+		} else {
+			pvl_lazy_fill(lazy, next, lazy->page);
+			next += lazy->page_size;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Lazy restore for libpvl (Linux)
+ *
+ * Loading replays the whole journal into main before the caller can use it.
+ * A lazy restore instead indexes where the newest contents of every byte
+ * of main live in the journal while loading, registers main with
+ * userfaultfd and fills each page on its first access. The same background
+ * thread prefetches the other pages in order while no faults are pending,
+ * so that main is eventually fully restored.
+ *
+ * Usage
+ * - Map main as anonymous private memory and do not touch it before
+ *   calling pvl_lazy_start, pages that are already present are not restored.
+ * - Pass pvl_lazy_index to pvl_set_restore_cb with the lazy restore as its
+ *   context, then load with pvl_set_read_cb and pvl_journal_read over the
+ *   same journal FILE.
+ * - Call pvl_lazy_start before accessing main and pvl_lazy_stop once
+ *   main is no longer accessed or should be fully restored.
+ *
+ * Only single-region pvl instances are supported. The journal must not be
+ * truncated or rewritten until pvl_lazy_stop returns.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct pvl_lazy;
+
+/* Returns the size of a lazy restore with an index of up to capacity pieces */
+size_t pvl_lazy_sizeof(size_t capacity);
+
+/*
+ * Initialize a lazy restore at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the lazy restore should be initialized
+ * capacity           - The number of distinct pieces the index can hold. Each
+ *                      span that is only partially overwritten by a later one
+ *                      may take up to two more.
+ * journal            - The journal FILE that the pvl instance is loaded from
+ * main               - Pointer to the start of the pvl-managed memory block,
+ *                      aligned to the page size
+ * length             - The length of the pvl-managed memory block,
+ *                      a multiple of the page size
+ *
+ * Returns
+ * pvl_lazy*          - A valid pointer in the case of a successful initialization,
+ *                      NULL otherwise.
+ */
+struct pvl_lazy *pvl_lazy_init(char *at, size_t capacity, FILE *journal, char *main, size_t length);
+
+/* Restore handler that indexes spans, see restore_callback in pvl.h */
+int pvl_lazy_index(void *ctx, size_t offset, size_t length, const unsigned char *pattern,
+		size_t pattern_size, size_t remaining);
+
+/*
+ * Register main with userfaultfd and start the background thread that serves
+ * faults and prefetches pages. Call pvl_lazy_stop after a failed start too.
+ */
+int pvl_lazy_start(struct pvl_lazy *lazy);
+
+/*
+ * Wait for the background thread to restore every page, then release the
+ * resources of the lazy restore.
+ *
+ * Returns non-zero if a page could not be read from the journal.
+ */
+int pvl_lazy_stop(struct pvl_lazy *lazy);
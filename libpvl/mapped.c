@@ -0,0 +1,268 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Memory-mapped journal handlers for libpvl (Linux, implementation)
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mapped.h"
+
+struct pvl_mapped {
+	int fd;
+	unsigned char *map;
+	size_t size;
+	size_t page_size;
+	_Bool sync;
+	/* writing - the append cursor and the change being copied */
+	size_t cursor;
+	size_t change_start;
+	size_t synced;
+	unsigned char header[2 * sizeof(size_t)];
+	size_t header_length;
+	_Bool in_change;
+	_Bool positioned;
+	/* reading */
+	size_t read_pos;
+	_Bool read_boundary;
+	_Bool read;
+};
+
+static int pvl_mapped_position(struct pvl_mapped *mapped);
+static int pvl_mapped_grow(struct pvl_mapped *mapped, size_t needed);
+static int pvl_mapped_msync(struct pvl_mapped *mapped, size_t from, size_t to);
+static int pvl_mapped_abort(struct pvl_mapped *mapped);
+
+size_t pvl_mapped_sizeof(void) {
+	return sizeof(struct pvl_mapped);
+}
+
+struct pvl_mapped *pvl_mapped_open(char *at, const char *path, size_t reserve, _Bool sync) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if ((path == NULL) || (reserve == 0)) {
+		return NULL;
+	}
+
+	struct pvl_mapped *mapped = (struct pvl_mapped*) at;
+	memset(mapped, 0, sizeof(struct pvl_mapped));
+	mapped->page_size = (size_t) sysconf(_SC_PAGESIZE);
+	mapped->sync = sync;
+	mapped->read_boundary = 1;
+
+	mapped->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	struct stat st;
+	if ((mapped->fd < 0) || fstat(mapped->fd, &st)) {
+		close(mapped->fd); /* fails harmlessly when the open did */
+		return NULL;
+	}
+
+	/* Preallocate the file to whole pages of at least reserve bytes */
+	size_t size = ((size_t) st.st_size > reserve) ? (size_t) st.st_size : reserve;
+	size = ((size + mapped->page_size - 1) / mapped->page_size) * mapped->page_size;
+	mapped->map = posix_fallocate(mapped->fd, 0, (off_t) size) ? MAP_FAILED
+		: mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mapped->fd, 0);
+	if (mapped->map == MAP_FAILED) {
+		close(mapped->fd);
+		return NULL;
+	}
+	mapped->size = size;
+	return mapped;
+}
+
+int pvl_mapped_close(struct pvl_mapped *mapped) {
+	if (mapped == NULL) {
+		return 1;
+	}
+	int result = pvl_mapped_sync(mapped);
+	result |= munmap(mapped->map, mapped->size) != 0;
+	result |= close(mapped->fd) != 0;
+	return result;
+}
+
+int pvl_mapped_write(void *ctx, void *from, size_t length, size_t remaining) {
+	if ((ctx == NULL) || (from == NULL) || (length == 0)) {
+		return 1;
+	}
+	struct pvl_mapped *mapped = (struct pvl_mapped*)(ctx);
+	const unsigned char *bytes = (const unsigned char*) from;
+
+	if (! mapped->in_change) {
+		/* Discard anything past the last complete change */
+		if ((! mapped->positioned) && pvl_mapped_position(mapped)) {
+			return 1;
+		}
+		if (length > sizeof(mapped->header)) {
+			return 1;
+		}
+		/* Make room for the whole change up front, the mapping may move */
+		size_t needed = mapped->cursor + length + remaining;
+		if ((needed > mapped->size) && pvl_mapped_grow(mapped, needed)) {
+			return 1;
+		}
+
+		/* The header is copied last, once the rest of the change is in place */
+		memcpy(mapped->header, bytes, length);
+		mapped->header_length = length;
+		mapped->change_start = mapped->cursor;
+		mapped->cursor += length;
+		mapped->in_change = 1;
+		bytes += length;
+		length = 0;
+	}
+
+	/* A change that is longer than announced fails */
+	int failed = length > (mapped->size - mapped->cursor);
+	if (! failed) {
+		memcpy(mapped->map + mapped->cursor, bytes, length);
+		mapped->cursor += length;
+	}
+	if ((! failed) && remaining) {
+		return 0;
+	}
+
+	/* Copy the header once the content is in place, and synced when requested */
+	size_t content = mapped->change_start + mapped->header_length;
+	failed = failed || (mapped->sync && pvl_mapped_msync(mapped, content, mapped->cursor));
+	if (! failed) {
+		memcpy(mapped->map + mapped->change_start, mapped->header, mapped->header_length);
+		failed = mapped->sync && pvl_mapped_msync(mapped, mapped->change_start, content);
+	}
+	if (failed) {
+		return pvl_mapped_abort(mapped);
+	}
+	if (mapped->sync) {
+		mapped->synced = mapped->cursor;
+	}
+	mapped->in_change = 0;
+	return 0;
+}
+
+int pvl_mapped_read(void *ctx, void *to, size_t length, size_t remaining) {
+	if (ctx == NULL) {
+		return 1;
+	}
+	struct pvl_mapped *mapped = (struct pvl_mapped*)(ctx);
+
+	/* Check that the rest of the change is present */
+	if (to == NULL) {
+		return remaining > (mapped->size - mapped->read_pos);
+	}
+
+	if (mapped->read_boundary) {
+		/* Appending resumes at the last change header that was looked for */
+		mapped->cursor = mapped->read_pos;
+		mapped->read = 1;
+		if (length > (mapped->size - mapped->read_pos)) {
+			return EOF;
+		}
+		/* A zero header is the unused tail of the journal */
+		const unsigned char *header = mapped->map + mapped->read_pos;
+		size_t i = 0;
+		while ((i < length) && (header[i] == 0)) {
+			i++;
+		}
+		if (i == length) {
+			return EOF;
+		}
+		memcpy(to, header, length);
+		mapped->read_pos += length;
+		mapped->read_boundary = 0;
+		return 0;
+	}
+
+	if (length > (mapped->size - mapped->read_pos)) {
+		return 1;
+	}
+	memcpy(to, mapped->map + mapped->read_pos, length);
+	mapped->read_pos += length;
+
+	/* The last read of a change is followed by the next change header */
+	if (remaining == 0) {
+		mapped->read_boundary = 1;
+	}
+	return 0;
+}
+
+int pvl_mapped_sync(struct pvl_mapped *mapped) {
+	if (mapped == NULL) {
+		return 1;
+	}
+	int result = (mapped->synced < mapped->cursor) && pvl_mapped_msync(mapped, mapped->synced, mapped->cursor);
+	mapped->synced = result ? mapped->synced : mapped->cursor;
+	return result;
+}
+
+/* Find the end of the complete changes and zero anything past it */
+static int pvl_mapped_position(struct pvl_mapped *mapped) {
+	if (! mapped->read) {
+		/* Walk the change headers - the span count and the content size */
+		size_t header[2];
+		size_t cursor = 0;
+		while (sizeof(header) <= (mapped->size - cursor)) {
+			memcpy(header, mapped->map + cursor, sizeof(header));
+			if (((header[0] == 0) && (header[1] == 0))
+					|| (header[1] > (mapped->size - cursor - sizeof(header)))) {
+				break;
+			}
+			cursor += sizeof(header) + header[1];
+		}
+		mapped->cursor = cursor;
+		/* A failed preallocation below leaves the file short of the mapping, do not walk it again */
+		mapped->read = 1;
+	}
+
+	/* Drop the blocks past the cursor and preallocate them anew */
+	if (ftruncate(mapped->fd, (off_t) mapped->cursor)
+			|| posix_fallocate(mapped->fd, 0, (off_t) mapped->size)) {
+		return 1;
+	}
+	mapped->synced = mapped->cursor;
+	mapped->positioned = 1;
+	return 0;
+}
+
+/* Double the file and the mapping until needed bytes fit */
+static int pvl_mapped_grow(struct pvl_mapped *mapped, size_t needed) {
+	size_t size = mapped->size;
+	while (size < needed) {
+		size *= 2;
+	}
+	void *map = posix_fallocate(mapped->fd, 0, (off_t) size) ? MAP_FAILED
+		: mremap(mapped->map, mapped->size, size, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED) {
+		return 1;
+	}
+	mapped->map = (unsigned char*) map;
+	mapped->size = size;
+	return 0;
+}
+
+/* msync the pages that hold the range from..to */
+static int pvl_mapped_msync(struct pvl_mapped *mapped, size_t from, size_t to) {
+	size_t start = from - (from % mapped->page_size);
+	return msync(mapped->map + start, to - start, MS_SYNC) != 0;
+}
+
+/* Drop a failed change so that it is written anew from its start */
+static int pvl_mapped_abort(struct pvl_mapped *mapped) {
+	memset(mapped->map + mapped->change_start, 0, mapped->cursor - mapped->change_start);
+	mapped->cursor = mapped->change_start;
+	mapped->in_change = 0;
+	return 1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Memory-mapped journal handlers for libpvl (Linux)
+ *
+ * The mapped journal maps a preallocated journal file with MAP_SHARED and
+ * copies each change into the mapping at an append cursor, so that a commit
+ * costs a memcpy rather than a system call. The file and the mapping are
+ * doubled with posix_fallocate and mremap when a change does not fit.
+ *
+ * Each change header is copied after the change content and the unused tail
+ * of the file reads as zeros, so that a change that was not completely
+ * copied when the process crashed reads as the end of the journal. Changes
+ * reach the disk on msync of the written range - on every commit when opened
+ * with sync, or for a whole batch of commits on pvl_mapped_sync. A power
+ * loss can tear the changes written since the last sync.
+ *
+ * Pass the same mapped journal to pvl_set_read_cb with pvl_mapped_read and
+ * to pvl_set_write_cb with pvl_mapped_write. Appending starts after the last
+ * change that was read, or after the last complete change in the file.
+ */
+#pragma once
+
+#include <stddef.h>
+
+struct pvl_mapped;
+
+/* Returns the size of a mapped journal */
+size_t pvl_mapped_sizeof(void);
+
+/*
+ * Open a mapped journal at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the mapped journal should be initialized
+ * path               - Path to the journal file, created if missing
+ * reserve            - The size that the journal file is preallocated to
+ * sync               - msync the range of each change so that commits are durable on return
+ *
+ * Returns
+ * pvl_mapped*        - A valid pointer in the case of success, NULL otherwise.
+ */
+struct pvl_mapped *pvl_mapped_open(char *at, const char *path, size_t reserve, _Bool sync);
+
+/* Sync the journal and release the mapping and the file */
+int pvl_mapped_close(struct pvl_mapped *mapped);
+
+/* Write handler, see write_callback in pvl.h */
+int pvl_mapped_write(void *ctx, void *from, size_t length, size_t remaining);
+
+/* Read handler, see read_callback in pvl.h */
+int pvl_mapped_read(void *ctx, void *to, size_t length, size_t remaining);
+
+/* msync the changes written since the last sync, returns non-zero on failure */
+int pvl_mapped_sync(struct pvl_mapped *mapped);
@@ -13,12 +13,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "bitset.h"
 #include "pvl.h"
 
-struct pvl {
+/*
+ * Build with -DPVL_USDT to place static tracepoints (USDT probes) at phase
+ * boundaries, e.g. for bpftrace -e 'usdt:./tests.out:libpvl:phase { ... }'.
+ * They compile to a nop until a tracer attaches.
+ */
+#ifdef PVL_USDT
+#include <sys/sdt.h>
+#define PVL_PROBE(p, ph, e) DTRACE_PROBE3(libpvl, phase, p, ph, e)
+#else
+#define PVL_PROBE(p, ph, e)
+#endif
+
+/*
+ * The top byte of a change header's span count tags its format.
+ * Compact changes store the tag and the code of the field width used by
+ * all of their span records. Legacy changes never set the top bit, as
+ * their span count is at most half the block length, so the rest of the
+ * top byte is part of their count.
+ */
+#define PVL_TAG_SHIFT ((sizeof(size_t) - 1u) * CHAR_BIT)
+#define PVL_SPANS_MASK (SIZE_MAX >> CHAR_BIT)
+#define PVL_COMPACT_TAG 0x80u
+#define PVL_WIDTH_MASK 0x03u
+
+/* Compact span record flags */
+#define PVL_RECORD_SPANS 0x01u /* offset and length are in span_length units */
+#define PVL_RECORD_FILL 0x02u /* content is a single byte repeated over the span */
+#define PVL_RECORD_FILL_WORD 0x04u /* content is a single word repeated over the span */
+#define PVL_RECORD_FLAGS (PVL_RECORD_SPANS | PVL_RECORD_FILL | PVL_RECORD_FILL_WORD)
+#define PVL_FILL_WORD sizeof(uint64_t)
+
+/* A managed memory block, placed at an offset in the combined address space of its pvl */
+struct pvl_region {
+	struct pvl_region *next;
 	char *main;
+	size_t offset;
+	size_t length;
+	size_t span_length;
+	size_t span_count;
+	size_t span_base; /* index of the first span among the spans of all regions */
+	_Bool span_pow2; /* span_length is a power of two, use span_shift instead of divisions */
+	unsigned int span_shift;
+	unsigned char spans[]; /* marks, then the fill flags kept by the sizing pass of a compact commit */
+};
+
+struct pvl {
+	struct pvl_region *regions;
+	struct pvl_region *last_region;
 	char *mirror;
 	size_t length;
 	/* read context and callback */
@@ -30,12 +77,53 @@ struct pvl {
 	/* leak detection context and callback */
 	void *leak_ctx;
 	leak_callback *leak_cb;
-	size_t span_length;
-	size_t span_count;
-	unsigned char spans[];
+	/* exact byte-range tracking, sorted [start, end) pairs */
+	size_t *extents;
+	size_t extent_count;
+	size_t extent_capacity;
+	/* gap-aware span coalescing */
+	_Bool coalesce;
+	size_t coalesce_cost;
+	/* compact change encoding */
+	_Bool compact;
+	/* cumulative counters and latency histograms */
+	struct pvl_stats *stats;
+	/* trace context and callback */
+	void *trace_ctx;
+	trace_callback *trace_cb;
+	/* write amplification analysis */
+	struct pvl_analysis *analysis;
+	/* per-span commit counters */
+	uint64_t *heatmap;
+	/* auto-commit policy, marked bytes since the last commit */
+	_Bool auto_commit;
+	size_t commit_dirty;
+	uint64_t commit_age;
+	size_t dirty;
+	uint64_t dirty_since;
+	_Bool commit_failed;
+	/* restore context and callback, indexing spans instead of applying them on load */
+	void *restore_ctx;
+	restore_callback *restore_cb;
+	/* buffer for reading whole changes on load and the position in the current one */
+	char *load_buffer;
+	size_t load_size;
+	_Bool load_bulk;
+	size_t load_pos;
+	/* apply context and callback, passed the spans of each written or loaded change */
+	void *apply_ctx;
+	apply_callback *apply_cb;
+	/* the initial load is done, and the header of a change that is not complete yet or invalid */
+	_Bool loaded;
+	_Bool load_pending;
+	_Bool load_invalid;
+	size_t load_header[2];
+	/* the first region is stored right after the pvl */
 };
 
 struct pvl_span {
+	struct pvl_region *region;
+	char *at;
 	size_t index;
 	size_t length;
 	_Bool marked;
@@ -43,16 +131,68 @@ struct pvl_span {
 };
 
 size_t pvl_sizeof(size_t span_count) {
-	return sizeof(struct pvl)+(bitset_size(span_count) * sizeof(char));
+	return sizeof(struct pvl) + pvl_region_sizeof(span_count);
+}
+
+size_t pvl_region_sizeof(size_t span_count) {
+	return sizeof(struct pvl_region)+((bitset_size(span_count) + bitset_size(2 * span_count)) * sizeof(char));
 }
 
+static int pvl_region_init(struct pvl_region *region, char *main, size_t length, size_t span_count);
+static _Bool pvl_overlaps(struct pvl *pvl, const char *start, size_t length);
+static struct pvl_region *pvl_region_of(struct pvl *pvl, size_t offset);
 static size_t pvl_next_span(struct pvl *pvl, size_t from, struct pvl_span *span);
-static void pvl_clear_span(struct pvl *pvl, struct pvl_span span);
-static void pvl_stat(struct pvl *pvl, size_t *spans, size_t *size);
+static size_t pvl_next_run(struct pvl *pvl, size_t from, struct pvl_span *span);
+static size_t pvl_next_extent_span(struct pvl *pvl, size_t from, struct pvl_span *span);
+static size_t pvl_find_extent(struct pvl *pvl, size_t offset);
+static void pvl_mark_extent(struct pvl *pvl, size_t start, size_t end);
+static void pvl_merge_closest_extents(struct pvl *pvl);
+static void pvl_clear_span(struct pvl_span span);
+static void pvl_stat(struct pvl *pvl, size_t *spans, size_t *size, size_t *widest);
+static unsigned char pvl_record_fields(struct pvl *pvl, size_t prev_end, struct pvl_span span,
+		unsigned char fill, size_t *delta, size_t *length);
+static unsigned char pvl_fill_flags(const char *from, size_t length);
+static unsigned char *pvl_fill_slot(struct pvl *pvl, struct pvl_span span, size_t *pos);
+static void pvl_keep_fill(struct pvl *pvl, struct pvl_span span, unsigned char fill);
+static unsigned char pvl_kept_fill(struct pvl *pvl, struct pvl_span span);
+static size_t pvl_payload_size(unsigned char flags, size_t length);
+static void pvl_fill(char *to, size_t length, const unsigned char *pattern, size_t pattern_size);
+static size_t pvl_width_code(size_t value);
+static size_t pvl_record_size(struct pvl *pvl, struct pvl_region *region);
+static void pvl_encode(unsigned char *to, size_t value, size_t width);
+static size_t pvl_decode(const unsigned char *from, size_t width);
 static int pvl_load(struct pvl *pvl);
+static int pvl_timed_load(struct pvl *pvl);
+static int pvl_read_span(struct pvl *pvl, size_t width, size_t *prev_end, size_t *content_size,
+		size_t remaining);
+static int pvl_read(struct pvl *pvl, void *to, size_t length, size_t remaining);
+static int pvl_loaded(struct pvl *pvl, size_t offset, const char *from, size_t length, size_t remaining);
 static int pvl_save(struct pvl *pvl);
+static int pvl_write_change(struct pvl *pvl, size_t *header, size_t width);
+static int pvl_apply_change(struct pvl *pvl, size_t spans);
+static int pvl_apply(struct pvl *pvl, size_t offset, const char *from, size_t length, size_t remaining);
+static int pvl_write_span(struct pvl *pvl, struct pvl_span span, size_t width, size_t *prev_end,
+		size_t *content_size);
 static void pvl_detect_leaks(struct pvl *pvl);
-static void pvl_detect_leaks_inner(struct pvl *pvl, size_t from, size_t to);
+static void pvl_detect_leaks_inner(struct pvl *pvl, struct pvl_span span);
+static void pvl_report_leak(struct pvl *pvl, char *start, size_t length);
+static void pvl_count_write(struct pvl *pvl, size_t length, size_t header);
+static int pvl_mark_inner(struct pvl *pvl, const char *start, size_t length);
+static struct pvl_region *pvl_region_for(struct pvl *pvl, struct pvl_region *hint, const char *start,
+		size_t length);
+static void pvl_count_mark(struct pvl *pvl, struct pvl_region *region, const char *start, size_t length);
+static void pvl_span_range(struct pvl_region *region, const char *start, size_t length,
+		size_t *from_pos, size_t *to_pos);
+static void pvl_auto_commit(struct pvl *pvl);
+static uint64_t pvl_now(void);
+static void pvl_record_latency(uint64_t *histogram, uint64_t since);
+static void pvl_trace(struct pvl *pvl, enum pvl_phase phase, _Bool end);
+static size_t pvl_log2_bucket(uint64_t value);
+static void pvl_analysis_start(struct pvl_analysis *analysis);
+static void pvl_analyze_span(struct pvl *pvl, struct pvl_span span);
+static void pvl_count_heat(struct pvl *pvl, struct pvl_span span);
+static uint64_t pvl_predicted_bytes(struct pvl_analysis *analysis, size_t from_slice, size_t to_slice,
+		size_t candidate);
 
 struct pvl *pvl_init(char *at, char *main, size_t length, size_t span_count) {
 	/* Check for alignment */
@@ -61,38 +201,109 @@ struct pvl *pvl_init(char *at, char *main, size_t length, size_t span_count) {
 		return NULL;
 	}
 
+	struct pvl *pvl = (struct pvl*) at;
+	struct pvl_region *region = (struct pvl_region*) (at + sizeof(struct pvl));
+
+	/* Validate and set up the first region */
+	if (pvl_region_init(region, main, length, span_count)) {
+		return NULL;
+	}
+
+	/* Zero the pvl destination. The region has its own flexible
+	   array so only the pvl structure itself is cleared. */
+	memset(pvl, 0, sizeof(struct pvl));
+
+	pvl->regions = region;
+	pvl->last_region = region;
+	pvl->length = length;
+	pvl->commit_dirty = SIZE_MAX;
+
+	return pvl;
+}
+
+static int pvl_region_init(struct pvl_region *region, char *main, size_t length, size_t span_count) {
 	/* main must not be NULL */
 	if (main == NULL) {
-		return NULL;
+		return 1;
 	}
 
 	/* length must be positive */
 	if (length == 0) {
-		return NULL;
+		return 1;
 	}
 
 	/* span_count must be positive */
 	if (span_count == 0) {
-		return NULL;
+		return 1;
 	}
 
 	/* length must be divisible by span_count */
 	if (length % span_count) {
-		return NULL;
+		return 1;
 	}
 
-	struct pvl *pvl = (struct pvl*) at;
-
-	/* Zero the pvl destination. The custom sizeof function will
+	/* Zero the region destination. The custom sizeof function will
 	   account for the flexible array at the end of the structure. */
-	memset(pvl, 0, pvl_sizeof(span_count));
+	memset(region, 0, pvl_region_sizeof(span_count));
 
-	pvl->span_count = span_count;
-	pvl->main = main;
-	pvl->length = length;
-	pvl->span_length = pvl->length / pvl->span_count;
+	region->span_count = span_count;
+	region->main = main;
+	region->length = length;
+	region->span_length = region->length / region->span_count;
 
-	return pvl;
+	region->span_pow2 = (region->span_length & (region->span_length - 1)) == 0;
+	while (((size_t)1 << region->span_shift) < region->span_length) {
+		region->span_shift++;
+	}
+	return 0;
+}
+
+int pvl_add_region(struct pvl *pvl, char *at, char *main, size_t length, size_t span_count) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->mirror || pvl->read_cb || pvl->read_ctx || pvl->heatmap) {
+		return 1; /* the combined block is already mirrored, loaded or counted */
+	}
+	if ((at == NULL) || (((uintptr_t) at) % alignof(max_align_t))) {
+		return 1;
+	}
+	if ((main != NULL) && pvl_overlaps(pvl, main, length)) {
+		return 1; /* Overlap between regions is not allowed */
+	}
+
+	struct pvl_region *region = (struct pvl_region*) at;
+	if (pvl_region_init(region, main, length, span_count)) {
+		return 1;
+	}
+
+	/* Append it to the combined address space */
+	region->offset = pvl->length;
+	region->span_base = pvl->last_region->span_base + pvl->last_region->span_count;
+	pvl->last_region->next = region;
+	pvl->last_region = region;
+	pvl->length += length;
+	return 0;
+}
+
+/* Indicates whether the provided block overlaps any region */
+static _Bool pvl_overlaps(struct pvl *pvl, const char *start, size_t length) {
+	for (struct pvl_region *r = pvl->regions; r; r = r->next) {
+		if (((start <= r->main) && ((start+length) > r->main)) ||
+				((r->main <= start) && ((r->main+r->length) > start))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Returns the region that contains the offset in the combined address space, or the last one */
+static struct pvl_region *pvl_region_of(struct pvl *pvl, size_t offset) {
+	struct pvl_region *region = pvl->regions;
+	while (region->next && ((region->offset + region->length) <= offset)) {
+		region = region->next;
+	}
+	return region;
 }
 
 int pvl_set_read_cb(struct pvl *pvl, void *read_ctx, read_callback read_cb) {
@@ -102,125 +313,1000 @@ int pvl_set_read_cb(struct pvl *pvl, void *read_ctx, read_callback read_cb) {
 	if (pvl->read_cb || pvl->read_ctx) {
 		return 1; /* already set */
 	}
-	pvl->read_ctx = read_ctx;
-	pvl->read_cb = read_cb;
-	return pvl_load(pvl);
+	pvl->read_ctx = read_ctx;
+	pvl->read_cb = read_cb;
+	return pvl_timed_load(pvl);
+}
+
+int pvl_poll(struct pvl *pvl) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->read_cb == NULL) {
+		return 1; /* nothing to follow */
+	}
+	int result = pvl_timed_load(pvl);
+	return result || pvl->load_invalid;
+}
+
+int pvl_set_write_cb(struct pvl *pvl, void *write_ctx, write_callback write_cb) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->write_cb || pvl->write_ctx) {
+		return 1; /* already set */
+	}
+	pvl->write_ctx = write_ctx;
+	pvl->write_cb = write_cb;
+	return 0;
+}
+
+int pvl_set_mirror(struct pvl *pvl, char *mirror) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->mirror) {
+		return 1; /* already set */
+	}
+	if ((mirror != NULL) && pvl_overlaps(pvl, mirror, pvl->length)) {
+		return 1; /* Overlap between main and mirror blocks is not allowed */
+	}
+	if (pvl->restore_cb) {
+		return 1; /* The mirror cannot be filled before main is restored */
+	}
+	pvl->mirror = mirror;
+	return 0;
+}
+
+int pvl_set_restore_cb(struct pvl *pvl, void *restore_ctx, restore_callback restore_cb) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->restore_cb || pvl->restore_ctx) {
+		return 1; /* already set */
+	}
+	if (pvl->mirror || pvl->read_cb) {
+		return 1; /* Restoring is handed over before loading and without a mirror */
+	}
+	pvl->restore_ctx = restore_ctx;
+	pvl->restore_cb = restore_cb;
+	return 0;
+}
+
+int pvl_set_leak_cb(struct pvl *pvl, void *leak_ctx, leak_callback leak_cb){
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->leak_cb || pvl->leak_ctx) {
+		return 1; /* already set */
+	}
+	if (!pvl->mirror) {
+		return 1; /* Leak detection requires a mirror */
+	}
+	pvl->leak_ctx = leak_ctx;
+	pvl->leak_cb = leak_cb;
+	return 0;
+}
+
+size_t pvl_extents_sizeof(size_t capacity) {
+	/* One extra extent is used while merging past capacity, followed by the kept fill flags */
+	return ((capacity + 1) * 2 * sizeof(size_t)) + bitset_size(2 * (capacity + 1));
+}
+
+int pvl_set_extents(struct pvl *pvl, char *extents, size_t capacity) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->extents) {
+		return 1; /* already set */
+	}
+	if ((extents == NULL) || (capacity == 0)) {
+		return 1;
+	}
+	if (((uintptr_t) extents) % alignof(max_align_t)) {
+		return 1;
+	}
+	size_t spans = 0;
+	size_t size = 0;
+	size_t widest = 0;
+	pvl_stat(pvl, &spans, &size, &widest);
+	if (spans) {
+		return 1; /* Already marked spans would be lost */
+	}
+	pvl->extents = (size_t*) extents;
+	pvl->extent_capacity = capacity;
+	return 0;
+}
+
+int pvl_set_trace_cb(struct pvl *pvl, void *trace_ctx, trace_callback trace_cb) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->trace_cb || pvl->trace_ctx) {
+		return 1; /* already set */
+	}
+	pvl->trace_ctx = trace_ctx;
+	pvl->trace_cb = trace_cb;
+	return 0;
+}
+
+int pvl_set_coalesce(struct pvl *pvl, size_t call_cost) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->coalesce) {
+		return 1; /* already set */
+	}
+	pvl->coalesce = 1;
+	pvl->coalesce_cost = call_cost;
+	return 0;
+}
+
+int pvl_set_load_buffer(struct pvl *pvl, char *buffer, size_t size) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->load_buffer) {
+		return 1; /* already set */
+	}
+	if ((buffer == NULL) || (size == 0)) {
+		return 1;
+	}
+	if (pvl->read_cb) {
+		return 1; /* Changes are only read on load */
+	}
+	pvl->load_buffer = buffer;
+	pvl->load_size = size;
+	return 0;
+}
+
+int pvl_set_apply_cb(struct pvl *pvl, void *apply_ctx, apply_callback apply_cb) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->apply_cb || pvl->apply_ctx) {
+		return 1; /* already set */
+	}
+	if (apply_cb == NULL) {
+		return 1;
+	}
+	if (pvl->read_cb) {
+		return 1; /* Loaded spans are applied as they are read */
+	}
+	pvl->apply_ctx = apply_ctx;
+	pvl->apply_cb = apply_cb;
+	return 0;
+}
+
+int pvl_set_compact(struct pvl *pvl) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->compact) {
+		return 1; /* already set */
+	}
+	pvl->compact = 1;
+	return 0;
+}
+
+int pvl_mark(struct pvl *pvl, const char *start, size_t length) {
+	if (pvl == NULL) {
+		return 1;
+	}
+
+	/* Reading the clock would dominate the cost of a mark, time only a sample */
+	int result = 0;
+	if ((pvl->stats == NULL) || (pvl->stats->marks % PVL_STATS_MARK_SAMPLE)) {
+		result = pvl_mark_inner(pvl, start, length);
+	} else {
+		uint64_t since = pvl_now();
+		result = pvl_mark_inner(pvl, start, length);
+		pvl_record_latency(pvl->stats->mark_latency, since);
+	}
+
+	if (result == 0) {
+		pvl_auto_commit(pvl);
+	}
+	return result;
+}
+
+static int pvl_mark_inner(struct pvl *pvl, const char *start, size_t length) {
+	/* Find the region that holds the span */
+	struct pvl_region *region = pvl_region_for(pvl, pvl->regions, start, length);
+	if (region == NULL) {
+		return 1;
+	}
+	pvl_count_mark(pvl, region, start, length);
+
+	/* Record the exact range */
+	if (pvl->extents) {
+		size_t offset = region->offset + (size_t)(start - region->main);
+		pvl_mark_extent(pvl, offset, offset + length);
+		return 0;
+	}
+
+	/* Set the matching spans */
+	size_t from_pos = 0;
+	size_t to_pos = 0;
+	pvl_span_range(region, start, length, &from_pos, &to_pos);
+	bitset_set_range(region->spans, from_pos, to_pos);
+
+	return 0;
+}
+
+int pvl_get_view(struct pvl *pvl, struct pvl_view *view) {
+	if ((pvl == NULL) || (view == NULL)) {
+		return 1;
+	}
+	if (pvl->extents) {
+		return 1; /* Marks are not tracked in the bitset */
+	}
+	if (! pvl->regions->span_pow2) {
+		return 1;
+	}
+	view->pvl = pvl;
+	view->main = pvl->regions->main;
+	view->length = pvl->regions->length;
+	view->span_shift = pvl->regions->span_shift;
+	view->spans = pvl->regions->spans;
+	return 0;
+}
+
+int pvl_mark_many(struct pvl *pvl, const struct pvl_range *ranges, size_t count) {
+	if (pvl == NULL) {
+		return 1;
+	}
+
+	if ((ranges == NULL) || (count == 0)) {
+		return 1;
+	}
+
+	/* Merge ranges over the same or adjacent spans before setting them */
+	struct pvl_region *region = pvl->regions;
+	struct pvl_region *run = NULL;
+	size_t run_from = 0;
+	size_t run_to = 0;
+	_Bool counted = pvl->stats || pvl->analysis || pvl->auto_commit;
+	int result = 0;
+	for (size_t i = 0; i < count; i++) {
+		const char *start = ranges[i].start;
+		size_t length = ranges[i].length;
+		/* Look up the region only when the range is not in the current one */
+		if ((start == NULL) || (length == 0) || (start < region->main)
+				|| ((start+length) > (region->main+region->length))) {
+			region = pvl_region_for(pvl, pvl->regions, start, length);
+			if (region == NULL) {
+				result = 1;
+				break;
+			}
+		}
+		if (counted) {
+			pvl_count_mark(pvl, region, start, length);
+		}
+
+		if (pvl->extents) {
+			size_t offset = region->offset + (size_t)(start - region->main);
+			pvl_mark_extent(pvl, offset, offset + length);
+			continue;
+		}
+
+		size_t from_pos = 0;
+		size_t to_pos = 0;
+		pvl_span_range(region, start, length, &from_pos, &to_pos);
+		if ((region == run) && (from_pos <= (run_to + 1)) && ((to_pos + 1) >= run_from)) {
+			run_from = (from_pos < run_from) ? from_pos : run_from;
+			run_to = (to_pos > run_to) ? to_pos : run_to;
+			continue;
+		}
+		if (run) {
+			bitset_set_range(run->spans, run_from, run_to);
+		}
+		run = region;
+		run_from = from_pos;
+		run_to = to_pos;
+	}
+	if (run) {
+		bitset_set_range(run->spans, run_from, run_to);
+	}
+
+	if (result == 0) {
+		pvl_auto_commit(pvl);
+	}
+	return result;
+}
+
+/* Find the first and last internal spans of a region that overlap a span of memory */
+static void pvl_span_range(struct pvl_region *region, const char *start, size_t length,
+		size_t *from_pos, size_t *to_pos) {
+	size_t offset = (size_t)(start - region->main);
+	if (region->span_pow2) {
+		*from_pos = offset >> region->span_shift;
+		*to_pos = (offset + length - 1) >> region->span_shift;
+		return;
+	}
+
+	/* The quotient and remainder come from a single division */
+	size_t within = offset % region->span_length;
+	*from_pos = offset / region->span_length;
+	*to_pos = *from_pos;
+	/* Most marks are shorter than a span, avoid a second division for them */
+	if ((within + length) > region->span_length) {
+		*to_pos += (within + length - 1) / region->span_length;
+	}
+}
+
+/* Returns the region that holds the span, checking the provided hint first */
+static struct pvl_region *pvl_region_for(struct pvl *pvl, struct pvl_region *hint, const char *start,
+		size_t length) {
+	if ((start == NULL) || (length == 0)) {
+		return NULL;
+	}
+	if ((start >= hint->main) && ((start+length) <= (hint->main+hint->length))) {
+		return hint;
+	}
+	struct pvl_region *region = pvl->regions;
+	while ((start < region->main) || ((start+length) > (region->main+region->length))) {
+		region = region->next;
+		if (region == NULL) {
+			return NULL;
+		}
+	}
+	return region;
+}
+
+/* Update statistics and analysis with a valid mark */
+static void pvl_count_mark(struct pvl *pvl, struct pvl_region *region, const char *start, size_t length) {
+	if (pvl->stats) {
+		pvl->stats->marks++;
+		pvl->stats->marked_bytes += length;
+	}
+	if (pvl->analysis) {
+		size_t offset = region->offset + (size_t)(start - region->main);
+		pvl->analysis->mark_sizes[pvl_log2_bucket(length)]++;
+		pvl->analysis->mark_slices[(offset * PVL_ANALYSIS_SLICES) / pvl->length]++;
+	}
+	if (pvl->auto_commit) {
+		/* The age of the oldest uncommitted mark is only tracked for a max age */
+		if ((pvl->dirty == 0) && pvl->commit_age) {
+			pvl->dirty_since = pvl_now();
+		}
+		pvl->dirty += length;
+	}
+}
+
+/* Commit once enough bytes have been marked since the last commit, backing off after a failure */
+static void pvl_auto_commit(struct pvl *pvl) {
+	if (pvl->commit_failed || (pvl->dirty < pvl->commit_dirty)) {
+		return;
+	}
+	pvl->commit_failed = pvl_commit(pvl) != 0;
+}
+
+int pvl_commit(struct pvl *pvl) {
+	if (pvl == NULL) {
+		return 1;
+	}
+
+	pvl->commit_failed = 0;
+	uint64_t since = 0;
+	if (pvl->stats) {
+		since = pvl_now();
+		pvl->stats->commits++;
+	}
+	if (pvl->analysis) {
+		pvl->analysis->commits++;
+	}
+
+	/* Perform leak detection */
+	if (pvl->leak_cb) {
+		pvl_trace(pvl, PVL_PHASE_LEAKS, 0);
+		pvl_detect_leaks(pvl);
+		pvl_trace(pvl, PVL_PHASE_LEAKS, 1);
+	}
+
+	int result = pvl_save(pvl);
+	if (pvl->stats) {
+		pvl_record_latency(pvl->stats->commit_latency, since);
+	}
+	/* Failed commits keep their marks and are retried */
+	if (result == 0) {
+		pvl->dirty = 0;
+	}
+	return result;
+}
+
+int pvl_set_auto_commit(struct pvl *pvl, size_t dirty_bytes, uint64_t max_age) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->auto_commit) {
+		return 1; /* already set */
+	}
+	if ((dirty_bytes == 0) && (max_age == 0)) {
+		return 1;
+	}
+	pvl->auto_commit = 1;
+	if (dirty_bytes) {
+		pvl->commit_dirty = dirty_bytes;
+	}
+	pvl->commit_age = max_age;
+	return 0;
+}
+
+int pvl_tick(struct pvl *pvl) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->commit_failed) {
+		return pvl_commit(pvl); /* retry a failed automatic commit */
+	}
+	if ((pvl->dirty == 0) || (pvl->commit_age == 0)) {
+		return 0;
+	}
+	if ((pvl_now() - pvl->dirty_since) < pvl->commit_age) {
+		return 0;
+	}
+	return pvl_commit(pvl);
+}
+
+int pvl_auto_commit_failed(struct pvl *pvl) {
+	if (pvl == NULL) {
+		return 0;
+	}
+	return pvl->commit_failed;
+}
+
+int pvl_set_stats(struct pvl *pvl, struct pvl_stats *stats) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->stats) {
+		return 1; /* already set */
+	}
+	if (stats == NULL) {
+		return 1;
+	}
+	memset(stats, 0, sizeof(struct pvl_stats));
+	pvl->stats = stats;
+	return 0;
+}
+
+int pvl_get_stats(struct pvl *pvl, struct pvl_stats *stats) {
+	if ((pvl == NULL) || (stats == NULL)) {
+		return 1;
+	}
+	if (pvl->stats == NULL) {
+		return 1; /* not collected */
+	}
+	*stats = *pvl->stats;
+	return 0;
+}
+
+static uint64_t pvl_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000u) + (uint64_t)ts.tv_nsec;
+}
+
+/* Mark the start or end of a phase for tracepoints and the trace callback */
+static void pvl_trace(struct pvl *pvl, enum pvl_phase phase, _Bool end) {
+	PVL_PROBE(pvl, phase, end);
+	if (pvl->trace_cb) {
+		pvl->trace_cb(pvl->trace_ctx, phase, end, pvl_now());
+	}
+}
+
+/* Count the time elapsed since the provided timestamp in its log2 bucket */
+static void pvl_record_latency(uint64_t *histogram, uint64_t since) {
+	histogram[pvl_log2_bucket(pvl_now() - since)]++;
+}
+
+static size_t pvl_log2_bucket(uint64_t value) {
+	size_t bucket = 0;
+	while ((value >>= 1) && (bucket < (PVL_STATS_BUCKETS - 1))) {
+		bucket++;
+	}
+	return bucket;
+}
+
+int pvl_set_analysis(struct pvl *pvl, struct pvl_analysis *analysis) {
+	if (pvl == NULL) {
+		return 1;
+	}
+	if (pvl->analysis) {
+		return 1; /* already set */
+	}
+	if (analysis == NULL) {
+		return 1;
+	}
+	if (!pvl->mirror) {
+		return 1; /* Analysis requires a mirror */
+	}
+	if (pvl->length % PVL_ANALYSIS_SLICES) {
+		return 1;
+	}
+	memset(analysis, 0, sizeof(struct pvl_analysis));
+	pvl->analysis = analysis;
+	return 0;
+}
+
+int pvl_advise(struct pvl *pvl, size_t scan_cost, struct pvl_advice *advice) {
+	if ((pvl == NULL) || (advice == NULL)) {
+		return 1;
+	}
+	struct pvl_analysis *analysis = pvl->analysis;
+	if (analysis == NULL) {
+		return 1; /* not analyzed */
+	}
+	memset(advice, 0, sizeof(struct pvl_advice));
+
+	/* Pick the span length that minimizes journal bytes and span scanning for the whole block,
+	   preferring longer spans on ties as they need a smaller pvl */
+	uint64_t best = UINT64_MAX;
+	for (size_t k = 0; (k < PVL_ANALYSIS_CANDIDATES) && (((size_t)1 << k) <= pvl->length); k++) {
+		size_t span_length = (size_t)1 << k;
+		if (pvl->length % span_length) {
+			break;
+		}
+		size_t span_count = pvl->length / span_length;
+		uint64_t bytes = pvl_predicted_bytes(analysis, 0, PVL_ANALYSIS_SLICES, k);
+		uint64_t scan = analysis->commits * span_count;
+		if ((bytes + (scan * scan_cost)) <= best) {
+			best = bytes + (scan * scan_cost);
+			advice->span_count = span_count;
+			advice->journal_bytes = bytes;
+			advice->scan_cost = scan;
+		}
+	}
+
+	/* .. and for each slice on its own, as if it were a separate region */
+	size_t slice_length = pvl->length / PVL_ANALYSIS_SLICES;
+	advice->split_journal_bytes = analysis->changes * (2 * sizeof(size_t));
+	for (size_t slice = 0; slice < PVL_ANALYSIS_SLICES; slice++) {
+		uint64_t slice_best = UINT64_MAX;
+		uint64_t slice_bytes = 0;
+		for (size_t k = 0; (k < PVL_ANALYSIS_CANDIDATES) && (((size_t)1 << k) <= slice_length); k++) {
+			size_t span_length = (size_t)1 << k;
+			if (slice_length % span_length) {
+				break;
+			}
+			uint64_t bytes = pvl_predicted_bytes(analysis, slice, slice+1, k);
+			uint64_t scan = analysis->commits * (slice_length / span_length);
+			if ((bytes + (scan * scan_cost)) <= slice_best) {
+				slice_best = bytes + (scan * scan_cost);
+				slice_bytes = bytes;
+				advice->slice_span_length[slice] = span_length;
+			}
+		}
+		advice->split_journal_bytes += slice_bytes;
+	}
+	return 0;
+}
+
+size_t pvl_heatmap_sizeof(struct pvl *pvl) {
+	if (pvl == NULL) {
+		return 0;
+	}
+	return (pvl->last_region->span_base + pvl->last_region->span_count) * sizeof(uint64_t);
 }
 
-int pvl_set_write_cb(struct pvl *pvl, void *write_ctx, write_callback write_cb) {
+int pvl_set_heatmap(struct pvl *pvl, uint64_t *heatmap) {
 	if (pvl == NULL) {
 		return 1;
 	}
-	if (pvl->write_cb || pvl->write_ctx) {
+	if (pvl->heatmap) {
 		return 1; /* already set */
 	}
-	pvl->write_ctx = write_ctx;
-	pvl->write_cb = write_cb;
+	if (heatmap == NULL) {
+		return 1;
+	}
+	memset(heatmap, 0, pvl_heatmap_sizeof(pvl));
+	pvl->heatmap = heatmap;
 	return 0;
 }
 
-int pvl_set_mirror(struct pvl *pvl, char *mirror) {
-	if (pvl == NULL) {
+int pvl_get_heatmap(struct pvl *pvl, uint64_t *heatmap, _Bool reset) {
+	if ((pvl == NULL) || (heatmap == NULL)) {
 		return 1;
 	}
-	if (pvl->mirror) {
-		return 1; /* already set */
+	if (pvl->heatmap == NULL) {
+		return 1; /* not counted */
 	}
-	if ((mirror != NULL)  &&
-			(((mirror <= pvl->main) && ((mirror+pvl->length) > pvl->main)) ||
-			((pvl->main <= mirror) && ((pvl->main+pvl->length) > mirror)))) {
-		return 1; /* Overlap between main and mirror blocks is not allowed */
+	memcpy(heatmap, pvl->heatmap, pvl_heatmap_sizeof(pvl));
+	if (reset) {
+		memset(pvl->heatmap, 0, pvl_heatmap_sizeof(pvl));
 	}
-	pvl->mirror = mirror;
 	return 0;
 }
 
-int pvl_set_leak_cb(struct pvl *pvl, void *leak_ctx, leak_callback leak_cb){
-	if (pvl == NULL) {
+int pvl_heatmap_csv(struct pvl *pvl, const uint64_t *heatmap, FILE *to) {
+	if ((pvl == NULL) || (heatmap == NULL) || (to == NULL)) {
 		return 1;
 	}
-	if (pvl->leak_cb || pvl->leak_ctx) {
-		return 1; /* already set */
+	/* Keep writing on failure, reporting it at the end */
+	int result = fprintf(to, "offset,length,commits\n") < 0;
+	for (struct pvl_region *r = pvl->regions; r; r = r->next) {
+		for (size_t i = 0; i < r->span_count; i++) {
+			uint64_t commits = heatmap[r->span_base + i];
+			if (commits == 0) {
+				continue;
+			}
+			result |= fprintf(to, "%zu,%zu,%llu\n", r->offset + (i * r->span_length), r->span_length,
+					(unsigned long long) commits) < 0;
+		}
 	}
-	if (!pvl->mirror) {
-		return 1; /* Leak detection requires a mirror */
+	return result;
+}
+
+/* Count a commit of each internal span that overlaps a committed span */
+static void pvl_count_heat(struct pvl *pvl, struct pvl_span span) {
+	struct pvl_region *region = span.region;
+	size_t from = (span.index - region->offset) / region->span_length;
+	size_t to = ((span.index + span.length - 1) - region->offset) / region->span_length;
+	for (size_t i = from; i <= to; i++) {
+		pvl->heatmap[region->span_base + i]++;
 	}
-	pvl->leak_ctx = leak_ctx;
-	pvl->leak_cb = leak_cb;
-	return 0;
 }
 
-int pvl_mark(struct pvl *pvl, const char *start, size_t length) {
-	if (pvl == NULL) {
-		return 1;
+/* Predicted span records and content over a range of slices, for a 2^candidate span length */
+static uint64_t pvl_predicted_bytes(struct pvl_analysis *analysis, size_t from_slice, size_t to_slice,
+		size_t candidate) {
+	uint64_t bytes = 0;
+	/* Change headers are accounted once for the whole block */
+	if ((from_slice == 0) && (to_slice == PVL_ANALYSIS_SLICES)) {
+		bytes += analysis->changes * (2 * sizeof(size_t));
+	}
+	for (size_t slice = from_slice; slice < to_slice; slice++) {
+		bytes += analysis->chunks[slice][candidate] << candidate;
+		bytes += analysis->runs[slice][candidate] * (2 * sizeof(size_t));
 	}
+	return bytes;
+}
 
-	/* Validate the span */
-	if ((start == NULL) || (length == 0) || (start < pvl->main)
-			|| ((start+length) > (pvl->main+pvl->length))) {
-		return 1;
+static void pvl_analysis_start(struct pvl_analysis *analysis) {
+	analysis->changes++;
+	for (size_t k = 0; k < PVL_ANALYSIS_CANDIDATES; k++) {
+		analysis->last[k] = SIZE_MAX;
 	}
+}
 
-	/* Set the matching spans */
-	size_t from_pos = (start - pvl->main) / pvl->span_length;
-	size_t to_pos = ((start+length) - pvl->main) / pvl->span_length;
-	bitset_set_range(pvl->spans, from_pos, to_pos);
+/*
+ * Compare a committed span against the mirror and count the spans and runs
+ * of spans that would hold its changed bytes for each candidate span length.
+ */
+static void pvl_analyze_span(struct pvl *pvl, struct pvl_span span) {
+	struct pvl_analysis *analysis = pvl->analysis;
+	const char *mirror = pvl->mirror + span.index;
+	analysis->committed_bytes += span.length;
+	for (size_t i = 0; i < span.length; i++) {
+		if (span.at[i] == mirror[i]) {
+			continue;
+		}
+		analysis->changed_bytes++;
+		size_t offset = span.index + i;
+		size_t slice = (offset * PVL_ANALYSIS_SLICES) / pvl->length;
+		for (size_t k = 0; k < PVL_ANALYSIS_CANDIDATES; k++) {
+			size_t chunk = offset >> k;
+			if (chunk == analysis->last[k]) {
+				break; /* .. and so are all longer span lengths */
+			}
+			analysis->chunks[slice][k]++;
+			if ((analysis->last[k] == SIZE_MAX) || (chunk != (analysis->last[k] + 1))) {
+				analysis->runs[slice][k]++;
+			}
+			analysis->last[k] = chunk;
+		}
+	}
+}
 
-	return 0;
+/*
+ * Find the next continuous span, starting at offset from in the combined
+ * address space. Spans never cross region boundaries.
+ */
+static size_t pvl_next_span(struct pvl *pvl, size_t from, struct pvl_span *span) {
+	if (from == pvl->length) {
+		return 0;
+	}
+
+	struct pvl_region *region = pvl_region_of(pvl, from);
+	span->region = region;
+	span->at = region->main + (from - region->offset);
+	span->index = from;
+
+	if (pvl->extents) {
+		return pvl_next_extent_span(pvl, from, span);
+	}
+
+	size_t pos = (from - region->offset) / region->span_length;
+	span->marked = bitset_test(region->spans, pos);
+	span->length = region->span_length;
+
+	for (size_t i = pos+1; i < region->span_count; i++) {
+		if (span->marked ^ bitset_test(region->spans, i)) {
+			return region->offset + (i * region->span_length);
+		}
+		span->length += region->span_length;
+	}
+
+	return region->offset + region->length;
 }
 
-int pvl_commit(struct pvl *pvl) {
-	if (pvl == NULL) {
-		return 1;
+/*
+ * Estimate the size of a span record in the active change encoding. Compact
+ * records are sized for the largest field of the region, in span_length units
+ * unless byte-range extents are tracked.
+ */
+static size_t pvl_record_size(struct pvl *pvl, struct pvl_region *region) {
+	if (! pvl->compact) {
+		return 2 * sizeof(size_t);
 	}
+	size_t unit = pvl->extents ? 1 : region->span_length;
+	return 1 + (2 * ((size_t)1 << pvl_width_code(pvl->length / unit)));
+}
 
-	/* Perform leak detection */
-	if (pvl->leak_cb) {
-		pvl_detect_leaks(pvl);
+/*
+ * Find the next span to persist. Marked spans absorb the clean gaps after them
+ * when saving a span header and a callback call costs more than the gap bytes.
+ */
+static size_t pvl_next_run(struct pvl *pvl, size_t from, struct pvl_span *span) {
+	size_t next = pvl_next_span(pvl, from, span);
+	if ((next == 0) || (! span->marked) || (! pvl->coalesce)) {
+		return next;
+	}
+
+	size_t threshold = pvl_record_size(pvl, span->region) + pvl->coalesce_cost;
+	size_t region_end = span->region->offset + span->region->length;
+	struct pvl_span gap;
+	struct pvl_span tail;
+	while (next < region_end) {
+		/* Marked and clean spans alternate, a marked one follows unless the gap reaches the region end */
+		size_t after = pvl_next_span(pvl, next, &gap);
+		if ((after == region_end) || (gap.length > threshold)) {
+			break;
+		}
+		next = pvl_next_span(pvl, after, &tail);
+		span->length += gap.length + tail.length;
 	}
+	return next;
+}
 
-	return pvl_save(pvl);
+/* Find the next continuous span in exact byte-range tracking mode */
+static size_t pvl_next_extent_span(struct pvl *pvl, size_t from, struct pvl_span *span) {
+	size_t i = pvl_find_extent(pvl, from+1);
+	size_t end = 0;
+	if ((i < pvl->extent_count) && (pvl->extents[2*i] <= from)) {
+		span->marked = 1;
+		end = pvl->extents[(2*i)+1];
+	} else {
+		span->marked = 0;
+		end = (i < pvl->extent_count) ? pvl->extents[2*i] : pvl->length;
+	}
+	/* Extents may touch across regions, split them at region boundaries */
+	size_t region_end = span->region->offset + span->region->length;
+	span->length = ((end < region_end) ? end : region_end) - from;
+	return from + span->length;
 }
 
-/* Find the next continuous span */
-static size_t pvl_next_span(struct pvl *pvl, size_t from, struct pvl_span *span) {
-	if (from == pvl->span_count) {
-		return 0;
+/* Returns the position of the first extent that ends at or after offset */
+static size_t pvl_find_extent(struct pvl *pvl, size_t offset) {
+	size_t lo = 0;
+	size_t hi = pvl->extent_count;
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) / 2);
+		if (pvl->extents[(2*mid)+1] < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	return lo;
+}
 
-	span->marked = bitset_test(pvl->spans, from);
-	span->index = from * pvl->span_length;
-	span->length = pvl->span_length;
+static void pvl_mark_extent(struct pvl *pvl, size_t start, size_t end) {
+	size_t *extents = pvl->extents;
+	size_t count = pvl->extent_count;
 
-	for (size_t i = from+1; i < pvl->span_count; i++) {
-		if (span->marked ^ bitset_test(pvl->spans, i)) {
-			return i;
+	/* Absorb all extents that overlap or touch the new one */
+	size_t lo = pvl_find_extent(pvl, start);
+	size_t hi = lo;
+	while ((hi < count) && (extents[2*hi] <= end)) {
+		if (extents[2*hi] < start) {
+			start = extents[2*hi];
+		}
+		if (extents[(2*hi)+1] > end) {
+			end = extents[(2*hi)+1];
 		}
-		span->length += pvl->span_length;
+		hi++;
+	}
+
+	/* Replace the absorbed extents (if any) with the new one */
+	memmove(extents + (2*(lo+1)), extents + (2*hi), (count - hi) * 2 * sizeof(size_t));
+	extents[2*lo] = start;
+	extents[(2*lo)+1] = end;
+	pvl->extent_count = count - (hi - lo) + 1;
+
+	if (pvl->extent_count > pvl->extent_capacity) {
+		pvl_merge_closest_extents(pvl);
 	}
+}
 
-	return pvl->span_count;
+/* Merge the two extents with the smallest gap between them */
+static void pvl_merge_closest_extents(struct pvl *pvl) {
+	size_t *extents = pvl->extents;
+	size_t count = pvl->extent_count;
+	size_t best = 0;
+	for (size_t i = 1; (i+1) < count; i++) {
+		if ((extents[2*(i+1)] - extents[(2*i)+1]) < (extents[2*(best+1)] - extents[(2*best)+1])) {
+			best = i;
+		}
+	}
+	extents[(2*best)+1] = extents[(2*best)+3];
+	memmove(extents + (2*(best+1)), extents + (2*(best+2)), (count - best - 2) * 2 * sizeof(size_t));
+	pvl->extent_count = count - 1;
 }
 
-static void pvl_clear_span(struct pvl *pvl, struct pvl_span span) {
-	size_t from_pos = span.index;
-	size_t to_pos = span.index+span.length;
-	bitset_clear_range(pvl->spans, from_pos, to_pos);
+static void pvl_clear_span(struct pvl_span span) {
+	struct pvl_region *region = span.region;
+	size_t from_pos = (span.index - region->offset) / region->span_length;
+	size_t to_pos = ((span.index + span.length - region->offset) / region->span_length) - 1;
+	bitset_clear_range(region->spans, from_pos, to_pos);
 }
 
-static void pvl_stat(struct pvl *pvl, size_t *spans, size_t *size) {
+static void pvl_stat(struct pvl *pvl, size_t *spans, size_t *size, size_t *widest) {
 	*spans = 0;
 	*size = 0;
+	*widest = 0;
+	size_t prev_end = 0;
 	size_t next = 0;
 	struct pvl_span span;
-	while((next = pvl_next_span(pvl, next, &span))) {
-		if (span.marked) {
-			(*spans)++;
+	while((next = pvl_next_run(pvl, next, &span))) {
+		if (! span.marked) {
+			continue;
+		}
+		(*spans)++;
+		if (! pvl->compact) {
 			*size += span.length;
+			continue;
 		}
+		/* Track the widest compact record field and the content size of fill records,
+		   keeping the fill flags for the writer so that spans are scanned once */
+		size_t delta = 0;
+		size_t length = 0;
+		unsigned char fill = pvl_fill_flags(span.at, span.length);
+		pvl_keep_fill(pvl, span, fill);
+		unsigned char flags = pvl_record_fields(pvl, prev_end, span, fill, &delta, &length);
+		*widest |= delta | length;
+		*size += pvl_payload_size(flags, span.length);
+		prev_end = span.index + span.length;
+	}
+}
+
+/*
+ * Compute the fields of a compact span record. The span offset is stored
+ * as a delta from the end of the previous span and both values are scaled
+ * down to span_length units of the region holding the end of the previous
+ * span when possible. fill holds the fill record flags of the span.
+ */
+static unsigned char pvl_record_fields(struct pvl *pvl, size_t prev_end, struct pvl_span span,
+		unsigned char fill, size_t *delta, size_t *length) {
+	unsigned char flags = fill;
+	size_t unit = pvl_region_of(pvl, prev_end)->span_length;
+	*delta = span.index - prev_end;
+	*length = span.length;
+	if (((*delta % unit) == 0) && ((*length % unit) == 0)) {
+		*delta /= unit;
+		*length /= unit;
+		flags |= PVL_RECORD_SPANS;
+	}
+	return flags;
+}
+
+/*
+ * Detect repeated content by comparing the span with itself shifted by the
+ * pattern size. memcmp is vectorized by the C library and stops at the
+ * first difference so this is cheap for regular content as well.
+ */
+static unsigned char pvl_fill_flags(const char *from, size_t length) {
+	if ((length > 1) && (memcmp(from, from + 1, length - 1) == 0)) {
+		return PVL_RECORD_FILL;
+	}
+	if ((length > (2 * PVL_FILL_WORD)) && (memcmp(from, from + PVL_FILL_WORD, length - PVL_FILL_WORD) == 0)) {
+		return PVL_RECORD_FILL_WORD;
+	}
+	return 0;
+}
+
+/*
+ * Locate the fill flags kept for a span, two bits at pos of the returned
+ * bitset. Region spans keep them at the position of their first span and
+ * extent spans at the position of their extent, except for the part of an
+ * extent continuing from the previous region, which is the first span of
+ * its region.
+ */
+static unsigned char *pvl_fill_slot(struct pvl *pvl, struct pvl_span span, size_t *pos) {
+	struct pvl_region *region = span.region;
+	unsigned char *fills = region->spans + bitset_size(region->span_count);
+	*pos = 0;
+	if (! pvl->extents) {
+		*pos = 2 * ((span.index - region->offset) / region->span_length);
+		return fills;
+	}
+	size_t i = pvl_find_extent(pvl, span.index + 1);
+	if (pvl->extents[2*i] < span.index) {
+		return fills;
+	}
+	*pos = 2 * i;
+	return (unsigned char*) (pvl->extents + (2 * (pvl->extent_capacity + 1)));
+}
+
+static void pvl_keep_fill(struct pvl *pvl, struct pvl_span span, unsigned char fill) {
+	size_t pos = 0;
+	unsigned char *fills = pvl_fill_slot(pvl, span, &pos);
+	bitset_clear_range(fills, pos, pos + 1);
+	if (fill & PVL_RECORD_FILL) {
+		bitset_set(fills, pos);
+	}
+	if (fill & PVL_RECORD_FILL_WORD) {
+		bitset_set(fills, pos + 1);
+	}
+}
+
+static unsigned char pvl_kept_fill(struct pvl *pvl, struct pvl_span span) {
+	size_t pos = 0;
+	const unsigned char *fills = pvl_fill_slot(pvl, span, &pos);
+	return (bitset_test(fills, pos) ? PVL_RECORD_FILL : 0) | (bitset_test(fills, pos + 1) ? PVL_RECORD_FILL_WORD : 0);
+}
+
+/* Returns the persisted content size of a span record */
+static size_t pvl_payload_size(unsigned char flags, size_t length) {
+	if (flags & PVL_RECORD_FILL) {
+		return 1;
+	}
+	if (flags & PVL_RECORD_FILL_WORD) {
+		return PVL_FILL_WORD;
+	}
+	return length;
+}
+
+/* Repeat the pattern over the destination, doubling the copied block each time */
+static void pvl_fill(char *to, size_t length, const unsigned char *pattern, size_t pattern_size) {
+	if (pattern_size == 1) {
+		memset(to, pattern[0], length);
+		return;
+	}
+	size_t filled = (pattern_size < length) ? pattern_size : length;
+	memcpy(to, pattern, filled);
+	while (filled < length) {
+		size_t chunk = (filled < (length - filled)) ? filled : (length - filled);
+		memcpy(to + filled, to, chunk);
+		filled += chunk;
+	}
+}
+
+/* Returns the code of the smallest field width that can hold value */
+static size_t pvl_width_code(size_t value) {
+	size_t code = 0;
+	while ((((size_t)1 << code) < sizeof(size_t)) && (value >> (CHAR_BIT * ((size_t)1 << code)))) {
+		code++;
+	}
+	return code;
+}
+
+/* Store a value in width bytes, least significant byte first */
+static void pvl_encode(unsigned char *to, size_t value, size_t width) {
+	for (size_t i = 0; i < width; i++) {
+		to[i] = (unsigned char) (value >> (CHAR_BIT * i));
 	}
 }
 
+static size_t pvl_decode(const unsigned char *from, size_t width) {
+	size_t value = 0;
+	for (size_t i = 0; i < width; i++) {
+		value |= (size_t)(from[i]) << (CHAR_BIT * i);
+	}
+	return value;
+}
+
 /* Save the currently-marked memory content */
 static int pvl_save(struct pvl *pvl) {
 
@@ -232,62 +1318,167 @@ static int pvl_save(struct pvl *pvl) {
 	/* Get the total number of spans and marked bytes */
 	size_t spans = 0;
 	size_t size = 0;
-	pvl_stat(pvl, &spans, &size);
+	size_t widest = 0;
+	pvl_trace(pvl, PVL_PHASE_STAT, 0);
+	pvl_stat(pvl, &spans, &size, &widest);
+	pvl_trace(pvl, PVL_PHASE_STAT, 1);
 
 	/* Nothing to save */
 	if (spans == 0) {
 		return 0;
 	}
 
-	/* Track remaining bytes for write hints */
-	size_t content_size = size + (spans * 2 * sizeof(size_t));
+	/* Compact changes use the smallest field width that fits all span records */
+	size_t width = 0;
+	size_t span_header = 2 * sizeof(size_t);
+	size_t tag = 0;
+	if (pvl->compact) {
+		size_t code = pvl_width_code(widest);
+		width = (size_t)1 << code;
+		span_header = 1 + (2 * width);
+		tag = (PVL_COMPACT_TAG | code) << PVL_TAG_SHIFT;
+	}
 
 	/* Create a header for the change, accouting for the span header overhead */
 	size_t header[2] = {0};
-	header[0] = spans;
-	header[1] = content_size;
+	header[0] = tag | spans;
+	header[1] = size + (spans * span_header);
+
+	/* A compact span count must not reach into the tag */
+	pvl_trace(pvl, PVL_PHASE_WRITE, 0);
+	int result = (tag && (spans > PVL_SPANS_MASK)) || pvl_write_change(pvl, header, width);
+	pvl_trace(pvl, PVL_PHASE_WRITE, 1);
+	if (result) {
+		return 1;
+	}
 
-	/* Construct and save the change header */
-	if (pvl->write_cb(pvl->write_ctx, &header, sizeof(header), header[1])) {
+	/* Apply the written change before clearing it, a failure keeps the marks for a retry */
+	if (pvl->apply_cb && pvl_apply_change(pvl, spans)) {
 		return 1;
 	}
 
-	/* Save each span */
+	pvl_trace(pvl, PVL_PHASE_APPLY, 0);
 	size_t next = 0;
 	struct pvl_span span;
-	while((next = pvl_next_span(pvl, next, &span))) {
+	if (pvl->analysis) {
+		pvl_analysis_start(pvl->analysis);
+	}
+	while((next = pvl_next_run(pvl, next, &span))) {
 		if (! span.marked) {
 			continue;
 		}
-
-		/* Write the span header */
-		header[0] = span.index;
-		header[1] = span.index + span.length;
-		content_size -= sizeof(header);
-		if(pvl->write_cb(pvl->write_ctx, &header, sizeof(header), content_size)) {
-			return 1;
+		/* Measure the changed bytes before applying to mirror */
+		if (pvl->analysis) {
+			pvl_analyze_span(pvl, span);
+		}
+		if (pvl->heatmap) {
+			pvl_count_heat(pvl, span);
+		}
+		/* Apply to mirror */
+		if (pvl->mirror) {
+			memcpy(pvl->mirror + span.index, span.at, span.length);
 		}
+		/* Clear the span, extents are cleared at once */
+		if (! pvl->extents) {
+			pvl_clear_span(span);
+		}
+	}
+	pvl->extent_count = 0;
+	pvl_trace(pvl, PVL_PHASE_APPLY, 1);
+	if (pvl->stats) {
+		pvl->stats->changes_written++;
+	}
+
+	return 0;
+}
 
-		/* Write the span content */
-		content_size -= header[1];
-		if(pvl->write_cb(pvl->write_ctx, pvl->main + span.index, span.length, content_size)) {
+/* Pass each marked span to the apply handler */
+static int pvl_apply_change(struct pvl *pvl, size_t spans) {
+	size_t next = 0;
+	struct pvl_span span;
+	while((next = pvl_next_run(pvl, next, &span))) {
+		if (! span.marked) {
+			continue;
+		}
+		spans--;
+		if (pvl_apply(pvl, span.index, span.at, span.length, spans)) {
 			return 1;
 		}
 	}
+	return 0;
+}
 
-	next = 0;
-	while((next = pvl_next_span(pvl, next, &span))) {
+/* Pass a span to the apply handler, if any */
+static int pvl_apply(struct pvl *pvl, size_t offset, const char *from, size_t length, size_t remaining) {
+	if (pvl->apply_cb == NULL) {
+		return 0;
+	}
+	return pvl->apply_cb(pvl->apply_ctx, offset, from, length, remaining);
+}
+
+/* Write the change header and each marked span */
+static int pvl_write_change(struct pvl *pvl, size_t *header, size_t width) {
+	/* Track remaining bytes for write hints */
+	size_t content_size = header[1];
+	if (pvl->write_cb(pvl->write_ctx, header, 2 * sizeof(size_t), content_size)) {
+		return 1;
+	}
+	pvl_count_write(pvl, 2 * sizeof(size_t), 2 * sizeof(size_t));
+
+	size_t prev_end = 0;
+	size_t next = 0;
+	struct pvl_span span;
+	while((next = pvl_next_run(pvl, next, &span))) {
 		if (! span.marked) {
 			continue;
 		}
-		/* Apply to mirror */
-		if (pvl->mirror) {
-			memcpy(pvl->mirror + span.index, pvl->main + span.index, span.length);
+		if (pvl_write_span(pvl, span, width, &prev_end, &content_size)) {
+			return 1;
 		}
-		/* Clear the span */
-		pvl_clear_span(pvl, span);
 	}
+	return 0;
+}
+
+/* Write a span header in the change format indicated by width, followed by the span content */
+static int pvl_write_span(struct pvl *pvl, struct pvl_span span, size_t width, size_t *prev_end,
+		size_t *content_size) {
+	unsigned char record[1 + (2 * sizeof(size_t))];
+	size_t record_size = 0;
+	size_t payload = span.length;
+	if (width == 0) {
+		size_t header[2] = {0};
+		header[0] = span.index;
+		header[1] = span.index + span.length;
+		memcpy(record, header, sizeof(header));
+		record_size = sizeof(header);
+	} else {
+		size_t delta = 0;
+		size_t length = 0;
+		/* The sizing pass already scanned the span for fill content */
+		record[0] = pvl_record_fields(pvl, *prev_end, span, pvl_kept_fill(pvl, span), &delta, &length);
+		pvl_encode(record + 1, delta, width);
+		pvl_encode(record + 1 + width, length, width);
+		record_size = 1 + (2 * width);
+		payload = pvl_payload_size(record[0], span.length);
+	}
+	*prev_end = span.index + span.length;
 
+	/* Write the span header */
+	*content_size -= record_size;
+	if (pvl->write_cb(pvl->write_ctx, record, record_size, *content_size)) {
+		return 1;
+	}
+	pvl_count_write(pvl, record_size, record_size);
+
+	/* Write the span content, fill records only store their pattern */
+	*content_size -= payload;
+	if (pvl->write_cb(pvl->write_ctx, span.at, payload, *content_size)) {
+		return 1;
+	}
+	pvl_count_write(pvl, payload, 0);
+	if (pvl->stats) {
+		pvl->stats->spans_written++;
+	}
 	return 0;
 }
 
@@ -297,20 +1488,42 @@ static int pvl_load(struct pvl *pvl) {
 		int read_result;
 		size_t header[2] = {0};
 
-		read_result = pvl->read_cb(pvl->read_ctx, &header, sizeof(header), 0);
-		if (read_result == EOF) {
-			/* The read callback has successfully read all (or none) changes */
-			break;
-		}
-		if (read_result) {
-			/* The read callback failed to read a subsequent change but the pvl memory state
-			   is not disrupted - operation can continue. */
-			break;
+		if (pvl->load_pending) {
+			/* Resume at the change whose header was read by an earlier load or poll */
+			memcpy(header, pvl->load_header, sizeof(header));
+		} else {
+			read_result = pvl->read_cb(pvl->read_ctx, &header, sizeof(header), 0);
+			if (read_result == EOF) {
+				/* The read callback has successfully read all (or none) changes */
+				break;
+			}
+			if (read_result) {
+				/* The read callback failed to read a subsequent change but the pvl memory state
+				   is not disrupted - operation can continue. */
+				break;
+			}
+			/* Keep the header until the change is complete so that polling can resume at it */
+			memcpy(pvl->load_header, header, sizeof(header));
+			pvl->load_pending = 1;
 		}
 
+		size_t tag = header[0] >> PVL_TAG_SHIFT;
 		size_t spans = header[0];
 		size_t content_size = header[1];
 
+		/* Determine the change format, the header is kept and reported by polls until it is valid */
+		pvl->load_invalid = 1;
+		size_t width = 0;
+		size_t span_header = sizeof(header);
+		if (tag & PVL_COMPACT_TAG) {
+			spans &= PVL_SPANS_MASK;
+			width = (size_t)1 << (tag & PVL_WIDTH_MASK);
+			if (((tag & ~PVL_WIDTH_MASK) != PVL_COMPACT_TAG) || (width > sizeof(size_t))) {
+				break; /* unknown change format */
+			}
+			span_header = 1 + (2 * width);
+		}
+
 		/*
 		 * Validate the change header
 		 */
@@ -320,12 +1533,13 @@ static int pvl_load(struct pvl *pvl) {
 		if (spans > (pvl->length/2)) {
 			break; /* span count upper bound for a byte-tracking pvl with every other byte marked */
 		}
-		if (content_size < (spans*(sizeof(header)+1))) {
+		if (content_size < (spans*(span_header+1))) {
 			break; /* content size lower bound for a byte-tracking single byte mark */
 		}
 		if (content_size > (pvl->length/2*(sizeof(header)+1))) {
 			break; /* content size upper bound for a byte-tracking pvl with every other byte marked */
 		}
+		pvl->load_invalid = 0;
 
 		read_result = pvl->read_cb(pvl->read_ctx, NULL, 0, content_size);
 		if (read_result != 0) {
@@ -333,44 +1547,167 @@ static int pvl_load(struct pvl *pvl) {
 			   but the pvl memory state is not disrupted - operation can continue. */
 			 break;
 		}
+		pvl->load_pending = 0;
+
+		/* Read the whole change at once when it fits in the load buffer. Restore
+		   handlers consume span content from the read stream so they read by span. */
+		pvl->load_pos = 0;
+		pvl->load_bulk = (content_size <= pvl->load_size) && (pvl->restore_cb == NULL);
+		if (pvl->load_bulk && pvl->read_cb(pvl->read_ctx, pvl->load_buffer, content_size, 0)) {
+			/* Nothing has been applied yet - operation can continue. */
+			break;
+		}
 
 		/* Read each span */
-		for (size_t i = 0; i < spans; i++) {
+		size_t prev_end = 0;
+		size_t change_size = sizeof(header) + content_size;
+		pvl_trace(pvl, PVL_PHASE_LOAD, 0);
+		int result = 0;
+		for (size_t i = 0; (i < spans) && (result == 0); i++) {
 			/* At this point read should always succeed up to the remaining bytes. */
+			result = pvl_read_span(pvl, width, &prev_end, &content_size, spans - i - 1);
+		}
+		pvl_trace(pvl, PVL_PHASE_LOAD, 1);
+		if (result) {
+			return 1;
+		}
+		if (pvl->stats) {
+			pvl->stats->changes_loaded++;
+			pvl->stats->bytes_loaded += change_size;
+		}
+	}
 
-			/* Read the header */
-			content_size -= sizeof(header);
-			if (pvl->read_cb(pvl->read_ctx, &header, sizeof(header), content_size) != 0) {
-				return 1;
-			}
+	/* Apply to mirror, polls apply each span as it is loaded */
+	if (pvl->mirror && (! pvl->loaded)) {
+		for (struct pvl_region *r = pvl->regions; r; r = r->next) {
+			memcpy(pvl->mirror + r->offset, r->main, r->length);
+		}
+	}
+	pvl->loaded = 1;
 
-			/*
-			 * Validate the span header
-			 */
-			if (header[0] >= pvl->length) {
-				return 1; /* span start location must be within pvl main block */
-			}
-			if (header[1] >= pvl->length) {
-				return 1; /* span end location must be within pvl main block */
-			}
-			if (header[1] <= header[0]) {
-				return 1; /* invalid span end location */
-			}
+	return 0;
+}
 
-			/* Read the content */
-			content_size -= header[1];
-			if (pvl->read_cb(pvl->read_ctx, pvl->main + header[0], header[1] - header[0], content_size) != 0) {
-				return 1;
-			}
+/* Load the available changes, recording the latency */
+static int pvl_timed_load(struct pvl *pvl) {
+	if (pvl->stats == NULL) {
+		return pvl_load(pvl);
+	}
+	uint64_t since = pvl_now();
+	int result = pvl_load(pvl);
+	pvl_record_latency(pvl->stats->load_latency, since);
+	return result;
+}
+
+/* Read a span header in the change format indicated by width and apply the span content */
+static int pvl_read_span(struct pvl *pvl, size_t width, size_t *prev_end, size_t *content_size,
+		size_t remaining) {
+	unsigned char record[1 + (2 * sizeof(size_t))];
+	size_t start = 0;
+	size_t end = 0;
+	size_t pattern_size = 0;
+
+	/* Read the header */
+	size_t record_size = (width == 0) ? (2 * sizeof(size_t)) : (1 + (2 * width));
+	if (record_size > *content_size) {
+		return 1; /* span header must be within the change */
+	}
+	*content_size -= record_size;
+	if (pvl_read(pvl, record, record_size, *content_size) != 0) {
+		return 1;
+	}
+
+	if (width == 0) {
+		size_t header[2] = {0};
+		memcpy(header, record, sizeof(header));
+		start = header[0];
+		end = header[1];
+	} else {
+		if (*prev_end >= pvl->length) {
+			return 1; /* the previous span ends the pvl main block */
+		}
+		size_t delta = pvl_decode(record + 1, width);
+		size_t length = pvl_decode(record + 1 + width, width);
+		size_t unit = (record[0] & PVL_RECORD_SPANS) ? pvl_region_of(pvl, *prev_end)->span_length : 1;
+		if ((record[0] & ~PVL_RECORD_FLAGS) ||
+				((record[0] & PVL_RECORD_FILL) && (record[0] & PVL_RECORD_FILL_WORD))) {
+			return 1; /* unknown span record flags */
 		}
+		pattern_size = pvl_payload_size(record[0] & ~PVL_RECORD_SPANS, 0);
+		if ((delta > (pvl->length / unit)) || (length > (pvl->length / unit))) {
+			return 1; /* span location must be within pvl main block */
+		}
+		start = *prev_end + (delta * unit);
+		end = start + (length * unit);
 	}
 
-	/* Apply to mirror */
-	if (pvl->mirror) {
-		memcpy(pvl->mirror, pvl->main, pvl->length);
+	/*
+	 * Validate the span header
+	 */
+	if (start >= pvl->length) {
+		return 1; /* span start location must be within pvl main block */
+	}
+	if (end > pvl->length) {
+		return 1; /* span end location must be within pvl main block */
+	}
+	if (end <= start) {
+		return 1; /* invalid span end location */
+	}
+	struct pvl_region *region = pvl_region_of(pvl, start);
+	if (end > (region->offset + region->length)) {
+		return 1; /* span must be within a single region */
+	}
+	char *at = region->main + (start - region->offset);
+	if ((pattern_size ? pattern_size : (end - start)) > *content_size) {
+		return 1; /* span content must be within the change */
 	}
 
-	return 0;
+	/* Read and apply the fill pattern */
+	if (pattern_size) {
+		unsigned char pattern[PVL_FILL_WORD];
+		*content_size -= pattern_size;
+		if (pvl_read(pvl, pattern, pattern_size, *content_size) != 0) {
+			return 1;
+		}
+		if (pvl->restore_cb) {
+			*prev_end = end;
+			return pvl->restore_cb(pvl->restore_ctx, start, end - start, pattern, pattern_size,
+					*content_size);
+		}
+		pvl_fill(at, end - start, pattern, pattern_size);
+		*prev_end = end;
+		return pvl_loaded(pvl, start, at, end - start, remaining);
+	}
+
+	/* Read the content, or leave it to the restore handler */
+	*content_size -= end - start;
+	if (pvl->restore_cb) {
+		*prev_end = end;
+		return pvl->restore_cb(pvl->restore_ctx, start, end - start, NULL, 0, *content_size);
+	}
+	if (pvl_read(pvl, at, end - start, *content_size) != 0) {
+		return 1;
+	}
+	*prev_end = end;
+	return pvl_loaded(pvl, start, at, end - start, remaining);
+}
+
+/* Pass on a span that has been read into main, updating the mirror when polling */
+static int pvl_loaded(struct pvl *pvl, size_t offset, const char *from, size_t length, size_t remaining) {
+	if (pvl->mirror && pvl->loaded) {
+		memcpy(pvl->mirror + offset, from, length);
+	}
+	return pvl_apply(pvl, offset, from, length, remaining);
+}
+
+/* Read the next bytes of the current change from the load buffer or the read handler */
+static int pvl_read(struct pvl *pvl, void *to, size_t length, size_t remaining) {
+	if (pvl->load_bulk) {
+		memcpy(to, pvl->load_buffer + pvl->load_pos, length);
+		pvl->load_pos += length;
+		return 0;
+	}
+	return pvl->read_cb(pvl->read_ctx, to, length, remaining);
 }
 
 static void pvl_detect_leaks(struct pvl *pvl) {
@@ -378,29 +1715,51 @@ static void pvl_detect_leaks(struct pvl *pvl) {
 	struct pvl_span span;
 	while((next = pvl_next_span(pvl, next, &span))) {
 		if (! span.marked) {
-			pvl_detect_leaks_inner(pvl, span.index, span.length);
+			pvl_detect_leaks_inner(pvl, span);
 		}
 	}
 }
 
-static void pvl_detect_leaks_inner(struct pvl *pvl, size_t from, size_t to) {
+static void pvl_detect_leaks_inner(struct pvl *pvl, struct pvl_span span) {
+	const char *main = span.at;
+	const char *mirror = pvl->mirror + span.index;
 	size_t in_diff = 0;
 	size_t diff_start = 0;
-	for (size_t i = from; i <= to; i++) {
+	for (size_t i = 0; i < span.length; i++) {
 		if (in_diff) {
-			if (pvl->main[i] == pvl->mirror[i]) {
+			if (main[i] == mirror[i]) {
 				/* Report diff */
-				pvl->leak_cb(pvl->leak_ctx, (pvl->main)+diff_start, i-diff_start);
+				pvl_report_leak(pvl, span.at+diff_start, i-diff_start);
 				/* Clear trackers */
 				in_diff = 0;
 				diff_start = 0;
 			}
 		} else {
-			if (pvl->main[i] != pvl->mirror[i]) {
+			if (main[i] != mirror[i]) {
 				/* Set trackers */
 				in_diff = 1;
 				diff_start = i;
 			}
 		}
 	}
+	/* Report a diff that reaches the end of the span */
+	if (in_diff) {
+		pvl_report_leak(pvl, span.at+diff_start, span.length-diff_start);
+	}
+}
+
+static void pvl_report_leak(struct pvl *pvl, char *start, size_t length) {
+	if (pvl->stats) {
+		pvl->stats->leak_reports++;
+		pvl->stats->leaked_bytes += length;
+	}
+	pvl->leak_cb(pvl->leak_ctx, start, length);
+}
+
+/* Count bytes passed to the write callback, header is the part of them that is not content */
+static void pvl_count_write(struct pvl *pvl, size_t length, size_t header) {
+	if (pvl->stats) {
+		pvl->stats->bytes_written += length;
+		pvl->stats->header_bytes += header;
+	}
 }
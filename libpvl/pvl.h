@@ -24,7 +24,9 @@
  */
 #pragma once
 
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /*
@@ -39,6 +41,70 @@ struct pvl;
  */
 size_t pvl_sizeof(size_t span_count);
 
+/*
+ * Latency histograms have log2 buckets of nanoseconds. Bucket i counts
+ * latencies in [2^i, 2^(i+1)), bucket zero also counts zero and the last
+ * bucket counts everything above.
+ */
+#define PVL_STATS_BUCKETS 32
+
+/* Only every PVL_STATS_MARK_SAMPLE-th pvl_mark call is timed */
+#define PVL_STATS_MARK_SAMPLE 64
+
+/*
+ * Cumulative statistics of a pvl instance, collected since pvl_set_stats
+ */
+struct pvl_stats {
+	uint64_t marks;          /* successful pvl_mark calls */
+	uint64_t marked_bytes;   /* bytes passed to successful pvl_mark calls */
+	uint64_t commits;        /* pvl_commit calls */
+	uint64_t changes_written;
+	uint64_t spans_written;
+	uint64_t bytes_written;  /* all bytes passed to the write callback */
+	uint64_t header_bytes;   /* change headers and span records within bytes_written */
+	uint64_t leak_reports;
+	uint64_t leaked_bytes;
+	uint64_t changes_loaded;
+	uint64_t bytes_loaded;
+	uint64_t mark_latency[PVL_STATS_BUCKETS];
+	uint64_t commit_latency[PVL_STATS_BUCKETS];
+	uint64_t load_latency[PVL_STATS_BUCKETS];
+};
+
+/* Write amplification analysis considers span lengths of 2^0 up to 2^(PVL_ANALYSIS_CANDIDATES-1) */
+#define PVL_ANALYSIS_CANDIDATES 32
+
+/* .. for the whole block and for each of PVL_ANALYSIS_SLICES equal slices of it */
+#define PVL_ANALYSIS_SLICES 16
+
+/*
+ * Write amplification analysis of a pvl instance, collected since pvl_set_analysis.
+ * Offsets and slices refer to the combined block of all regions.
+ */
+struct pvl_analysis {
+	uint64_t commits;
+	uint64_t changes;         /* commits that persisted a change */
+	uint64_t committed_bytes; /* bytes in committed spans */
+	uint64_t changed_bytes;   /* bytes in committed spans that differ from the mirror */
+	uint64_t mark_sizes[PVL_STATS_BUCKETS];    /* log2 histogram of mark lengths */
+	uint64_t mark_slices[PVL_ANALYSIS_SLICES]; /* marks by the slice they start in */
+	/* spans of 2^i bytes and runs of adjacent such spans that held changed bytes, by slice */
+	uint64_t chunks[PVL_ANALYSIS_SLICES][PVL_ANALYSIS_CANDIDATES];
+	uint64_t runs[PVL_ANALYSIS_SLICES][PVL_ANALYSIS_CANDIDATES];
+	/* last counted span of each length during a commit */
+	size_t last[PVL_ANALYSIS_CANDIDATES];
+};
+
+/* Tuning advice based on a write amplification analysis */
+struct pvl_advice {
+	size_t span_count;            /* recommended span_count for the whole block */
+	uint64_t journal_bytes;       /* predicted journal bytes with it */
+	uint64_t scan_cost;           /* predicted spans scanned by commits with it */
+	/* recommended span length for each slice if it were a separate region */
+	size_t slice_span_length[PVL_ANALYSIS_SLICES];
+	uint64_t split_journal_bytes; /* predicted journal bytes with them */
+};
+
 /*
  * Callback for persisting changes
  *
@@ -89,6 +155,64 @@ typedef int read_callback(void *ctx, void *to, size_t length, size_t remaining);
  */
 typedef void leak_callback(void *ctx, void *start, size_t length);
 
+/*
+ * Callback for indexing loaded spans instead of applying them to main
+ *
+ * Passed parameters
+ * - Caller-provided context
+ * - Offset of the span in the pvl-managed memory block
+ * - Length of the span
+ * - The fill pattern of the span, repeated from its start, or NULL if
+ *    the span content is next in the read stream. The callback must
+ *    consume it from the read handler's source.
+ * - Size of the fill pattern
+ * - Number of remaining bytes of the same change after the span content
+ *
+ * Returns
+ * - Zero on success, non-zero otherwise
+ */
+typedef int restore_callback(void *ctx, size_t offset, size_t length, const unsigned char *pattern,
+		size_t pattern_size, size_t remaining);
+
+/*
+ * Callback for applying the spans of a change elsewhere once they are in
+ * main, e.g. to a data file that backs main. See backing.h.
+ *
+ * Passed parameters
+ * - Caller-provided context
+ * - Offset of the span in the pvl-managed memory block
+ * - Pointer to the span content in main
+ * - Length of the span
+ * - Number of remaining spans of the same change after this one
+ *
+ * Returns
+ * - Zero on success, non-zero otherwise
+ */
+typedef int apply_callback(void *ctx, size_t offset, const char *from, size_t length, size_t remaining);
+
+/* Phases of commits and loads reported to tracing */
+enum pvl_phase {
+	PVL_PHASE_LEAKS, /* leak detection */
+	PVL_PHASE_STAT,  /* counting marked spans and bytes */
+	PVL_PHASE_WRITE, /* writing the change */
+	PVL_PHASE_APPLY, /* updating the mirror and clearing marks */
+	PVL_PHASE_LOAD   /* reading the spans of a single change */
+};
+
+/*
+ * Callback for tracing commit and load phases
+ *
+ * Passed parameters
+ * - Caller-provided context
+ * - The phase
+ * - Zero at the start of the phase, non-zero at its end
+ * - CLOCK_MONOTONIC timestamp in nanoseconds
+ *
+ * Returns
+ * - Nothing
+ */
+typedef void trace_callback(void *ctx, enum pvl_phase phase, _Bool end, uint64_t timestamp);
+
 /*
  * Initialize pvl_t at the provided location.
  *
@@ -107,20 +231,282 @@ typedef void leak_callback(void *ctx, void *start, size_t length);
  */
 struct pvl *pvl_init(char *at, char *main, size_t length, size_t span_count);
 
+/*
+ * .. and the same for additional regions.
+ */
+size_t pvl_region_sizeof(size_t span_count);
+
+/*
+ * Add a memory block to be managed by a pvl instance, next to the one
+ * passed to pvl_init. Each region tracks changes with its own span_count
+ * while a commit persists the marked spans of all regions in a single change.
+ *
+ * Regions are laid out one after another in the order of their addition,
+ * forming a combined block. They must be added before setting a mirror or
+ * a read handler on the pvl instance and they must be added in the same
+ * order when loading.
+ *
+ * Passed parameters
+ * pvl                - The pvl instance
+ * at                 - Pointer to where the region object should be initialized,
+ *                      sized with pvl_region_sizeof(span_count) and aligned to max_align_t
+ * main               - Pointer to the start of a pvl-managed memory block
+ * length             - The lenght of the pvl-managed memory block
+ *                      It must be divisible by span_count.
+ * span_count         - The number of internal spans used to track changes
+ *
+ * Returns
+ * int                - Zero on success, non-zero otherwise
+ */
+int pvl_add_region(struct pvl *pvl, char *at, char *main, size_t length, size_t span_count);
+
+/*
+ * Configure a restore handler that is passed each loaded span instead of
+ * main, e.g. to restore main lazily on first access. See lazy.h.
+ *
+ * It must be set before the read handler and excludes a mirror.
+ */
+int pvl_set_restore_cb(struct pvl *pvl, void *restore_ctx, restore_callback restore_cb);
+
+/*
+ * Read each change on load with a single read handler call into a caller-provided
+ * buffer and decode it in memory. Changes larger than size, and all changes when
+ * a restore handler is set, are read span by span. It must be set before the
+ * read handler.
+ */
+int pvl_set_load_buffer(struct pvl *pvl, char *buffer, size_t size);
+
+/*
+ * Configure an apply handler that is passed each span of a change after the
+ * change is written on commit, and after the span is read into main on load.
+ * A failed apply keeps the marks and fails the commit so that it is retried.
+ * It must be set before the read handler. Spans passed to a restore handler
+ * are not applied.
+ */
+int pvl_set_apply_cb(struct pvl *pvl, void *apply_ctx, apply_callback apply_cb);
+
 /* Configure the read handler on a pvl instance and trigger a load */
 int pvl_set_read_cb(struct pvl *pvl, void *read_ctx, read_callback read_cb);
 
+/*
+ * Apply the changes that became available to the read handler since the
+ * load or the last poll, e.g. to follow a journal that another process
+ * appends to. A trailing change that is not complete yet is left for the
+ * next poll. The read handler should not consume a partially available
+ * change header, see journal.h.
+ *
+ * Returns non-zero when the next change header is invalid, e.g. in a corrupt
+ * or foreign journal. Polling cannot get past it and keeps failing. Each poll
+ * is recorded in the load latency stats like the initial load.
+ */
+int pvl_poll(struct pvl *pvl);
+
 /* Configure the write handler on a pvl instance */
 int pvl_set_write_cb(struct pvl *pvl, void *write_ctx, write_callback write_cb);
 
-/* Configure a mirror on the pvl instance, used for leak detection and other stats*/
+/*
+ * Configure a mirror on the pvl instance, used for leak detection and other stats.
+ * The mirror must be as large as all regions combined.
+ */
 int pvl_set_mirror(struct pvl *pvl, char *mirror);
 
 /* Configure the leak detection handler on a pvl instance. Requires a mirror */
 int pvl_set_leak_cb(struct pvl *pvl, void *leak_ctx, leak_callback leak_cb);
 
+/*
+ * Configure the trace handler on a pvl instance. It is called at the start
+ * and end of each commit and load phase. Set it before the read handler
+ * to trace the load.
+ */
+int pvl_set_trace_cb(struct pvl *pvl, void *trace_ctx, trace_callback trace_cb);
+
+/*
+ * Analyze write amplification on a pvl instance in caller-provided storage.
+ *
+ * Commits compare each committed span against the mirror to count the bytes
+ * that actually changed, and the spans of each candidate length that would
+ * have held them. Marks are recorded by size and offset. This is meant for
+ * canaries and test runs as it scans all committed bytes.
+ *
+ * Requires a mirror. The combined length must be divisible by PVL_ANALYSIS_SLICES.
+ */
+int pvl_set_analysis(struct pvl *pvl, struct pvl_analysis *analysis);
+
+/*
+ * Recommend a span_count, and span lengths for splitting the block into
+ * regions, that minimize the predicted journal bytes, in the default encoding
+ * and assuming that marks match changed bytes, plus scan_cost bytes for each
+ * span scanned by a commit.
+ */
+int pvl_advise(struct pvl *pvl, size_t scan_cost, struct pvl_advice *advice);
+
+/* Returns the size of a heatmap for all spans of a pvl instance, including its regions */
+size_t pvl_heatmap_sizeof(struct pvl *pvl);
+
+/*
+ * Count the commits of each internal span in a caller-provided heatmap,
+ * sized with pvl_heatmap_sizeof, with the spans of each region following
+ * the spans of the previous one. Spans written by coalescing or within
+ * a committed extent are counted as well. Set it after adding all regions.
+ */
+int pvl_set_heatmap(struct pvl *pvl, uint64_t *heatmap);
+
+/* Copy a snapshot of the heatmap, optionally resetting its counters */
+int pvl_get_heatmap(struct pvl *pvl, uint64_t *heatmap, _Bool reset);
+
+/* Export a heatmap snapshot as CSV of offset, length and commits for each committed span */
+int pvl_heatmap_csv(struct pvl *pvl, const uint64_t *heatmap, FILE *to);
+
+/* Returns the size of an extent array that can track up to capacity distinct ranges */
+size_t pvl_extents_sizeof(size_t capacity);
+
+/*
+ * Switch a pvl instance to exact byte-range tracking.
+ *
+ * pvl_mark will record the exact ranges passed to it in a sorted array of
+ * extents at the provided location, coalescing overlapping and adjacent ones.
+ * Commits then write only marked bytes and their cost is proportional to the
+ * number of distinct ranges instead of span_count. This suits very large,
+ * sparsely written blocks.
+ *
+ * When more than capacity distinct ranges are marked the two closest extents
+ * are merged together with the gap between them.
+ *
+ * Ensure that the location is aligned to max_align_t and sized with
+ * pvl_extents_sizeof(capacity). Must be set before marking any spans.
+ */
+int pvl_set_extents(struct pvl *pvl, char *extents, size_t capacity);
+
+/*
+ * Configure gap-aware coalescing of marked spans on a pvl instance.
+ *
+ * Each persisted span costs a span header and a write callback call. With
+ * coalescing marked spans separated by a clean gap are persisted as a single
+ * span, including the gap bytes, when the gap is no longer than the span header
+ * of the change encoding in use plus call_cost - the caller's estimate of a
+ * write callback call in bytes.
+ * Pass zero to coalesce only when it does not grow the persisted change.
+ */
+int pvl_set_coalesce(struct pvl *pvl, size_t call_cost);
+
+/*
+ * Configure a pvl instance to persist changes in the compact encoding.
+ *
+ * Compact span records consist of a flag byte followed by the span offset,
+ * as a delta from the end of the previous span, and the span length, both in
+ * span_length units when possible. All fields of a change share the smallest
+ * byte width that fits them. Changes in both encodings can be loaded by any
+ * pvl instance.
+ *
+ * The top byte of the span count holds the encoding, so a compact change has
+ * fewer than 2^24 spans on 32-bit platforms. Commits of more spans fail and
+ * keep their marks.
+ */
+int pvl_set_compact(struct pvl *pvl);
+
 /* Mark a span of memory for inclusion in the next commit. */
 int pvl_mark(struct pvl *pvl, const char *start, size_t length);
 
+/*
+ * The hot fields of a pvl instance for marking in the caller's code.
+ * Treat it as read-only and do not use it after reconfiguring the pvl.
+ */
+struct pvl_view {
+	struct pvl *pvl;
+	const char *main;
+	size_t length;
+	unsigned int span_shift;
+	unsigned char *spans;
+};
+
+/*
+ * Get a view of the memory block passed to pvl_init for pvl_mark_view.
+ * Requires a power-of-two span length and fails with exact range tracking.
+ */
+int pvl_get_view(struct pvl *pvl, struct pvl_view *view);
+
+/*
+ * Mark a span of memory like pvl_mark, inline and with shifts instead of divisions.
+ *
+ * Spans outside of the viewed block or over more than CHAR_BIT internal spans
+ * are passed on to pvl_mark. Marks made inline are not counted by pvl_set_stats
+ * or pvl_set_analysis.
+ */
+static inline int pvl_mark_view(const struct pvl_view *view, const char *start, size_t length) {
+	size_t offset = (size_t)(start - view->main);
+	/* Starts before main wrap around to large offsets */
+	if ((start == NULL) || (length == 0) || (offset >= view->length) || (length > (view->length - offset))) {
+		return pvl_mark(view->pvl, start, length);
+	}
+	size_t from_pos = offset >> view->span_shift;
+	size_t to_pos = (offset + length - 1) >> view->span_shift;
+	if ((to_pos - from_pos) >= CHAR_BIT) {
+		return pvl_mark(view->pvl, start, length);
+	}
+	for (size_t i = from_pos; i <= to_pos; i++) {
+		view->spans[i / CHAR_BIT] |= (unsigned char)(1u << (i % CHAR_BIT));
+	}
+	return 0;
+}
+
+/* A span of memory for pvl_mark_many */
+struct pvl_range {
+	const char *start;
+	size_t length;
+};
+
+/*
+ * Mark many spans of memory at once. Consecutive ranges over the same or
+ * adjacent internal spans are merged before marking, so sorting the ranges
+ * by address helps. On an invalid range it returns non-zero, leaving the
+ * ranges before it marked.
+ */
+int pvl_mark_many(struct pvl *pvl, const struct pvl_range *ranges, size_t count);
+
 /* Persist the marked spans. */
 int pvl_commit(struct pvl *pvl);
+
+/*
+ * Commit automatically instead of at points chosen by domain code.
+ *
+ * Passed parameters
+ * dirty_bytes        - pvl_mark and pvl_mark_many commit once this many bytes
+ *                      have been marked since the last commit, zero disables it.
+ *                      Overlapping marks are counted again.
+ * max_age            - pvl_tick commits once the oldest uncommitted mark is
+ *                      this many nanoseconds old, zero disables it.
+ *
+ * A failed automatic commit does not fail the marking call, see
+ * pvl_auto_commit_failed. The marks are kept and marking calls stop committing
+ * until the next pvl_tick, which retries the commit, or pvl_commit. Marks made
+ * inline by pvl_mark_view are not counted. See flusher.h for calling pvl_tick
+ * from a background thread.
+ *
+ * Automatic commits can fall between the marks of an update that is split
+ * across several of them, and a crash then leaves only part of the update
+ * persisted. Callers that need a group of marks to be committed together must
+ * pass zero dirty_bytes and keep pvl_tick from running during the group, e.g.
+ * by holding the flusher's lock across it.
+ */
+int pvl_set_auto_commit(struct pvl *pvl, size_t dirty_bytes, uint64_t max_age);
+
+/*
+ * Commit if the oldest uncommitted mark is older than the max_age set by
+ * pvl_set_auto_commit, or if the last automatic commit failed
+ */
+int pvl_tick(struct pvl *pvl);
+
+/* Returns non-zero while a failed automatic commit waits for pvl_tick or pvl_commit */
+int pvl_auto_commit_failed(struct pvl *pvl);
+
+/*
+ * Collect statistics of a pvl instance in caller-provided storage.
+ *
+ * Counters are updated on each call. Commits, loads and polls are timed on
+ * each call while marks are sampled to keep their cost low. Set it before the
+ * read handler to include the load.
+ */
+int pvl_set_stats(struct pvl *pvl, struct pvl_stats *stats);
+
+/* Copy a snapshot of the statistics collected by a pvl instance */
+int pvl_get_stats(struct pvl *pvl, struct pvl_stats *stats);
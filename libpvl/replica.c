@@ -0,0 +1,361 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Streaming replication for libpvl (POSIX, implementation)
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "replica.h"
+
+struct pvl_replica_follower {
+	int fd;
+	int ack_fd;
+	_Bool alive;
+	uint64_t acked;
+	/* a partially read acknowledgement */
+	unsigned char ack[sizeof(uint64_t)];
+	size_t ack_fill;
+};
+
+struct pvl_replica {
+	void *write_ctx;
+	write_callback *write_cb;
+	uint64_t sequence;
+	_Bool in_change; /* part of a change has been sent */
+	size_t capacity;
+	size_t count;
+	struct pollfd *polls;
+	struct pvl_replica_follower followers[];
+};
+
+struct pvl_follower {
+	int fd;
+	int ack_fd;
+	_Bool acking;
+	uint64_t sequence;
+	uint64_t acked;
+	/* the change being applied */
+	size_t buffer_size;
+	size_t pos;
+	size_t length;
+	unsigned char buffer[];
+};
+
+static void pvl_replica_drop(struct pvl_replica_follower *follower);
+static int pvl_replica_send(int fd, const unsigned char *from, size_t length);
+static void pvl_replica_receive(struct pvl_replica_follower *follower);
+static int pvl_replica_recv(int fd, unsigned char *to, size_t length);
+static uint64_t pvl_replica_now(void);
+
+size_t pvl_replica_sizeof(size_t capacity) {
+	return sizeof(struct pvl_replica) + (capacity * (sizeof(struct pvl_replica_follower) + sizeof(struct pollfd)));
+}
+
+struct pvl_replica *pvl_replica_init(char *at, size_t capacity, void *write_ctx, write_callback write_cb) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if (capacity == 0) {
+		return NULL;
+	}
+	struct pvl_replica *replica = (struct pvl_replica*) at;
+	memset(replica, 0, pvl_replica_sizeof(capacity));
+	replica->write_ctx = write_ctx;
+	replica->write_cb = write_cb;
+	replica->capacity = capacity;
+	replica->polls = (struct pollfd*) &replica->followers[capacity];
+	return replica;
+}
+
+int pvl_replica_add(struct pvl_replica *replica, int fd, int ack_fd) {
+	if (replica == NULL) {
+		return 1;
+	}
+	if ((fd < 0) || (ack_fd < 0)) {
+		return 1;
+	}
+	if (replica->in_change) {
+		return 1; /* followers start at a change boundary */
+	}
+
+	/* Reuse the slot of a dropped follower */
+	size_t slot = 0;
+	while ((slot < replica->count) && replica->followers[slot].alive) {
+		slot++;
+	}
+	if (slot == replica->capacity) {
+		return 1;
+	}
+	if (slot == replica->count) {
+		replica->count++;
+	}
+	struct pvl_replica_follower *follower = &replica->followers[slot];
+	memset(follower, 0, sizeof(struct pvl_replica_follower));
+	follower->fd = fd;
+	follower->ack_fd = ack_fd;
+	follower->alive = 1;
+	follower->acked = replica->sequence;
+	return 0;
+}
+
+int pvl_replica_close(struct pvl_replica *replica) {
+	if (replica == NULL) {
+		return 1;
+	}
+	for (size_t i = 0; i < replica->count; i++) {
+		pvl_replica_drop(&replica->followers[i]);
+	}
+	return 0;
+}
+
+int pvl_replica_write(void *ctx, void *from, size_t length, size_t remaining) {
+	if ((ctx == NULL) || (from == NULL) || (length == 0)) {
+		return 1;
+	}
+	struct pvl_replica *replica = (struct pvl_replica*)(ctx);
+
+	/* The journal comes first, a failed commit is retried from its start */
+	if (replica->write_cb && replica->write_cb(replica->write_ctx, from, length, remaining)) {
+		if (replica->in_change) {
+			/* The followers have part of a change that will be sent anew */
+			pvl_replica_close(replica);
+			replica->in_change = 0;
+		}
+		return 1;
+	}
+
+	for (size_t i = 0; i < replica->count; i++) {
+		struct pvl_replica_follower *follower = &replica->followers[i];
+		if (follower->alive && pvl_replica_send(follower->fd, (const unsigned char*) from, length)) {
+			pvl_replica_drop(follower);
+		}
+	}
+	replica->in_change = remaining != 0;
+	if (remaining == 0) {
+		replica->sequence++;
+	}
+	return 0;
+}
+
+uint64_t pvl_replica_sequence(struct pvl_replica *replica) {
+	if (replica == NULL) {
+		return 0;
+	}
+	return replica->sequence;
+}
+
+int pvl_replica_wait(struct pvl_replica *replica, uint64_t sequence, size_t followers, int timeout) {
+	if (replica == NULL) {
+		return 1;
+	}
+	uint64_t deadline = pvl_replica_now() + ((uint64_t) timeout * 1000000u);
+	while (1) {
+		/* Count the followers that have acknowledged and poll the others */
+		size_t acked = 0;
+		size_t polled = 0;
+		for (size_t i = 0; i < replica->count; i++) {
+			struct pvl_replica_follower *follower = &replica->followers[i];
+			if (! follower->alive) {
+				continue;
+			}
+			if (follower->acked >= sequence) {
+				acked++;
+				continue;
+			}
+			replica->polls[polled].fd = follower->ack_fd;
+			replica->polls[polled].events = POLLIN;
+			replica->polls[polled].revents = 0;
+			polled++;
+		}
+		if (acked >= followers) {
+			return 0;
+		}
+		if ((acked + polled) < followers) {
+			return 1; /* too few followers remain */
+		}
+
+		int wait = -1;
+		if (timeout >= 0) {
+			uint64_t now = pvl_replica_now();
+			if (now >= deadline) {
+				return 1;
+			}
+			wait = (int) (((deadline - now) + 999999u) / 1000000u);
+		}
+		int ready = poll(replica->polls, (nfds_t) polled, wait);
+		if ((ready < 0) && (errno != EINTR)) {
+			return 1;
+		}
+
+		/* Read the acknowledgements of the followers that are ready */
+		polled = 0;
+		for (size_t i = 0; (ready > 0) && (i < replica->count); i++) {
+			struct pvl_replica_follower *follower = &replica->followers[i];
+			if ((! follower->alive) || (follower->acked >= sequence)) {
+				continue;
+			}
+			if (replica->polls[polled++].revents) {
+				pvl_replica_receive(follower);
+			}
+		}
+	}
+}
+
+size_t pvl_follower_sizeof(size_t buffer_size) {
+	return sizeof(struct pvl_follower) + buffer_size;
+}
+
+struct pvl_follower *pvl_follower_init(char *at, int fd, int ack_fd, size_t buffer_size, uint64_t sequence) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if ((fd < 0) || (ack_fd < 0) || (buffer_size == 0)) {
+		return NULL;
+	}
+	struct pvl_follower *follower = (struct pvl_follower*) at;
+	memset(follower, 0, sizeof(struct pvl_follower));
+	follower->fd = fd;
+	follower->ack_fd = ack_fd;
+	follower->acking = 1;
+	follower->sequence = sequence;
+	follower->acked = sequence;
+	follower->buffer_size = buffer_size;
+	return follower;
+}
+
+int pvl_follower_read(void *ctx, void *to, size_t length, size_t remaining) {
+	if (ctx == NULL) {
+		return 1;
+	}
+	struct pvl_follower *follower = (struct pvl_follower*)(ctx);
+
+	/* Receive the rest of the change before any of it is applied */
+	if (to == NULL) {
+		if (remaining > follower->buffer_size) {
+			return 1;
+		}
+		if (pvl_replica_recv(follower->fd, follower->buffer, remaining)) {
+			return 1;
+		}
+		follower->pos = 0;
+		follower->length = remaining;
+		return 0;
+	}
+	if (follower->pos < follower->length) {
+		if (length > (follower->length - follower->pos)) {
+			return 1;
+		}
+		memcpy(to, follower->buffer + follower->pos, length);
+		follower->pos += length;
+		return 0;
+	}
+
+	/* Every change before the next header has been applied */
+	if (follower->acked < follower->sequence) {
+		unsigned char ack[sizeof(uint64_t)];
+		memcpy(ack, &follower->sequence, sizeof(ack));
+		/* keep applying without acknowledging once that fails */
+		follower->acking = follower->acking && (pvl_replica_send(follower->ack_fd, ack, sizeof(ack)) == 0);
+		follower->acked = follower->sequence;
+	}
+	int result = pvl_replica_recv(follower->fd, (unsigned char*) to, length);
+	if (result == 0) {
+		follower->sequence++;
+	}
+	return result;
+}
+
+uint64_t pvl_follower_sequence(struct pvl_follower *follower) {
+	if (follower == NULL) {
+		return 0;
+	}
+	return follower->acked;
+}
+
+static void pvl_replica_drop(struct pvl_replica_follower *follower) {
+	if (! follower->alive) {
+		return;
+	}
+	follower->alive = 0;
+	close(follower->fd);
+	if (follower->ack_fd != follower->fd) {
+		close(follower->ack_fd);
+	}
+}
+
+/* Send all bytes, without raising SIGPIPE on sockets */
+static int pvl_replica_send(int fd, const unsigned char *from, size_t length) {
+	_Bool socket = 1;
+	while (length) {
+		ssize_t done = socket ? send(fd, from, length, MSG_NOSIGNAL) : write(fd, from, length);
+		if ((done < 0) && ((errno == EINTR) || (socket && (errno == ENOTSOCK)))) {
+			socket = socket && (errno != ENOTSOCK); /* write to descriptors other than sockets */
+			continue;
+		}
+		if (done <= 0) {
+			return 1;
+		}
+		from += done;
+		length -= (size_t) done;
+	}
+	return 0;
+}
+
+/* Read the available part of an acknowledgement, dropping a closed follower */
+static void pvl_replica_receive(struct pvl_replica_follower *follower) {
+	ssize_t done = read(follower->ack_fd, follower->ack + follower->ack_fill,
+			sizeof(follower->ack) - follower->ack_fill);
+	if (done <= 0) {
+		/* An interrupted read is retried on the next poll */
+		if ((done == 0) || (errno != EINTR)) {
+			pvl_replica_drop(follower);
+		}
+		return;
+	}
+	follower->ack_fill += (size_t) done;
+	if (follower->ack_fill == sizeof(follower->ack)) {
+		uint64_t acked;
+		memcpy(&acked, follower->ack, sizeof(acked));
+		if (acked > follower->acked) {
+			follower->acked = acked;
+		}
+		follower->ack_fill = 0;
+	}
+}
+
+/* Receive exactly length bytes, EOF if the stream ends before any of them */
+static int pvl_replica_recv(int fd, unsigned char *to, size_t length) {
+	size_t received = 0;
+	while (received < length) {
+		ssize_t done = read(fd, to + received, length - received);
+		if (done == 0) {
+			return received ? 1 : EOF;
+		}
+		if ((done < 0) && (errno != EINTR)) {
+			return 1;
+		}
+		received += (done > 0) ? (size_t) done : 0; /* interrupted reads are retried */
+	}
+	return 0;
+}
+
+static uint64_t pvl_replica_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000u) + (uint64_t)ts.tv_nsec;
+}
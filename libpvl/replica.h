@@ -0,0 +1,109 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Streaming replication for libpvl (POSIX)
+ *
+ * The replica write handler passes each change to an optional journal write
+ * handler and then tees it to followers over file descriptors, e.g. pipes
+ * or Unix sockets. Followers acknowledge the number of changes they have
+ * applied so that the primary can wait for them after a commit.
+ *
+ * A follower passes pvl_follower_read to pvl_set_read_cb, whose load then
+ * applies the changes continuously as they arrive, validated the same way
+ * as a journal, and returns once the stream is closed. Each change is read
+ * whole before it is applied so that a primary that stops in the middle of
+ * a change leaves the follower at the previous one. The follower main must
+ * not be used until the load returns.
+ *
+ * A follower must start from the state of the primary when it is added,
+ * e.g. by adding all followers before the first commit or by loading a
+ * copy of the journal taken at that point.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pvl.h"
+
+struct pvl_replica;
+
+/* Returns the size of a replica sender for up to capacity followers */
+size_t pvl_replica_sizeof(size_t capacity);
+
+/*
+ * Initialize a replica sender at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the sender should be initialized
+ * capacity           - The maximum number of followers
+ * write_ctx          - Context of the journal write handler
+ * write_cb           - The journal write handler, called before the followers, or NULL
+ *
+ * Returns
+ * pvl_replica*       - A valid pointer in the case of success, NULL otherwise.
+ */
+struct pvl_replica *pvl_replica_init(char *at, size_t capacity, void *write_ctx, write_callback write_cb);
+
+/*
+ * Add a follower between commits. Changes are sent over fd and acknowledgements
+ * are read from ack_fd, which may be the same descriptor. The sender takes
+ * ownership of both and closes them when the follower fails, or when a change
+ * fails part way through, which ends the loads of the followers. The slots of
+ * dropped followers are reused, so that they can be added again.
+ */
+int pvl_replica_add(struct pvl_replica *replica, int fd, int ack_fd);
+
+/* Close the streams of all followers, which ends their loads */
+int pvl_replica_close(struct pvl_replica *replica);
+
+/*
+ * Write handler, see write_callback in pvl.h
+ *
+ * A journal write that fails after part of a change was sent drops every
+ * follower, as the retried change cannot be told apart from the rest of the
+ * partial one. Resync them by adding them again from a copy of the journal.
+ */
+int pvl_replica_write(void *ctx, void *from, size_t length, size_t remaining);
+
+/* Returns the number of changes sent since initialization */
+uint64_t pvl_replica_sequence(struct pvl_replica *replica);
+
+/*
+ * Wait until at least followers followers have acknowledged sequence changes.
+ * A negative timeout in milliseconds waits indefinitely. Returns non-zero on
+ * timeout or when too few followers remain.
+ */
+int pvl_replica_wait(struct pvl_replica *replica, uint64_t sequence, size_t followers, int timeout);
+
+struct pvl_follower;
+
+/* Returns the size of a follower that applies changes of up to buffer_size bytes */
+size_t pvl_follower_sizeof(size_t buffer_size);
+
+/*
+ * Initialize a follower at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the follower should be initialized
+ * fd                 - The stream of changes from the primary
+ * ack_fd             - Where applied changes are acknowledged, may be the same as fd
+ * buffer_size        - The largest change that can be applied, larger ones end the load
+ * sequence           - The sequence of the primary that the follower starts at
+ *
+ * Returns
+ * pvl_follower*      - A valid pointer in the case of success, NULL otherwise.
+ */
+struct pvl_follower *pvl_follower_init(char *at, int fd, int ack_fd, size_t buffer_size, uint64_t sequence);
+
+/* Read handler, see read_callback in pvl.h */
+int pvl_follower_read(void *ctx, void *to, size_t length, size_t remaining);
+
+/* Returns the sequence of the last change that was applied */
+uint64_t pvl_follower_sequence(struct pvl_follower *follower);
@@ -0,0 +1,480 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Segmented journal handlers for libpvl (POSIX, implementation)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "segment.h"
+
+#define PVL_SEGMENT_MANIFEST "manifest"
+#define PVL_SEGMENT_MANIFEST_TMP "manifest.tmp"
+
+/* Room for a sequence number in hex and the file extension */
+#define PVL_SEGMENT_NAME_SIZE 32
+
+struct pvl_segment {
+	int dir_fd;
+	size_t segment_size;
+	size_t staging_size;
+	_Bool sync;
+	unsigned char *staging;
+	/* segments in use, there are none when first is past last */
+	uint64_t first;
+	uint64_t last;
+	/* writing - the segment appended to and the end of the change in it */
+	int fd;
+	uint64_t seq;
+	off_t offset;
+	off_t change_start;
+	size_t fill;
+	unsigned char header[2 * sizeof(size_t)];
+	size_t header_length;
+	_Bool in_change;
+	_Bool positioned;
+	_Bool rotate;
+	int spare; /* the preallocated segment after the last one */
+	/* reading */
+	int read_fd;
+	uint64_t read_seq;
+	off_t read_pos;
+	off_t read_size;
+	_Bool read_boundary;
+	/* where appending resumes after reading */
+	_Bool appending;
+	uint64_t append_seq;
+	off_t append_offset;
+};
+
+static void pvl_segment_name(char *name, uint64_t seq);
+static int pvl_segment_create(struct pvl_segment *segment, uint64_t seq);
+static int pvl_segment_clear(struct pvl_segment *segment, int fd, off_t from);
+static int pvl_segment_manifest(struct pvl_segment *segment, uint64_t first, uint64_t last);
+static int pvl_segment_load_manifest(struct pvl_segment *segment);
+static int pvl_segment_position(struct pvl_segment *segment);
+static int pvl_segment_next(struct pvl_segment *segment);
+static int pvl_segment_flush(struct pvl_segment *segment);
+static int pvl_segment_abort(struct pvl_segment *segment);
+static int pvl_segment_pwrite(int fd, const unsigned char *from, size_t length, off_t position);
+static int pvl_segment_pread(int fd, unsigned char *to, size_t length, off_t position);
+
+size_t pvl_segment_sizeof(size_t staging_size) {
+	return sizeof(struct pvl_segment) + staging_size;
+}
+
+struct pvl_segment *pvl_segment_open(char *at, const char *directory, size_t segment_size,
+		size_t staging_size, _Bool sync) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if ((directory == NULL) || (segment_size == 0) || (staging_size == 0)) {
+		return NULL;
+	}
+
+	struct pvl_segment *segment = (struct pvl_segment*) at;
+	memset(segment, 0, sizeof(struct pvl_segment));
+	segment->segment_size = segment_size;
+	segment->staging_size = staging_size;
+	segment->sync = sync;
+	segment->staging = (unsigned char*) (at + sizeof(struct pvl_segment));
+	segment->fd = -1;
+	segment->spare = -1;
+	segment->read_fd = -1;
+	segment->read_boundary = 1;
+
+	segment->dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (segment->dir_fd < 0) {
+		return NULL;
+	}
+	if (pvl_segment_load_manifest(segment)) {
+		close(segment->dir_fd);
+		return NULL;
+	}
+	segment->read_seq = segment->first;
+	return segment;
+}
+
+int pvl_segment_close(struct pvl_segment *segment) {
+	if (segment == NULL) {
+		return 1;
+	}
+	int result = 0;
+	int fds[3] = {segment->fd, segment->spare, segment->read_fd};
+	for (size_t i = 0; i < 3; i++) {
+		if (fds[i] >= 0) {
+			result |= close(fds[i]) != 0;
+		}
+	}
+	result |= close(segment->dir_fd) != 0;
+	return result;
+}
+
+int pvl_segment_write(void *ctx, void *from, size_t length, size_t remaining) {
+	if ((ctx == NULL) || (from == NULL) || (length == 0)) {
+		return 1;
+	}
+	struct pvl_segment *segment = (struct pvl_segment*)(ctx);
+	const unsigned char *bytes = (const unsigned char*) from;
+
+	if (! segment->in_change) {
+		/* Discard anything past the last change that was read */
+		if ((! segment->positioned) && pvl_segment_position(segment)) {
+			return 1;
+		}
+		/* Start a new segment for a change that does not fit in the current one */
+		size_t total = length + remaining;
+		if (segment->rotate || (segment->fd < 0) || ((segment->offset > 0)
+				&& (((size_t) segment->offset + total) > segment->segment_size))) {
+			if (pvl_segment_next(segment)) {
+				return 1;
+			}
+		}
+		if (length > sizeof(segment->header)) {
+			return 1;
+		}
+
+		/* The header is written last, once the rest of the change is in place */
+		memcpy(segment->header, bytes, length);
+		segment->header_length = length;
+		segment->change_start = segment->offset;
+		segment->offset += (off_t) length;
+		segment->fill = 0;
+		segment->in_change = 1;
+		bytes += length;
+		length = 0;
+	}
+
+	/* Gather the change in the staging buffer */
+	while (length) {
+		size_t chunk = segment->staging_size - segment->fill;
+		if (chunk > length) {
+			chunk = length;
+		}
+		memcpy(segment->staging + segment->fill, bytes, chunk);
+		segment->fill += chunk;
+		segment->offset += (off_t) chunk;
+		bytes += chunk;
+		length -= chunk;
+		if ((segment->fill == segment->staging_size) && pvl_segment_flush(segment)) {
+			return pvl_segment_abort(segment);
+		}
+	}
+	if (remaining) {
+		return 0;
+	}
+
+	/* Order the header after the content so that a torn change is never read */
+	if (pvl_segment_flush(segment)
+			|| (segment->sync && fdatasync(segment->fd))
+			|| pvl_segment_pwrite(segment->fd, segment->header, segment->header_length,
+				segment->change_start)
+			|| (segment->sync && fdatasync(segment->fd))) {
+		return pvl_segment_abort(segment);
+	}
+	segment->in_change = 0;
+	return 0;
+}
+
+int pvl_segment_read(void *ctx, void *to, size_t length, size_t remaining) {
+	if (ctx == NULL) {
+		return 1;
+	}
+	struct pvl_segment *segment = (struct pvl_segment*)(ctx);
+
+	/* Check that the rest of the change is present */
+	if (to == NULL) {
+		return (segment->read_pos + (off_t) remaining) > segment->read_size;
+	}
+
+	if (segment->read_boundary) {
+		/* Move on to the next segment at the end of the current one or at its zeroed tail */
+		while (1) {
+			if (segment->read_fd < 0) {
+				if (segment->read_seq > segment->last) {
+					return EOF;
+				}
+				char name[PVL_SEGMENT_NAME_SIZE];
+				pvl_segment_name(name, segment->read_seq);
+				segment->read_fd = openat(segment->dir_fd, name, O_RDONLY | O_CLOEXEC);
+				struct stat st;
+				if ((segment->read_fd < 0) || fstat(segment->read_fd, &st)) {
+					close(segment->read_fd); /* fails harmlessly when the open did */
+					segment->read_fd = -1;
+					return 1;
+				}
+				segment->read_size = st.st_size;
+				segment->read_pos = 0;
+			}
+			segment->appending = 1;
+			segment->append_seq = segment->read_seq;
+			segment->append_offset = segment->read_pos;
+
+			if ((segment->read_pos + (off_t) length) <= segment->read_size) {
+				if (pvl_segment_pread(segment->read_fd, (unsigned char*) to, length, segment->read_pos)) {
+					return 1;
+				}
+				const unsigned char *bytes = (const unsigned char*) to;
+				size_t i = 0;
+				while ((i < length) && (bytes[i] == 0)) {
+					i++;
+				}
+				if (i < length) {
+					break;
+				}
+			}
+			close(segment->read_fd);
+			segment->read_fd = -1;
+			segment->read_seq++;
+		}
+		segment->read_pos += (off_t) length;
+		segment->read_boundary = 0;
+		return 0;
+	}
+
+	if ((segment->read_pos + (off_t) length) > segment->read_size) {
+		return 1;
+	}
+	if (pvl_segment_pread(segment->read_fd, (unsigned char*) to, length, segment->read_pos)) {
+		return 1;
+	}
+	segment->read_pos += (off_t) length;
+
+	/* The last read of a change is followed by the next change header */
+	if (remaining == 0) {
+		segment->read_boundary = 1;
+	}
+	return 0;
+}
+
+int pvl_segment_rotate(struct pvl_segment *segment) {
+	if (segment == NULL) {
+		return 1;
+	}
+	segment->rotate = 1;
+	return 0;
+}
+
+uint64_t pvl_segment_current(struct pvl_segment *segment) {
+	if (segment == NULL) {
+		return 0;
+	}
+	return segment->seq;
+}
+
+int pvl_segment_trim(struct pvl_segment *segment, uint64_t first) {
+	if (segment == NULL) {
+		return 1;
+	}
+	if (first <= segment->first) {
+		return 0;
+	}
+	if (first > segment->last) {
+		return 1; /* the last segment is kept */
+	}
+
+	/* Update the manifest before unlinking so that loading never misses a segment */
+	uint64_t dropped = segment->first;
+	if (pvl_segment_manifest(segment, first, segment->last)) {
+		return 1;
+	}
+	segment->first = first;
+	int result = 0;
+	for (; dropped < first; dropped++) {
+		char name[PVL_SEGMENT_NAME_SIZE];
+		pvl_segment_name(name, dropped);
+		if (unlinkat(segment->dir_fd, name, 0) && (errno != ENOENT)) {
+			result = 1;
+		}
+	}
+	return result;
+}
+
+static void pvl_segment_name(char *name, uint64_t seq) {
+	snprintf(name, PVL_SEGMENT_NAME_SIZE, "%016" PRIx64 ".segment", seq);
+}
+
+/* Create or reuse the segment file for seq, empty and preallocated */
+static int pvl_segment_create(struct pvl_segment *segment, uint64_t seq) {
+	char name[PVL_SEGMENT_NAME_SIZE];
+	pvl_segment_name(name, seq);
+	int fd = openat(segment->dir_fd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if ((fd < 0) || pvl_segment_clear(segment, fd, 0)) {
+		close(fd); /* fails harmlessly when the open did */
+		return -1;
+	}
+	return fd;
+}
+
+/* Zero a segment from the provided offset on, keeping it preallocated */
+static int pvl_segment_clear(struct pvl_segment *segment, int fd, off_t from) {
+	return ftruncate(fd, from) || (posix_fallocate(fd, 0, (off_t) segment->segment_size) != 0);
+}
+
+/* Replace the manifest with one listing the segments from first to last */
+static int pvl_segment_manifest(struct pvl_segment *segment, uint64_t first, uint64_t last) {
+	char text[64];
+	int length = snprintf(text, sizeof(text), "%" PRIu64 " %" PRIu64 "\n", first, last);
+	int fd = openat(segment->dir_fd, PVL_SEGMENT_MANIFEST_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return 1;
+	}
+	int result = pvl_segment_pwrite(fd, (const unsigned char*) text, (size_t) length, 0);
+	result |= fdatasync(fd) != 0;
+	result |= close(fd) != 0;
+	return result || renameat(segment->dir_fd, PVL_SEGMENT_MANIFEST_TMP, segment->dir_fd, PVL_SEGMENT_MANIFEST)
+		|| (fsync(segment->dir_fd) != 0);
+}
+
+static int pvl_segment_load_manifest(struct pvl_segment *segment) {
+	/* A journal without a manifest has no segments */
+	segment->first = 1;
+	segment->last = 0;
+	int fd = openat(segment->dir_fd, PVL_SEGMENT_MANIFEST, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return errno != ENOENT;
+	}
+	char text[64];
+	ssize_t length = read(fd, text, sizeof(text) - 1);
+	close(fd);
+	if (length <= 0) {
+		return 1;
+	}
+	text[length] = '\0';
+	uint64_t first;
+	uint64_t last;
+	if (sscanf(text, "%" SCNu64 " %" SCNu64, &first, &last) != 2) {
+		return 1;
+	}
+	if ((first == 0) || (first > (last + 1))) {
+		return 1;
+	}
+	segment->first = first;
+	segment->last = last;
+	return 0;
+}
+
+/* Resume appending after the last change that was read, or in a new segment */
+static int pvl_segment_position(struct pvl_segment *segment) {
+	if (segment->read_fd >= 0) {
+		close(segment->read_fd);
+		segment->read_fd = -1;
+	}
+	if (! segment->appending) {
+		segment->positioned = 1;
+		return 0;
+	}
+
+	/* Drop the segments after the one appended to */
+	uint64_t last = segment->last;
+	if (segment->append_seq < last) {
+		if (pvl_segment_manifest(segment, segment->first, segment->append_seq)) {
+			return 1;
+		}
+		segment->last = segment->append_seq;
+		for (uint64_t seq = segment->append_seq + 1; seq <= last; seq++) {
+			char name[PVL_SEGMENT_NAME_SIZE];
+			pvl_segment_name(name, seq);
+			unlinkat(segment->dir_fd, name, 0);
+		}
+	}
+
+	char name[PVL_SEGMENT_NAME_SIZE];
+	pvl_segment_name(name, segment->append_seq);
+	int fd = openat(segment->dir_fd, name, O_RDWR | O_CLOEXEC);
+	if ((fd < 0) || pvl_segment_clear(segment, fd, segment->append_offset)) {
+		close(fd); /* fails harmlessly when the open did */
+		return 1;
+	}
+	segment->fd = fd;
+	segment->seq = segment->append_seq;
+	segment->offset = segment->append_offset;
+	segment->positioned = 1;
+	return 0;
+}
+
+/* Append to a new segment and preallocate the one after it */
+static int pvl_segment_next(struct pvl_segment *segment) {
+	uint64_t seq = segment->last + 1;
+	int fd = (segment->spare >= 0) ? segment->spare : pvl_segment_create(segment, seq);
+	segment->spare = -1;
+	if (fd < 0) {
+		return 1;
+	}
+	uint64_t first = (segment->first > segment->last) ? seq : segment->first;
+	if (pvl_segment_manifest(segment, first, seq)) {
+		segment->spare = fd;
+		return 1;
+	}
+	if (segment->fd >= 0) {
+		close(segment->fd);
+	}
+	segment->fd = fd;
+	segment->seq = seq;
+	segment->offset = 0;
+	segment->rotate = 0;
+	segment->first = first;
+	segment->last = seq;
+
+	/* A failed preallocation is retried at the next rotation */
+	segment->spare = pvl_segment_create(segment, seq + 1);
+	return 0;
+}
+
+/* Write out the staged part of the change */
+static int pvl_segment_flush(struct pvl_segment *segment) {
+	off_t position = segment->offset - (off_t) segment->fill;
+	if (pvl_segment_pwrite(segment->fd, segment->staging, segment->fill, position)) {
+		return 1;
+	}
+	segment->fill = 0;
+	return 0;
+}
+
+/* Drop a failed change so that it is written anew from its start */
+static int pvl_segment_abort(struct pvl_segment *segment) {
+	pvl_segment_clear(segment, segment->fd, segment->change_start);
+	segment->offset = segment->change_start;
+	segment->fill = 0;
+	segment->in_change = 0;
+	return 1;
+}
+
+static int pvl_segment_pwrite(int fd, const unsigned char *from, size_t length, off_t position) {
+	while (length) {
+		ssize_t done = pwrite(fd, from, length, position);
+		if (done <= 0) {
+			return 1;
+		}
+		from += done;
+		length -= (size_t) done;
+		position += done;
+	}
+	return 0;
+}
+
+static int pvl_segment_pread(int fd, unsigned char *to, size_t length, off_t position) {
+	while (length) {
+		ssize_t done = pread(fd, to, length, position);
+		if (done <= 0) {
+			return 1;
+		}
+		to += done;
+		length -= (size_t) done;
+		position += done;
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Segmented journal handlers for libpvl (POSIX)
+ *
+ * A single journal file grows with every append, so that each sync also
+ * commits a file size update, and old history cannot be dropped without
+ * rewriting it. The segmented journal writes changes into fixed-size segment
+ * files in a directory, preallocated ahead of use so that appends are pure
+ * data writes. A small manifest lists the first and last segment in use,
+ * changes are read across segments in order and retention unlinks whole
+ * segments.
+ *
+ * Each change is written with its header last, so that a change that was
+ * not completely written reads as the end of its segment. The preallocated
+ * tail of a segment reads as zeros and the reader moves on to the next one.
+ *
+ * Pass the same segmented journal to pvl_set_read_cb with pvl_segment_read
+ * and to pvl_set_write_cb with pvl_segment_write. Appending starts after the
+ * last change that was read, discarding anything past it. Without reading,
+ * appending starts in a new segment.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pvl_segment;
+
+/* Returns the size of a segmented journal with a staging buffer of staging_size bytes */
+size_t pvl_segment_sizeof(size_t staging_size);
+
+/*
+ * Open a segmented journal at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the segmented journal should be initialized
+ * directory          - An existing directory that holds the segments and the manifest
+ * segment_size       - The preallocated size of each segment. A change that does not
+ *                      fit in the rest of a segment starts a new one, and a change
+ *                      larger than segment_size extends its segment.
+ * staging_size       - The size of the buffer that change writes are gathered in
+ * sync               - Call fdatasync before and after writing each change header
+ *                      so that commits are durable and atomic on return
+ *
+ * Returns
+ * pvl_segment*       - A valid pointer in the case of success, NULL otherwise.
+ */
+struct pvl_segment *pvl_segment_open(char *at, const char *directory, size_t segment_size,
+		size_t staging_size, _Bool sync);
+
+/* Close the segment files and the directory */
+int pvl_segment_close(struct pvl_segment *segment);
+
+/* Write handler, see write_callback in pvl.h */
+int pvl_segment_write(void *ctx, void *from, size_t length, size_t remaining);
+
+/* Read handler, see read_callback in pvl.h */
+int pvl_segment_read(void *ctx, void *to, size_t length, size_t remaining);
+
+/* Start the next change in a new segment */
+int pvl_segment_rotate(struct pvl_segment *segment);
+
+/* Returns the sequence number of the segment that is appended to, zero before the first write */
+uint64_t pvl_segment_current(struct pvl_segment *segment);
+
+/*
+ * Drop the segments before the one with sequence number first.
+ *
+ * Loading then starts at that segment, so it should begin with a change
+ * that holds the whole state, e.g. by calling pvl_segment_rotate and
+ * committing after marking the whole memory block.
+ */
+int pvl_segment_trim(struct pvl_segment *segment, uint64_t first);
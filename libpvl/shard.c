@@ -0,0 +1,338 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Sharded front end for libpvl (implementation)
+ */
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pvl.h"
+#include "shard.h"
+
+struct pvl_shard {
+	struct pvl *pvl;
+	pthread_t thread;
+	/* write context and callback, the epoch prefixes each change */
+	void *write_ctx;
+	write_callback *write_cb;
+	_Bool write_boundary;
+	uint64_t epoch;
+	/* read context and callback, loading stops past the cut epoch */
+	void *read_ctx;
+	read_callback *read_cb;
+	_Bool read_boundary;
+	uint64_t cut;
+	uint64_t seen;
+};
+
+struct pvl_shards {
+	char *main;
+	size_t length;
+	size_t shard_length;
+	size_t shard_count;
+	/* epoch context and callback */
+	void *epoch_ctx;
+	epoch_callback *epoch_cb;
+	uint64_t epoch;
+	/* worker pool state, guarded by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	size_t workers;
+	size_t next_shard;
+	size_t pending;
+	int failed;
+	_Bool stopping;
+	struct pvl_shard shards[];
+};
+
+static size_t pvl_shards_pvl_sizeof(size_t span_count);
+static int pvl_shards_write(void *ctx, void *from, size_t length, size_t remaining);
+static int pvl_shards_read(void *ctx, void *to, size_t length, size_t remaining);
+static void *pvl_shards_worker(void *arg);
+static void pvl_shards_drain(struct pvl_shards *shards);
+
+/* Each shard's pvl is kept aligned to max_align_t */
+static size_t pvl_shards_pvl_sizeof(size_t span_count) {
+	size_t size = pvl_sizeof(span_count);
+	return size + ((alignof(max_align_t) - (size % alignof(max_align_t))) % alignof(max_align_t));
+}
+
+size_t pvl_shards_sizeof(size_t shard_count, size_t span_count) {
+	size_t header = sizeof(struct pvl_shards) + (shard_count * sizeof(struct pvl_shard));
+	header += (alignof(max_align_t) - (header % alignof(max_align_t))) % alignof(max_align_t);
+	return header + (shard_count * pvl_shards_pvl_sizeof(span_count));
+}
+
+struct pvl_shards *pvl_shards_init(char *at, char *main, size_t length, size_t shard_count,
+		size_t span_count) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+
+	/* shard_count must be positive and divide the block */
+	if ((shard_count == 0) || (length % shard_count)) {
+		return NULL;
+	}
+
+	struct pvl_shards *shards = (struct pvl_shards*) at;
+	memset(shards, 0, sizeof(struct pvl_shards) + (shard_count * sizeof(struct pvl_shard)));
+	shards->main = main;
+	shards->length = length;
+	shards->shard_count = shard_count;
+	shards->shard_length = length / shard_count;
+
+	/* Initialize a pvl for each shard, pvl_init validates the rest */
+	char *pvl_at = at + (pvl_shards_sizeof(shard_count, span_count)
+			- (shard_count * pvl_shards_pvl_sizeof(span_count)));
+	for (size_t i = 0; i < shard_count; i++) {
+		struct pvl_shard *shard = &shards->shards[i];
+		shard->pvl = pvl_init(pvl_at, main + (i * shards->shard_length), shards->shard_length, span_count);
+		if (shard->pvl == NULL) {
+			return NULL;
+		}
+		shard->write_boundary = 1;
+		shard->read_boundary = 1;
+		pvl_at += pvl_shards_pvl_sizeof(span_count);
+	}
+
+	pthread_mutex_init(&shards->lock, NULL);
+	pthread_cond_init(&shards->work, NULL);
+	pthread_cond_init(&shards->done, NULL);
+	return shards;
+}
+
+struct pvl *pvl_shards_pvl(struct pvl_shards *shards, size_t shard) {
+	if ((shards == NULL) || (shard >= shards->shard_count)) {
+		return NULL;
+	}
+	return shards->shards[shard].pvl;
+}
+
+int pvl_shards_set_read_cb(struct pvl_shards *shards, size_t shard, void *read_ctx,
+		read_callback read_cb, uint64_t epoch) {
+	if ((shards == NULL) || (shard >= shards->shard_count)) {
+		return 1;
+	}
+	struct pvl_shard *s = &shards->shards[shard];
+	if (s->read_cb) {
+		return 1; /* already set */
+	}
+	s->read_ctx = read_ctx;
+	s->read_cb = read_cb;
+	s->cut = epoch;
+	int result = pvl_set_read_cb(s->pvl, s, pvl_shards_read);
+
+	/* Never reuse an epoch that is already present in a journal */
+	if (s->seen > shards->epoch) {
+		shards->epoch = s->seen;
+	}
+	return result;
+}
+
+int pvl_shards_set_write_cb(struct pvl_shards *shards, size_t shard, void *write_ctx,
+		write_callback write_cb) {
+	if ((shards == NULL) || (shard >= shards->shard_count)) {
+		return 1;
+	}
+	struct pvl_shard *s = &shards->shards[shard];
+	if (s->write_cb) {
+		return 1; /* already set */
+	}
+	s->write_ctx = write_ctx;
+	s->write_cb = write_cb;
+	return pvl_set_write_cb(s->pvl, s, pvl_shards_write);
+}
+
+int pvl_shards_set_epoch_cb(struct pvl_shards *shards, void *epoch_ctx, epoch_callback epoch_cb) {
+	if (shards == NULL) {
+		return 1;
+	}
+	if (shards->epoch_cb || shards->epoch_ctx) {
+		return 1; /* already set */
+	}
+	shards->epoch_ctx = epoch_ctx;
+	shards->epoch_cb = epoch_cb;
+	return 0;
+}
+
+int pvl_shards_start(struct pvl_shards *shards, size_t workers) {
+	if (shards == NULL) {
+		return 1;
+	}
+	if (shards->workers || (workers == 0) || (workers > shards->shard_count)) {
+		return 1;
+	}
+	/* Run with as many workers as could be started */
+	for (size_t i = 0; (i < workers)
+			&& (pthread_create(&shards->shards[i].thread, NULL, pvl_shards_worker, shards) == 0); i++) {
+		shards->workers++;
+	}
+	return shards->workers == 0;
+}
+
+void pvl_shards_stop(struct pvl_shards *shards) {
+	if (shards == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&shards->lock);
+	shards->stopping = 1;
+	pthread_cond_broadcast(&shards->work);
+	pthread_mutex_unlock(&shards->lock);
+	for (size_t i = 0; i < shards->workers; i++) {
+		pthread_join(shards->shards[i].thread, NULL);
+	}
+	shards->workers = 0;
+	pthread_cond_destroy(&shards->done);
+	pthread_cond_destroy(&shards->work);
+	pthread_mutex_destroy(&shards->lock);
+}
+
+int pvl_shards_mark(struct pvl_shards *shards, const char *start, size_t length) {
+	if (shards == NULL) {
+		return 1;
+	}
+
+	/* Validate the span */
+	if ((start == NULL) || (length == 0) || (start < shards->main)
+			|| ((start+length) > (shards->main+shards->length))) {
+		return 1;
+	}
+
+	/* Split it at shard boundaries */
+	int result = 0;
+	while (length) {
+		size_t index = (size_t)(start - shards->main) / shards->shard_length;
+		size_t shard_end = (index + 1) * shards->shard_length;
+		size_t chunk = shard_end - (size_t)(start - shards->main);
+		if (chunk > length) {
+			chunk = length;
+		}
+		result |= pvl_mark(shards->shards[index].pvl, start, chunk);
+		start += chunk;
+		length -= chunk;
+	}
+	return result;
+}
+
+int pvl_shards_commit(struct pvl_shards *shards) {
+	if (shards == NULL) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&shards->lock);
+	shards->epoch++;
+	shards->next_shard = 0;
+	shards->pending = shards->shard_count;
+	shards->failed = 0;
+	for (size_t i = 0; i < shards->shard_count; i++) {
+		shards->shards[i].epoch = shards->epoch;
+	}
+
+	/* Hand the shards to the workers or commit them in place */
+	if (shards->workers) {
+		pthread_cond_broadcast(&shards->work);
+		while (shards->pending) {
+			pthread_cond_wait(&shards->done, &shards->lock);
+		}
+	} else {
+		pvl_shards_drain(shards);
+	}
+	int failed = shards->failed;
+	uint64_t epoch = shards->epoch;
+	pthread_mutex_unlock(&shards->lock);
+
+	if (failed) {
+		return 1;
+	}
+
+	/* All shards have persisted the epoch */
+	if (shards->epoch_cb) {
+		return shards->epoch_cb(shards->epoch_ctx, epoch);
+	}
+	return 0;
+}
+
+uint64_t pvl_shards_epoch(struct pvl_shards *shards) {
+	if (shards == NULL) {
+		return 0;
+	}
+	return shards->epoch;
+}
+
+/* Commit shards until none are left, called with the lock held */
+static void pvl_shards_drain(struct pvl_shards *shards) {
+	while (shards->next_shard < shards->shard_count) {
+		struct pvl_shard *shard = &shards->shards[shards->next_shard];
+		shards->next_shard++;
+
+		pthread_mutex_unlock(&shards->lock);
+		int result = pvl_commit(shard->pvl);
+		pthread_mutex_lock(&shards->lock);
+
+		shards->failed |= result;
+		shards->pending--;
+		if (shards->pending == 0) {
+			pthread_cond_broadcast(&shards->done);
+		}
+	}
+}
+
+static void *pvl_shards_worker(void *arg) {
+	struct pvl_shards *shards = (struct pvl_shards*) arg;
+	pthread_mutex_lock(&shards->lock);
+	while (! shards->stopping) {
+		if (shards->next_shard < shards->shard_count) {
+			pvl_shards_drain(shards);
+		} else {
+			pthread_cond_wait(&shards->work, &shards->lock);
+		}
+	}
+	pthread_mutex_unlock(&shards->lock);
+	return NULL;
+}
+
+/* Prefix each change with the epoch of the commit that persists it */
+static int pvl_shards_write(void *ctx, void *from, size_t length, size_t remaining) {
+	struct pvl_shard *shard = (struct pvl_shard*) ctx;
+	if (shard->write_boundary) {
+		if (shard->write_cb(shard->write_ctx, &shard->epoch, sizeof(shard->epoch), length + remaining)) {
+			return 1;
+		}
+		shard->write_boundary = 0;
+	}
+	int result = shard->write_cb(shard->write_ctx, from, length, remaining);
+	/* The next write starts a new change after the last one or after a failure */
+	shard->write_boundary = (remaining == 0) || result;
+	return result;
+}
+
+/* Read the epoch that prefixes each change and stop past the cut */
+static int pvl_shards_read(void *ctx, void *to, size_t length, size_t remaining) {
+	struct pvl_shard *shard = (struct pvl_shard*) ctx;
+	if (shard->read_boundary) {
+		uint64_t epoch = 0;
+		int result = shard->read_cb(shard->read_ctx, &epoch, sizeof(epoch), length);
+		if (result) {
+			return result;
+		}
+		/* Epochs only grow within a journal */
+		shard->seen = epoch;
+		if (epoch > shard->cut) {
+			return EOF;
+		}
+		shard->read_boundary = 0;
+		return shard->read_cb(shard->read_ctx, to, length, remaining);
+	}
+	/* The last read of a change is followed by the next change */
+	shard->read_boundary = (to != NULL) && (remaining == 0);
+	return shard->read_cb(shard->read_ctx, to, length, remaining);
+}
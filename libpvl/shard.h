@@ -0,0 +1,101 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Sharded front end for libpvl
+ *
+ * A single pvl instance persists changes through a single write callback
+ * stream. The sharded front end splits one memory block into equally sized
+ * address-range shards, each managed by its own pvl instance and persisted
+ * to its own sink, and commits them in parallel on a worker pool.
+ *
+ * Each commit is assigned an epoch that prefixes the change persisted by
+ * every shard. Once all shards have persisted their changes the epoch
+ * callback is called so that the caller can durably record the epoch as
+ * committed. Loading a shard stops at the first change past the recorded
+ * epoch, restoring a consistent cut across all shards.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pvl.h"
+
+struct pvl_shards;
+
+/*
+ * Callback for recording a committed epoch
+ *
+ * Passed parameters
+ * - Caller-provided context
+ * - The epoch that has been persisted by all shards
+ *
+ * Returns
+ * - Zero on success, non-zero otherwise
+ */
+typedef int epoch_callback(void *ctx, uint64_t epoch);
+
+/* Returns the size of a sharded front end, span_count is per shard */
+size_t pvl_shards_sizeof(size_t shard_count, size_t span_count);
+
+/*
+ * Initialize a sharded front end at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the sharded front end should be initialized
+ * main               - Pointer to the start of a pvl-managed memory block
+ * length             - The length of the pvl-managed memory block
+ *                      It must be divisible by shard_count.
+ * shard_count        - The number of shards
+ * span_count         - The number of internal spans used to track changes in each shard
+ *                      The shard length must be divisible by it.
+ *
+ * Returns
+ * pvl_shards*        - A valid pointer in the case of a successful initialization,
+ *                      NULL otherwise.
+ */
+struct pvl_shards *pvl_shards_init(char *at, char *main, size_t length, size_t shard_count,
+		size_t span_count);
+
+/*
+ * Returns the pvl instance of a shard for additional configuration, e.g. mirror
+ * or encoding. Do not set its read or write handlers directly.
+ */
+struct pvl *pvl_shards_pvl(struct pvl_shards *shards, size_t shard);
+
+/*
+ * Configure the read handler of a shard and load it up to and including
+ * the provided epoch. Later epochs are not applied - discard them from
+ * the journal before appending new changes.
+ */
+int pvl_shards_set_read_cb(struct pvl_shards *shards, size_t shard, void *read_ctx,
+		read_callback read_cb, uint64_t epoch);
+
+/* Configure the write handler of a shard */
+int pvl_shards_set_write_cb(struct pvl_shards *shards, size_t shard, void *write_ctx,
+		write_callback write_cb);
+
+/* Configure the epoch handler, called after all shards have persisted a commit */
+int pvl_shards_set_epoch_cb(struct pvl_shards *shards, void *epoch_ctx, epoch_callback epoch_cb);
+
+/*
+ * Start a pool of worker threads that commit shards in parallel.
+ * Without workers shards are committed one after another by the calling thread.
+ */
+int pvl_shards_start(struct pvl_shards *shards, size_t workers);
+
+/* Stop the worker pool and release its resources. Do not commit afterwards. */
+void pvl_shards_stop(struct pvl_shards *shards);
+
+/* Mark a span of memory for inclusion in the next commit. It can cross shards. */
+int pvl_shards_mark(struct pvl_shards *shards, const char *start, size_t length);
+
+/* Persist the marked spans of all shards as a new epoch */
+int pvl_shards_commit(struct pvl_shards *shards);
+
+/* Returns the last used epoch, including epochs seen while loading */
+uint64_t pvl_shards_epoch(struct pvl_shards *shards);
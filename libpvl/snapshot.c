@@ -0,0 +1,222 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Copy-on-write snapshots for libpvl (POSIX, implementation)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+/* The size of each write of the snapshot image */
+#define PVL_SNAPSHOT_WRITE ((size_t) 8 << 20)
+
+#define PVL_SNAPSHOT_MAGIC "pvlsnap1"
+#define PVL_SNAPSHOT_TMP ".tmp"
+
+struct pvl_snapshot_header {
+	char magic[8];
+	uint64_t position;
+	uint64_t length;
+};
+
+struct pvl_snapshot {
+	/* paths are prepared before forking, the child only makes system calls */
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	char dir_path[PATH_MAX];
+	pid_t child;
+	_Bool running;
+	int result;
+};
+
+static _Noreturn void pvl_snapshot_child(struct pvl_snapshot *snapshot,
+		const struct pvl_snapshot_header *header, const char *main);
+static int pvl_snapshot_write(int fd, const void *from, size_t length);
+static int pvl_snapshot_read(int fd, void *to, size_t length);
+static void pvl_snapshot_reap(struct pvl_snapshot *snapshot, pid_t done, int status);
+
+size_t pvl_snapshot_sizeof(void) {
+	return sizeof(struct pvl_snapshot);
+}
+
+struct pvl_snapshot *pvl_snapshot_init(char *at, const char *path) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if (path == NULL) {
+		return NULL;
+	}
+	size_t length = strlen(path);
+	if ((length == 0) || ((length + sizeof(PVL_SNAPSHOT_TMP)) > PATH_MAX)) {
+		return NULL;
+	}
+
+	struct pvl_snapshot *snapshot = (struct pvl_snapshot*) at;
+	memset(snapshot, 0, sizeof(struct pvl_snapshot));
+	memcpy(snapshot->path, path, length + 1);
+	memcpy(snapshot->tmp_path, path, length);
+	memcpy(snapshot->tmp_path + length, PVL_SNAPSHOT_TMP, sizeof(PVL_SNAPSHOT_TMP));
+
+	/* The directory is synced after renaming the snapshot into place */
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		snapshot->dir_path[0] = '.';
+	} else if (slash == path) {
+		snapshot->dir_path[0] = '/';
+	} else {
+		memcpy(snapshot->dir_path, path, (size_t) (slash - path));
+	}
+	return snapshot;
+}
+
+int pvl_snapshot_start(struct pvl_snapshot *snapshot, struct pvl *pvl, const char *main, size_t length,
+		uint64_t position) {
+	if ((snapshot == NULL) || (pvl == NULL) || (main == NULL) || (length == 0)) {
+		return 1;
+	}
+	if (pvl_snapshot_busy(snapshot)) {
+		return 1; /* one snapshot at a time */
+	}
+
+	struct pvl_snapshot_header header;
+	memcpy(header.magic, PVL_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.position = position;
+	header.length = length;
+
+	/* Fork at a commit boundary so that main holds only committed state */
+	pid_t child = pvl_commit(pvl) ? -1 : fork();
+	if (child < 0) {
+		return 1;
+	}
+	if (child == 0) {
+		pvl_snapshot_child(snapshot, &header, main);
+	}
+	snapshot->child = child;
+	snapshot->running = 1;
+	return 0;
+}
+
+int pvl_snapshot_busy(struct pvl_snapshot *snapshot) {
+	if (snapshot == NULL) {
+		return 0;
+	}
+	if (! snapshot->running) {
+		return 0;
+	}
+	int status = 0;
+	pid_t done = waitpid(snapshot->child, &status, WNOHANG);
+	if (done == 0) {
+		return 1;
+	}
+	pvl_snapshot_reap(snapshot, done, status);
+	return 0;
+}
+
+int pvl_snapshot_wait(struct pvl_snapshot *snapshot) {
+	if (snapshot == NULL) {
+		return 1;
+	}
+	if (snapshot->running) {
+		int status = 0;
+		pid_t done;
+		do {
+			done = waitpid(snapshot->child, &status, 0);
+		} while ((done < 0) && (errno == EINTR));
+		pvl_snapshot_reap(snapshot, done, status);
+	}
+	return snapshot->result;
+}
+
+int pvl_snapshot_load(const char *path, char *main, size_t length, uint64_t *position) {
+	if ((path == NULL) || (main == NULL) || (position == NULL)) {
+		return 1;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 1;
+	}
+	struct pvl_snapshot_header header;
+	int result = pvl_snapshot_read(fd, &header, sizeof(header));
+	if ((result == 0) && (memcmp(header.magic, PVL_SNAPSHOT_MAGIC, sizeof(header.magic))
+			|| (header.length != length))) {
+		result = 1; /* not a snapshot of this block */
+	}
+	if (result == 0) {
+		result = pvl_snapshot_read(fd, main, length);
+	}
+	close(fd);
+	if (result == 0) {
+		*position = header.position;
+	}
+	return result;
+}
+
+/* Write the frozen main to the temporary file and rename it into place */
+static _Noreturn void pvl_snapshot_child(struct pvl_snapshot *snapshot,
+		const struct pvl_snapshot_header *header, const char *main) {
+	int fd = open(snapshot->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	int result = (fd < 0) || pvl_snapshot_write(fd, header, sizeof(*header));
+	for (size_t offset = 0; (result == 0) && (offset < header->length); offset += PVL_SNAPSHOT_WRITE) {
+		size_t chunk = header->length - offset;
+		if (chunk > PVL_SNAPSHOT_WRITE) {
+			chunk = PVL_SNAPSHOT_WRITE;
+		}
+		result = pvl_snapshot_write(fd, main + offset, chunk);
+	}
+	result |= fdatasync(fd) != 0; /* fails harmlessly when the open did */
+	result |= close(fd) != 0;
+	if (result || rename(snapshot->tmp_path, snapshot->path)) {
+		unlink(snapshot->tmp_path);
+		_exit(1);
+	}
+
+	int dir_fd = open(snapshot->dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	result = (dir_fd < 0) || fsync(dir_fd);
+	close(dir_fd); /* fails harmlessly when the open did */
+	_exit(result);
+}
+
+static int pvl_snapshot_write(int fd, const void *from, size_t length) {
+	const char *bytes = (const char*) from;
+	while (length) {
+		ssize_t done = write(fd, bytes, length);
+		if (done <= 0) {
+			return 1;
+		}
+		bytes += done;
+		length -= (size_t) done;
+	}
+	return 0;
+}
+
+static int pvl_snapshot_read(int fd, void *to, size_t length) {
+	char *bytes = (char*) to;
+	while (length) {
+		ssize_t done = read(fd, bytes, length);
+		if (done <= 0) {
+			return 1;
+		}
+		bytes += done;
+		length -= (size_t) done;
+	}
+	return 0;
+}
+
+/* Record the result of a finished child, or of a failed wait for it */
+static void pvl_snapshot_reap(struct pvl_snapshot *snapshot, pid_t done, int status) {
+	snapshot->running = 0;
+	snapshot->result = (done != snapshot->child) || (! WIFEXITED(status)) || (WEXITSTATUS(status) != 0);
+}
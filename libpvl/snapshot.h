@@ -0,0 +1,79 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * Copy-on-write snapshots for libpvl (POSIX)
+ *
+ * Replaying a long journal is slow and keeping a mirror for compaction
+ * doubles memory. A snapshot forks the process at a commit boundary and the
+ * child streams the frozen main block to a snapshot file in large sequential
+ * writes, while the parent keeps running with the kernel copying the pages
+ * it writes to. The snapshot records the journal position that it covers,
+ * so that loading starts from the snapshot and replays only the changes
+ * after that position. Replaying a change that the snapshot already holds
+ * is harmless.
+ *
+ * The child only calls async-signal-safe functions, so that snapshots can
+ * be taken while other threads, e.g. a flusher, hold locks. Forking copies
+ * the page tables of the process, which takes time for very large blocks.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pvl.h"
+
+struct pvl_snapshot;
+
+/* Returns the size of a snapshot object */
+size_t pvl_snapshot_sizeof(void);
+
+/*
+ * Initialize a snapshot object at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the snapshot object should be initialized
+ * path               - Path to the snapshot file. It is written next to it and
+ *                      renamed over it once complete.
+ *
+ * Returns
+ * pvl_snapshot*      - A valid pointer in the case of success, NULL otherwise.
+ */
+struct pvl_snapshot *pvl_snapshot_init(char *at, const char *path);
+
+/*
+ * Commit any marked changes and fork a child that writes main to the snapshot file.
+ *
+ * The position is read by the caller before that commit. A change committed
+ * here is therefore held by the snapshot and replayed again on load, which is
+ * harmless. Commit before reading the position to avoid replaying it.
+ *
+ * Passed parameters
+ * snapshot           - The snapshot object, without a snapshot in progress
+ * pvl                - The pvl instance that manages main
+ * main               - The pvl-managed memory block
+ * length             - The length of main
+ * position           - The journal position after the last commit
+ *
+ * Returns
+ * int                - Zero once the child is started, non-zero otherwise
+ */
+int pvl_snapshot_start(struct pvl_snapshot *snapshot, struct pvl *pvl, const char *main, size_t length,
+		uint64_t position);
+
+/* Returns non-zero while a snapshot is being written, reaping a finished child */
+int pvl_snapshot_busy(struct pvl_snapshot *snapshot);
+
+/* Wait for the snapshot in progress, returns non-zero if the last snapshot failed */
+int pvl_snapshot_wait(struct pvl_snapshot *snapshot);
+
+/*
+ * Read a snapshot file into main before loading the journal from the
+ * returned position, e.g. by seeking the journal to it before calling
+ * pvl_set_read_cb. Returns non-zero if there is no valid snapshot of length.
+ */
+int pvl_snapshot_load(const char *path, char *main, size_t length, uint64_t *position);
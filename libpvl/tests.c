@@ -3,11 +3,25 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <signal.h>
 #include <stdalign.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "tests.h"
 
@@ -15,9 +29,31 @@
 #include "bbt.h"
 
 #include "pvl.h"
+#include "shard.h"
+#include "flusher.h"
+#include "journal.h"
+#include "lazy.h"
+#include "direct.h"
+#include "uring.h"
+#include "segment.h"
+#include "mapped.h"
+#include "backing.h"
+#include "snapshot.h"
+#include "replica.h"
 
 #define pvl_header_size (2*sizeof(size_t))
 
+/*
+ * The tests are linked with -Wl,--wrap=_exit. Snapshot children leave with
+ * _exit, which skips writing coverage counters, so write them first.
+ */
+void __gcov_dump(void);
+_Noreturn void __real__exit(int status);
+
+_Noreturn void __wrap__exit(int status) {
+    __gcov_dump(), __real__exit(status);
+}
+
 void test_init_misalignment() {
 	start_test;
     alignas(max_align_t) char pvlbuf[pvl_sizeof(1)+1];
@@ -400,6 +436,7 @@ typedef struct {
      */
     char iobuf[CTX_BUFFER_SIZE];
     size_t iobuf_pos;
+    size_t iobuf_len;
 
     read_mock     read_data[10];
     int           read_pos;
@@ -450,6 +487,30 @@ int write_cb(void *ctx, void *from, size_t length, size_t remaining) {
     return fix.return_int;
 }
 
+/* Appends everything to the iobuf without expectations */
+int buffer_write_cb(void *ctx, void *from, size_t length, size_t remaining) {
+    (void)(remaining);
+    test_ctx *t = (test_ctx*) ctx;
+    memcpy(t->iobuf+t->iobuf_pos, from, length);
+    t->iobuf_pos += length;
+    t->iobuf_len = t->iobuf_pos;
+    return 0;
+}
+
+/* Reads back whatever buffer_write_cb has stored */
+int buffer_read_cb(void *ctx, void *to, size_t length, size_t remaining) {
+    test_ctx *t = (test_ctx*) ctx;
+    if (to == NULL) {
+        return (t->iobuf_pos + remaining) > t->iobuf_len;
+    }
+    if ((t->iobuf_pos + length) > t->iobuf_len) {
+        return EOF;
+    }
+    memcpy(to, t->iobuf+t->iobuf_pos, length);
+    t->iobuf_pos += length;
+    return 0;
+}
+
 void leak_cb(void *ctx, void *start, size_t length) {
     test_ctx *t = (test_ctx*) ctx;
 
@@ -1540,6 +1601,85 @@ void test_invalid_span_header_03() {
     }
 }
 
+void test_mark_span_boundary() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    // A mark that ends on a span boundary does not reach into the next span
+    assert(!pvl_mark(ctx.pvl, ctx.main, 64));
+    assert(!pvl_commit(ctx.pvl));
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 1);
+    assert(h_ptr[1] == pvl_header_size + 64);
+    assert((h_ptr[2] == 0) && (h_ptr[3] == 64));
+}
+
+void test_commit_clears_spans() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    // Committed spans past the first one are cleared
+    assert(!pvl_mark(ctx.pvl, ctx.main+64, 64));
+    assert(!pvl_mark(ctx.pvl, ctx.main+512, 1));
+    assert(!pvl_commit(ctx.pvl));
+    size_t committed = ctx.iobuf_pos;
+    assert(committed == (3*pvl_header_size) + 128);
+    assert(!pvl_commit(ctx.pvl));
+    assert(ctx.iobuf_pos == committed);
+}
+
+void test_load_span_at_end() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    memset(ctx.main+CTX_BUFFER_SIZE-64, 1, 64);
+    assert(!pvl_mark(ctx.pvl, ctx.main+CTX_BUFFER_SIZE-64, 64));
+    assert(!pvl_commit(ctx.pvl));
+
+    // A span that ends at the end of main is loaded
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert(ctx.iobuf_pos == ctx.iobuf_len);
+    assert((ctx.main[CTX_BUFFER_SIZE-65] == 0) && (ctx.main[CTX_BUFFER_SIZE-64] == 1));
+    assert(ctx.main[CTX_BUFFER_SIZE-1] == 1);
+}
+
+void test_write_remaining_hint() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, write_cb) == 0);
+
+    // The remaining bytes count down for spans that do not start at zero
+    size_t expected[][2] = {
+        {pvl_header_size, (2*pvl_header_size) + 128},
+        {pvl_header_size, pvl_header_size + 128},
+        {64, pvl_header_size + 64},
+        {pvl_header_size, 64},
+        {64, 0},
+    };
+    for (size_t i = 0; i < 5; i++) {
+        ctx.write_data[i].expected_length = expected[i][0];
+        ctx.write_data[i].expected_remaining = expected[i][1];
+    }
+    assert(!pvl_mark(ctx.pvl, ctx.main+64, 64));
+    assert(!pvl_mark(ctx.pvl, ctx.main+256, 64));
+    assert(!pvl_commit(ctx.pvl));
+    assert(ctx.write_pos == 5);
+}
+
 void test_leak_detected() {
     start_test;
     size_t marks_count = CTX_BUFFER_SIZE/32;
@@ -1647,6 +1787,21 @@ void test_bitset_range() {
 	}
 }
 
+void test_bitset_clear_range_bounds() {
+	start_test;
+	unsigned char buf[4];
+	size_t bitset_length = 32;
+	for (size_t i = 0; i < bitset_length; i++) {
+		for (size_t j = 0; j <= i; j++) {
+			memset(buf, 0xff, 4);
+			bitset_clear_range(buf, j, i);
+			for (size_t k = 0; k < bitset_length; k++) {
+				assert(bitset_test(buf, k) == ((k < j) || (k > i)));
+			}
+		}
+	}
+}
+
 void test_bbt_sizeof_invalid_order() {
 	start_test;
 	assert(bbt_sizeof(0) == 0);
@@ -1762,87 +1917,4146 @@ void test_bbt_basic() {
 	bbt_order(bbt);
 }
 
-int main() {
-    {
-        test_init_misalignment();
-        test_init_alignment();
-        test_init_zero_marks();
-        test_init_null_main();
-        test_init_non_null_main();
-        test_init_zero_length();
-        test_init_non_zero_length();
-        test_init_non_divisible_spans();
-        test_init_main_mirror_overlap();
-        test_init_main_mirror_no_overlap();
-        test_init_mirror_main_overlap();
-        test_init_mirror_main_no_overlap();
+void test_leak_range_tail() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_leak_cb(ctx.pvl, &ctx, leak_cb) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
 
-        test_mark_pvl_null();
-        test_mark_mark_null();
-        test_mark_zero_length();
-        test_mark_before_main();
-        test_mark_mark_main_overlap();
-        test_mark_main_mark_overlap();
-        test_mark_after_main();
-        test_mark_start_of_main();
-        test_mark_middle_of_main();
-        test_mark_end_of_main();
-        test_mark_all_of_main();
-        test_mark_extra_marks();
+    // Diffs that reach the end of an unmarked run are reported
+    ctx.leak_data[0].expected_start = ctx.main+127;
+    ctx.leak_data[0].expected_length = 1;
+    ctx.leak_data[1].expected_start = ctx.main+CTX_BUFFER_SIZE-1;
+    ctx.leak_data[1].expected_length = 1;
 
-        test_commit_pvl_null();
-        test_commit_no_mark();
-        test_commit_single_mark();
-        test_commit_max_marks();
-        test_commit_over_max_marks();
+    ctx.main[127] = 1;
+    ctx.main[CTX_BUFFER_SIZE-1] = 1;
+    assert(!pvl_mark(ctx.pvl, ctx.main+128, 64));
+    assert(!pvl_commit(ctx.pvl));
+    assert(ctx.leak_pos == 2);
+}
 
-        test_set_read_cb_null_pvl();
-        test_set_write_cb_null_pvl();
-        test_set_mirror_null_pvl();
-        test_set_leak_cb_null_pvl();
+void test_extents_set_invalid() {
+    start_test;
+    alignas(max_align_t) char pvlbuf[pvl_sizeof(8)];
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)+1];
+    char buffer[1024];
+    assert(pvl_set_extents(NULL, extents, 4) != 0);
+    struct pvl *pvl = pvl_init(pvlbuf, buffer, 1024, 8);
+    assert(pvl != NULL);
+    assert(pvl_set_extents(pvl, NULL, 4) != 0);
+    assert(pvl_set_extents(pvl, extents, 0) != 0);
+    assert(pvl_set_extents(pvl, extents+1, 4) != 0);
+    assert(pvl_set_write_cb(pvl, NULL, noop_write_cb) == 0);
+    assert(!pvl_mark(pvl, buffer, 1));
+    assert(pvl_set_extents(pvl, extents, 4) != 0);
+    assert(!pvl_commit(pvl));
+    assert(pvl_set_extents(pvl, extents, 4) == 0);
+    assert(pvl_set_extents(pvl, extents, 4) != 0);
+}
 
-        test_set_read_cb_twice();
-        test_set_write_cb_twice();
-        test_set_mirror_twice();
-        test_set_leak_cb_twice();
+void test_extents_commit() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char extents[pvl_extents_sizeof(8)];
 
-		test_init_leak_no_mirror();
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_extents(ctx.pvl, extents, 8) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    for (size_t i = 0; i < CTX_BUFFER_SIZE; i++) {
+        ctx.main[i] = (char) i;
     }
 
-    {
-        test_basic_commit();
-        test_basic_commit_mirror();
+    assert(!pvl_mark(ctx.pvl, ctx.main+10, 10));
+    assert(!pvl_mark(ctx.pvl, ctx.main+30, 10));
+    // Adjacent to the first one
+    assert(!pvl_mark(ctx.pvl, ctx.main+20, 5));
+    // Overlaps the first one
+    assert(!pvl_mark(ctx.pvl, ctx.main+5, 7));
+    // After, before and in between
+    assert(!pvl_mark(ctx.pvl, ctx.main+1020, 4));
+    assert(!pvl_mark(ctx.pvl, ctx.main, 2));
+    assert(!pvl_mark(ctx.pvl, ctx.main+50, 10));
+    // Contained in an existing one
+    assert(!pvl_mark(ctx.pvl, ctx.main+52, 2));
+    assert(!pvl_commit(ctx.pvl));
 
-        test_read_failure_01();
-        test_read_failure_02();
+    size_t expected[] = {0, 2, 5, 25, 30, 40, 50, 60, 1020, 1024};
+    size_t expected_spans = 5;
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == expected_spans);
+    assert(h_ptr[1] == (2+20+10+10+4) + (expected_spans * pvl_header_size));
+    size_t pos = pvl_header_size;
+    for (size_t i = 0; i < expected_spans; i++) {
+        size_t header[2];
+        memcpy(header, ctx.iobuf+pos, sizeof(header));
+        assert(header[0] == expected[2*i]);
+        assert(header[1] == expected[(2*i)+1]);
+        pos += sizeof(header);
+        assert(!memcmp(ctx.iobuf+pos, ctx.main+header[0], header[1]-header[0]));
+        pos += header[1]-header[0];
+    }
+    assert(pos == ctx.iobuf_len);
 
-        test_read_partial_failure_01();
-        test_read_partial_failure_02();
+    // Nothing is left marked
+    assert(!pvl_commit(ctx.pvl));
+    assert(pos == ctx.iobuf_len);
 
-        test_write_no_marks();
+    // Restore into a clean main block
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    for (size_t i = 0; i < CTX_BUFFER_SIZE; i++) {
+        _Bool marked = 0;
+        for (size_t j = 0; j < expected_spans; j++) {
+            marked |= (i >= expected[2*j]) && (i < expected[(2*j)+1]);
+        }
+        assert(ctx.main[i] == (marked ? (char) i : 0));
+    }
+}
 
-        test_write_failure_01();
-        test_write_failure_02();
-        test_write_failure_03();
+void test_extents_over_capacity() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char extents[pvl_extents_sizeof(2)];
 
-        test_invalid_change_header_01();
-        test_invalid_change_header_02();
-        test_invalid_change_header_03();
-        test_invalid_change_header_04();
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_extents(ctx.pvl, extents, 2) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(!pvl_mark(ctx.pvl, ctx.main+10, 1));
+    // The closest extents are merged
+    assert(!pvl_mark(ctx.pvl, ctx.main+13, 1));
+    assert(!pvl_mark(ctx.pvl, ctx.main+100, 1));
+    assert(!pvl_commit(ctx.pvl));
 
-        test_invalid_span_header_01();
-        test_invalid_span_header_02();
-        test_invalid_span_header_03();
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 2);
+    assert(h_ptr[2] == 0);
+    assert(h_ptr[3] == 14);
+    size_t header[2];
+    memcpy(header, ctx.iobuf+(2*pvl_header_size)+14, sizeof(header));
+    assert(header[0] == 100);
+    assert(header[1] == 101);
+}
+
+void test_extents_leak_detected() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)];
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_extents(ctx.pvl, extents, 4) == 0);
+    assert(pvl_set_leak_cb(ctx.pvl, &ctx, leak_cb) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    ctx.leak_data[0].expected_start = ctx.main+8;
+    ctx.leak_data[0].expected_length = 2;
+    ctx.leak_data[1].expected_start = ctx.main+CTX_BUFFER_SIZE-1;
+    ctx.leak_data[1].expected_length = 1;
+
+    memset(ctx.main, 1, 4);
+    memset(ctx.main+8, 1, 2);
+    ctx.main[CTX_BUFFER_SIZE-1] = 1;
+    assert(!pvl_mark(ctx.pvl, ctx.main, 4));
+    assert(!pvl_commit(ctx.pvl));
+    assert(ctx.leak_pos == 2);
+    assert(ctx.mirror[3] == 1);
+    assert(ctx.mirror[8] == 0);
+}
+
+void test_coalesce_set_invalid() {
+    start_test;
+    alignas(max_align_t) char pvlbuf[pvl_sizeof(1)];
+    char buffer[1024];
+    assert(pvl_set_coalesce(NULL, 0) != 0);
+    struct pvl *pvl = pvl_init(pvlbuf, buffer, 1024, 1);
+    assert(pvl != NULL);
+    assert(pvl_set_coalesce(pvl, 0) == 0);
+    assert(pvl_set_coalesce(pvl, 0) != 0);
+}
+
+void test_coalesce_spans() {
+    start_test;
+    test_ctx ctx = {0};
+    size_t span_length = pvl_header_size;
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, CTX_BUFFER_SIZE/span_length);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_coalesce(ctx.pvl, 0) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    memset(ctx.main, 1, CTX_BUFFER_SIZE);
+    // A gap the size of a span header is absorbed, a larger one is not
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(!pvl_mark(ctx.pvl, ctx.main+(2*span_length), 1));
+    assert(!pvl_mark(ctx.pvl, ctx.main+(5*span_length), 1));
+    assert(!pvl_commit(ctx.pvl));
+
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 2);
+    assert(h_ptr[1] == (4*span_length) + (2*pvl_header_size));
+    assert(h_ptr[2] == 0);
+    assert(h_ptr[3] == 3*span_length);
+    size_t header[2];
+    memcpy(header, ctx.iobuf+(2*pvl_header_size)+(3*span_length), sizeof(header));
+    assert(header[0] == 5*span_length);
+    assert(header[1] == 6*span_length);
+    assert(ctx.iobuf_len == (3*pvl_header_size)+(4*span_length));
+
+    // All spans were cleared, including the absorbed ones
+    assert(!pvl_commit(ctx.pvl));
+    assert(ctx.iobuf_len == (3*pvl_header_size)+(4*span_length));
+
+    // Restore into a clean main block
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, CTX_BUFFER_SIZE/span_length);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    for (size_t i = 0; i < CTX_BUFFER_SIZE; i++) {
+        _Bool persisted = (i < 3*span_length) || ((i >= 5*span_length) && (i < 6*span_length));
+        assert(ctx.main[i] == persisted);
     }
+}
 
-    {
-        test_leak_detected();
-        test_leak_no_leak();
+void test_coalesce_extents() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)];
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_extents(ctx.pvl, extents, 4) == 0);
+    assert(pvl_set_coalesce(ctx.pvl, 8) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    assert(!pvl_mark(ctx.pvl, ctx.main, 4));
+    assert(!pvl_mark(ctx.pvl, ctx.main+10, 4));
+    assert(!pvl_mark(ctx.pvl, ctx.main+30, 4));
+    assert(!pvl_mark(ctx.pvl, ctx.main+100, 4));
+    assert(!pvl_commit(ctx.pvl));
+
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 2);
+    assert(h_ptr[2] == 0);
+    assert(h_ptr[3] == 34);
+}
+
+#define compact_tag(width_code) ((size_t)(0x80u | (width_code)) << ((sizeof(size_t) - 1) * CHAR_BIT))
+
+void test_coalesce_compact() {
+    start_test;
+    test_ctx ctx = {0};
+    // Compact records of a 128 span block take three bytes
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 128);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_coalesce(ctx.pvl, 0) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    // A one span gap costs more than a compact record
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(!pvl_mark(ctx.pvl, ctx.main+16, 1));
+    assert(!pvl_commit(ctx.pvl));
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == (compact_tag(0) | 2));
+
+    // It is absorbed when the call cost makes up the difference
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 128);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_coalesce(ctx.pvl, 5) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(!pvl_mark(ctx.pvl, ctx.main+16, 1));
+    assert(!pvl_commit(ctx.pvl));
+    assert(h_ptr[0] == (compact_tag(0) | 1));
+}
+
+void test_compact_set_invalid() {
+    start_test;
+    alignas(max_align_t) char pvlbuf[pvl_sizeof(1)];
+    char buffer[1024];
+    assert(pvl_set_compact(NULL) != 0);
+    struct pvl *pvl = pvl_init(pvlbuf, buffer, 1024, 1);
+    assert(pvl != NULL);
+    assert(pvl_set_compact(pvl) == 0);
+    assert(pvl_set_compact(pvl) != 0);
+}
+
+void test_compact_spans() {
+    start_test;
+    test_ctx ctx = {0};
+    size_t span_count = 64;
+    size_t span_length = CTX_BUFFER_SIZE/span_count;
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, span_count);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    for (size_t i = 0; i < CTX_BUFFER_SIZE; i++) {
+        ctx.main[i] = (char) i;
+    }
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(!pvl_mark(ctx.pvl, ctx.main+(3*span_length), 2*span_length));
+    assert(!pvl_commit(ctx.pvl));
+
+    // Both records use span units and single byte fields
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == (compact_tag(0) | 2));
+    assert(h_ptr[1] == (2*3) + (3*span_length));
+    const unsigned char first[] = {0x01, 0, 1};
+    assert(!memcmp(ctx.iobuf+pvl_header_size, first, sizeof(first)));
+    const unsigned char second[] = {0x01, 2, 2};
+    assert(!memcmp(ctx.iobuf+pvl_header_size+sizeof(first)+span_length, second, sizeof(second)));
+    assert(ctx.iobuf_len == pvl_header_size+(2*3)+(3*span_length));
+
+    // Restore into a clean main block
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, span_count);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    for (size_t i = 0; i < CTX_BUFFER_SIZE; i++) {
+        _Bool persisted = (i < span_length) || ((i >= 3*span_length) && (i < 5*span_length));
+        assert(ctx.main[i] == (persisted ? (char) i : 0));
+    }
+}
+
+void test_compact_extents() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)];
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_extents(ctx.pvl, extents, 4) == 0);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    for (size_t i = 0; i < CTX_BUFFER_SIZE; i++) {
+        ctx.main[i] = (char) i;
+    }
+    assert(!pvl_mark(ctx.pvl, ctx.main+1, 3));
+    assert(!pvl_mark(ctx.pvl, ctx.main+1000, 10));
+    assert(!pvl_commit(ctx.pvl));
+
+    // Byte units, the second delta needs two byte fields
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == (compact_tag(1) | 2));
+    assert(h_ptr[1] == (2*5) + 13);
+    const unsigned char first[] = {0x00, 1, 0, 3, 0};
+    assert(!memcmp(ctx.iobuf+pvl_header_size, first, sizeof(first)));
+    const unsigned char second[] = {0x00, 996 & 0xff, 996 >> 8, 10, 0};
+    assert(!memcmp(ctx.iobuf+pvl_header_size+sizeof(first)+3, second, sizeof(second)));
+
+    // Restore into a clean main block
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    for (size_t i = 0; i < CTX_BUFFER_SIZE; i++) {
+        _Bool persisted = ((i >= 1) && (i < 4)) || ((i >= 1000) && (i < 1010));
+        assert(ctx.main[i] == (persisted ? (char) i : 0));
+    }
+}
+
+/* Load a forged change, returning the pvl_set_read_cb result */
+int load_forged(test_ctx *ctx, size_t spans, size_t content_size, const void *content, size_t length) {
+    size_t header[2] = {spans, content_size};
+    memcpy(ctx->iobuf, header, sizeof(header));
+    memcpy(ctx->iobuf+sizeof(header), content, length);
+    ctx->iobuf_len = sizeof(header) + length;
+    ctx->iobuf_pos = 0;
+    ctx->pvl = pvl_init(ctx->pvl_at, ctx->main, CTX_BUFFER_SIZE, 8);
+    assert(ctx->pvl != NULL);
+    return pvl_set_read_cb(ctx->pvl, ctx, buffer_read_cb);
+}
+
+void test_compact_invalid_tag() {
+    start_test;
+    test_ctx ctx = {0};
+    const unsigned char content[] = {0x00, 0, 1, 1};
+    // Unknown changes are not applied
+    assert(load_forged(&ctx, compact_tag(0x10) | 1, sizeof(content), content, sizeof(content)) == 0);
+    assert(ctx.iobuf_pos == pvl_header_size);
+    assert(ctx.main[0] == 0);
+
+    // Without the top bit the tag byte is part of a legacy span count, too large for the block
+    memset(&ctx, 0, sizeof(ctx));
+    size_t tag = compact_tag(0) ^ compact_tag(0x40);
+    assert(load_forged(&ctx, tag | 1, sizeof(content), content, sizeof(content)) == 0);
+    assert(ctx.iobuf_pos == pvl_header_size);
+    assert(ctx.main[0] == 0);
+}
+
+void test_compact_invalid_flags() {
+    start_test;
+    test_ctx ctx = {0};
+    const unsigned char content[] = {0x80, 0, 1, 1};
+    assert(load_forged(&ctx, compact_tag(0) | 1, sizeof(content), content, sizeof(content)) != 0);
+}
+
+void test_compact_invalid_delta() {
+    start_test;
+    test_ctx ctx = {0};
+    const unsigned char content[] = {0x01, 9, 1, 1};
+    assert(load_forged(&ctx, compact_tag(0) | 1, sizeof(content), content, sizeof(content)) != 0);
+}
+
+void test_compact_invalid_length() {
+    start_test;
+    test_ctx ctx = {0};
+    const unsigned char content[] = {0x00, 0, 2, 1};
+    assert(load_forged(&ctx, compact_tag(0) | 1, sizeof(content), content, sizeof(content)) != 0);
+}
+
+void test_compact_invalid_header() {
+    start_test;
+    test_ctx ctx = {0};
+    const unsigned char content[] = {0x00, 0, 5, 1, 1, 1, 1, 1};
+    assert(load_forged(&ctx, compact_tag(0) | 2, sizeof(content), content, sizeof(content)) != 0);
+}
+
+void test_fill_records() {
+    start_test;
+    test_ctx ctx = {0};
+    size_t span_count = 16;
+    size_t span_length = CTX_BUFFER_SIZE/span_count;
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, span_count);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    // A repeated byte, a repeated word and regular content
+    memset(ctx.main, 0x5a, span_length);
+    const unsigned char word[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for (size_t i = 0; i < span_length; i += sizeof(word)) {
+        memcpy(ctx.main+(2*span_length)+i, word, sizeof(word));
+    }
+    for (size_t i = 0; i < span_length; i++) {
+        ctx.main[(4*span_length)+i] = (char) i;
+    }
+    assert(!pvl_mark(ctx.pvl, ctx.main, span_length));
+    assert(!pvl_mark(ctx.pvl, ctx.main+(2*span_length), span_length));
+    assert(!pvl_mark(ctx.pvl, ctx.main+(4*span_length), span_length));
+    assert(!pvl_commit(ctx.pvl));
+
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == (compact_tag(0) | 3));
+    assert(h_ptr[1] == (3*3) + 1 + sizeof(word) + span_length);
+    const unsigned char byte_fill[] = {0x03, 0, 1, 0x5a};
+    assert(!memcmp(ctx.iobuf+pvl_header_size, byte_fill, sizeof(byte_fill)));
+    const unsigned char word_fill[] = {0x05, 1, 1};
+    assert(!memcmp(ctx.iobuf+pvl_header_size+sizeof(byte_fill), word_fill, sizeof(word_fill)));
+    assert(!memcmp(ctx.iobuf+pvl_header_size+sizeof(byte_fill)+sizeof(word_fill), word, sizeof(word)));
+    assert(ctx.iobuf_len == pvl_header_size + h_ptr[1]);
+
+    // Restore into a clean main block
+    char expected[CTX_BUFFER_SIZE];
+    memcpy(expected, ctx.main, CTX_BUFFER_SIZE);
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, span_count);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert(!memcmp(ctx.main, expected, CTX_BUFFER_SIZE));
+}
+
+void test_fill_short_word() {
+    start_test;
+    test_ctx ctx = {0};
+    // A word fill shorter than the word itself is truncated
+    const unsigned char content[] = {0x04, 0, 3, 1, 2, 3, 4, 5, 6, 7, 8};
+    assert(load_forged(&ctx, compact_tag(0) | 1, sizeof(content), content, sizeof(content)) == 0);
+    assert((ctx.main[0] == 1) && (ctx.main[1] == 2) && (ctx.main[2] == 3) && (ctx.main[3] == 0));
+}
+
+void test_fill_invalid_flags() {
+    start_test;
+    test_ctx ctx = {0};
+    const unsigned char content[] = {0x06, 0, 1, 1};
+    assert(load_forged(&ctx, compact_tag(0) | 1, sizeof(content), content, sizeof(content)) != 0);
+}
+
+void test_fill_invalid_pattern() {
+    start_test;
+    test_ctx ctx = {0};
+    const unsigned char content[] = {0x04, 0, 16, 1};
+    assert(load_forged(&ctx, compact_tag(0) | 1, sizeof(content), content, sizeof(content)) != 0);
+}
+
+void test_fill_read_failure() {
+    start_test;
+    test_ctx ctx = {0};
+    const unsigned char content[] = {0x02, 0, 4, 1};
+    size_t header[2] = {compact_tag(0) | 1, sizeof(content)};
+    memcpy(ctx.iobuf, header, sizeof(header));
+    memcpy(ctx.iobuf+sizeof(header), content, sizeof(content));
+
+    ctx.read_data[0].expected_length = pvl_header_size;
+    ctx.read_data[0].expected_remaining = 0;
+    ctx.read_data[0].return_int = 0;
+
+    ctx.read_data[1].expected_length = 0;
+    ctx.read_data[1].expected_remaining = sizeof(content);
+    ctx.read_data[1].return_int = 0;
+
+    ctx.read_data[2].expected_length = 3;
+    ctx.read_data[2].expected_remaining = 1;
+    ctx.read_data[2].return_int = 0;
+
+    ctx.read_data[3].expected_length = 1;
+    ctx.read_data[3].expected_remaining = 0;
+    ctx.read_data[3].return_int = 1;
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, read_cb) != 0);
+    assert(ctx.read_pos == 4);
+}
+
+void test_add_region_invalid() {
+    start_test;
+    alignas(max_align_t) char pvlbuf[pvl_sizeof(1)];
+    alignas(max_align_t) char regionbuf[pvl_region_sizeof(4)+1];
+    char buffer[1024];
+    char other[1024];
+    char mirror[2048];
+    assert(pvl_add_region(NULL, regionbuf, other, 1024, 4) != 0);
+
+    struct pvl *pvl = pvl_init(pvlbuf, buffer, 1024, 1);
+    assert(pvl != NULL);
+    assert(pvl_add_region(pvl, NULL, other, 1024, 4) != 0);
+    assert(pvl_add_region(pvl, regionbuf+1, other, 1024, 4) != 0);
+    assert(pvl_add_region(pvl, regionbuf, buffer+512, 512, 4) != 0);
+    assert(pvl_add_region(pvl, regionbuf, NULL, 1024, 4) != 0);
+    assert(pvl_add_region(pvl, regionbuf, other, 1024, 3) != 0);
+    assert(pvl_add_region(pvl, regionbuf, other, 1024, 4) == 0);
+    assert(pvl_add_region(pvl, regionbuf, other, 1024, 4) != 0);
+
+    // The mirror must not overlap any region
+    assert(pvl_set_mirror(pvl, other+1023) != 0);
+    assert(pvl_set_mirror(pvl, mirror) == 0);
+    assert(pvl_add_region(pvl, regionbuf, other, 1024, 4) != 0);
+
+    pvl = pvl_init(pvlbuf, buffer, 1024, 1);
+    assert(pvl != NULL);
+    assert(pvl_set_read_cb(pvl, NULL, noop_read_cb) == 0);
+    assert(pvl_add_region(pvl, regionbuf, other, 1024, 4) != 0);
+}
+
+void test_regions_mark() {
+    start_test;
+    alignas(max_align_t) char pvlbuf[pvl_sizeof(1)];
+    alignas(max_align_t) char regionbuf[pvl_region_sizeof(4)];
+    char buffer[1024];
+    struct pvl *pvl = pvl_init(pvlbuf, buffer, 512, 1);
+    assert(pvl != NULL);
+    assert(pvl_add_region(pvl, regionbuf, buffer+512, 512, 4) == 0);
+    assert(!pvl_mark(pvl, buffer+500, 12));
+    assert(!pvl_mark(pvl, buffer+512, 512));
+    // Marks must not cross regions even if they are adjacent in memory
+    assert(pvl_mark(pvl, buffer+500, 24));
+    assert(pvl_mark(pvl, buffer+1020, 8));
+}
+
+void test_regions_commit() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char table_at[pvl_region_sizeof(16)];
+    alignas(max_align_t) char heap_at[pvl_region_sizeof(8)];
+    char header[64];
+    char table[256];
+    char heap[512];
+
+    ctx.pvl = pvl_init(ctx.pvl_at, header, sizeof(header), 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, table_at, table, sizeof(table), 16) == 0);
+    assert(pvl_add_region(ctx.pvl, heap_at, heap, sizeof(heap), 8) == 0);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_leak_cb(ctx.pvl, &ctx, leak_cb) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    memset(header, 1, sizeof(header));
+    memset(table, 2, sizeof(table));
+    memset(heap, 3, sizeof(heap));
+    assert(!pvl_mark(ctx.pvl, header, sizeof(header)));
+    assert(!pvl_mark(ctx.pvl, table+20, 1));
+    assert(!pvl_mark(ctx.pvl, heap+64, 64));
+    // Unmarked content is reported at its own address
+    ctx.leak_data[0].expected_start = table;
+    ctx.leak_data[0].expected_length = 16;
+    ctx.leak_data[1].expected_start = table+32;
+    ctx.leak_data[1].expected_length = sizeof(table)-32;
+    ctx.leak_data[2].expected_start = heap;
+    ctx.leak_data[2].expected_length = 64;
+    ctx.leak_data[3].expected_start = heap+128;
+    ctx.leak_data[3].expected_length = sizeof(heap)-128;
+    assert(!pvl_commit(ctx.pvl));
+    assert(ctx.leak_pos == 4);
+
+    // A single change with offsets in the combined block
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 3);
+    assert(h_ptr[1] == (3*pvl_header_size)+64+16+64);
+    size_t span[2];
+    memcpy(span, ctx.iobuf+pvl_header_size, sizeof(span));
+    assert((span[0] == 0) && (span[1] == 64));
+    memcpy(span, ctx.iobuf+(2*pvl_header_size)+64, sizeof(span));
+    assert((span[0] == 64+16) && (span[1] == 64+32));
+    memcpy(span, ctx.iobuf+(3*pvl_header_size)+64+16, sizeof(span));
+    assert((span[0] == 64+256+64) && (span[1] == 64+256+128));
+    assert(ctx.mirror[64+16] == 2);
+    assert(ctx.mirror[64+256+64] == 3);
+    assert(ctx.mirror[64+256] == 0);
+
+    // Restore into clean regions
+    memset(header, 0, sizeof(header));
+    memset(table, 0, sizeof(table));
+    memset(heap, 0, sizeof(heap));
+    memset(ctx.mirror, 0, sizeof(ctx.mirror));
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, header, sizeof(header), 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, table_at, table, sizeof(table), 16) == 0);
+    assert(pvl_add_region(ctx.pvl, heap_at, heap, sizeof(heap), 8) == 0);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert((header[0] == 1) && (header[63] == 1));
+    assert((table[15] == 0) && (table[16] == 2) && (table[31] == 2) && (table[32] == 0));
+    assert((heap[63] == 0) && (heap[64] == 3) && (heap[127] == 3) && (heap[128] == 0));
+    assert(!memcmp(ctx.mirror+64, table, sizeof(table)));
+}
+
+void test_regions_compact_extents() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char region_at[pvl_region_sizeof(4)];
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)];
+    char first[64];
+    char second[64];
+
+    ctx.pvl = pvl_init(ctx.pvl_at, first, sizeof(first), 4);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, region_at, second, sizeof(second), 4) == 0);
+    assert(pvl_set_extents(ctx.pvl, extents, 4) == 0);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_coalesce(ctx.pvl, 64) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    for (size_t i = 0; i < sizeof(first); i++) {
+        first[i] = (char) i;
+        second[i] = (char) (i+sizeof(first));
+    }
+    // Extents touching across the region boundary are split
+    assert(!pvl_mark(ctx.pvl, first+60, 4));
+    assert(!pvl_mark(ctx.pvl, second, 20));
+    assert(!pvl_mark(ctx.pvl, second+40, 8));
+    assert(!pvl_commit(ctx.pvl));
+
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == (compact_tag(0) | 2));
+    const unsigned char first_record[] = {0x00, 60, 4};
+    assert(!memcmp(ctx.iobuf+pvl_header_size, first_record, sizeof(first_record)));
+    const unsigned char second_record[] = {0x01, 0, 3};
+    assert(!memcmp(ctx.iobuf+pvl_header_size+3+4, second_record, sizeof(second_record)));
+
+    // Restore into clean regions
+    memset(first, 0, sizeof(first));
+    memset(second, 0, sizeof(second));
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, first, sizeof(first), 4);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, region_at, second, sizeof(second), 4) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert((first[59] == 0) && (first[60] == 60));
+    assert((second[0] == 64) && (second[47] == 64+47) && (second[48] == 0));
+}
+
+void test_regions_compact_extents_fill() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char region_at[pvl_region_sizeof(4)];
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)];
+    char first[64];
+    char second[64];
+
+    ctx.pvl = pvl_init(ctx.pvl_at, first, sizeof(first), 4);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, region_at, second, sizeof(second), 4) == 0);
+    assert(pvl_set_extents(ctx.pvl, extents, 4) == 0);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    // Regular content continued by a repeated byte in the next region, then a repeated word
+    for (size_t i = 0; i < sizeof(first); i++) {
+        first[i] = (char) i;
+    }
+    memset(second, 0x33, 16);
+    const unsigned char word[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for (size_t i = 32; i < 56; i += sizeof(word)) {
+        memcpy(second+i, word, sizeof(word));
+    }
+    assert(!pvl_mark(ctx.pvl, first+60, 4));
+    assert(!pvl_mark(ctx.pvl, second, 16));
+    assert(!pvl_mark(ctx.pvl, second+32, 24));
+    assert(!pvl_commit(ctx.pvl));
+
+    // Each part of the split extent keeps its own fill flags
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == (compact_tag(0) | 3));
+    assert(h_ptr[1] == (3*3) + 4 + 1 + 8);
+    const unsigned char first_record[] = {0x00, 60, 4};
+    assert(!memcmp(ctx.iobuf+pvl_header_size, first_record, sizeof(first_record)));
+    const unsigned char second_record[] = {0x03, 0, 1, 0x33};
+    assert(!memcmp(ctx.iobuf+pvl_header_size+3+4, second_record, sizeof(second_record)));
+    const unsigned char third_record[] = {0x04, 16, 24, 1};
+    assert(!memcmp(ctx.iobuf+pvl_header_size+3+4+4, third_record, sizeof(third_record)));
+
+    // Restore into clean regions
+    memset(first, 0, sizeof(first));
+    memset(second, 0, sizeof(second));
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, first, sizeof(first), 4);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, region_at, second, sizeof(second), 4) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert((first[59] == 0) && (first[60] == 60) && (first[63] == 63));
+    assert((second[0] == 0x33) && (second[15] == 0x33) && (second[16] == 0));
+    assert((second[32] == 1) && (second[55] == 8) && (second[56] == 0));
+}
+
+void test_regions_invalid_span() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char region_at[pvl_region_sizeof(1)];
+    char second[64];
+    size_t header[4] = {1, (2*sizeof(size_t))+8, 60, 68};
+    memcpy(ctx.iobuf, header, sizeof(header));
+    ctx.iobuf_len = sizeof(header) + 8;
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, 64, 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, region_at, second, sizeof(second), 1) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) != 0);
+}
+
+void test_regions_span_after_end() {
+    start_test;
+    test_ctx ctx = {0};
+    // A span in span_length units following a span that ends the last region
+    const unsigned char content[] = {0x03, 0, 8, 0x5a, 0x03, 0, 1, 0x5a};
+    assert(load_forged(&ctx, compact_tag(0) | 2, sizeof(content), content, sizeof(content)) != 0);
+}
+
+void test_mark_many_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    struct pvl_range ranges[] = {{ctx.main, 1}, {ctx.main+CTX_BUFFER_SIZE-1, 2}};
+    assert(pvl_mark_many(NULL, ranges, 1) != 0);
+    assert(pvl_mark_many(ctx.pvl, NULL, 1) != 0);
+    assert(pvl_mark_many(ctx.pvl, ranges, 0) != 0);
+    assert(pvl_mark_many(ctx.pvl, ranges, 2) != 0);
+    ranges[1].start = NULL;
+    assert(pvl_mark_many(ctx.pvl, ranges, 2) != 0);
+    ranges[1].start = ctx.main+1;
+    ranges[1].length = 0;
+    assert(pvl_mark_many(ctx.pvl, ranges, 2) != 0);
+
+    // Ranges before an invalid one remain marked
+    assert(!pvl_commit(ctx.pvl));
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert((h_ptr[0] == 1) && (h_ptr[1] == pvl_header_size+64));
+}
+
+void test_mark_many_merge() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char table_at[pvl_region_sizeof(4)];
+    char table[256];
+    struct pvl_stats stats;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, table_at, table, sizeof(table), 4) == 0);
+    assert(pvl_set_stats(ctx.pvl, &stats) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    const struct pvl_range ranges[] = {
+        {ctx.main, 1},
+        {ctx.main+64, 1},  // next span
+        {ctx.main+10, 1},  // same span
+        {ctx.main+512, 10},
+        {ctx.main+300, 1}, // before the last one
+        {table+200, 1},    // another region
+        {ctx.main+1000, 1}
+    };
+    assert(pvl_mark_many(ctx.pvl, ranges, sizeof(ranges)/sizeof(ranges[0])) == 0);
+    assert(stats.marks == sizeof(ranges)/sizeof(ranges[0]));
+    assert(stats.marked_bytes == 16);
+    assert(!pvl_commit(ctx.pvl));
+
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 5);
+    size_t expected[] = {0, 128, 256, 320, 512, 576, 960, 1024, 1024+192, 1024+256};
+    size_t pos = pvl_header_size;
+    for (size_t i = 0; i < 5; i++) {
+        size_t span[2];
+        memcpy(span, ctx.iobuf+pos, sizeof(span));
+        assert((span[0] == expected[2*i]) && (span[1] == expected[(2*i)+1]));
+        pos += pvl_header_size + (span[1] - span[0]);
+    }
+}
+
+void test_mark_many_extents() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_extents(ctx.pvl, extents, 4) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    const struct pvl_range ranges[] = {{ctx.main+20, 4}, {ctx.main+10, 10}};
+    assert(pvl_mark_many(ctx.pvl, ranges, 2) == 0);
+    assert(!pvl_commit(ctx.pvl));
+    size_t span[2];
+    memcpy(span, ctx.iobuf+pvl_header_size, sizeof(span));
+    assert((span[0] == 10) && (span[1] == 24));
+}
+
+void test_view_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_view view;
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, 768, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_get_view(NULL, &view) != 0);
+    assert(pvl_get_view(ctx.pvl, NULL) != 0);
+    // 96 bytes per span are marked with divisions
+    assert(pvl_get_view(ctx.pvl, &view) != 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(pvl_mark(ctx.pvl, ctx.main+90, 10) == 0);
+    assert(!pvl_commit(ctx.pvl));
+    size_t span[2];
+    memcpy(span, ctx.iobuf+pvl_header_size, sizeof(span));
+    assert((span[0] == 0) && (span[1] == 192));
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_get_view(ctx.pvl, &view) == 0);
+    assert(pvl_set_extents(ctx.pvl, extents, 4) == 0);
+    assert(pvl_get_view(ctx.pvl, &view) != 0);
+}
+
+void test_view_mark() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_view view;
+    alignas(max_align_t) char table_at[pvl_region_sizeof(4)];
+    char table[256];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 64);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, table_at, table, sizeof(table), 4) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(pvl_get_view(ctx.pvl, &view) == 0);
+    assert(view.span_shift == 4);
+
+    assert(pvl_mark_view(&view, NULL, 1) != 0);
+    assert(pvl_mark_view(&view, ctx.main, 0) != 0);
+    assert(pvl_mark_view(&view, ctx.main+CTX_BUFFER_SIZE-1, 2) != 0);
+    assert(pvl_mark_view(&view, ctx.main+1, 1) == 0);
+    assert(pvl_mark_view(&view, ctx.main+30, 20) == 0);
+    // Over more than CHAR_BIT spans and outside of the view
+    assert(pvl_mark_view(&view, ctx.main+512, 200) == 0);
+    assert(pvl_mark_view(&view, table+100, 1) == 0);
+    assert(!pvl_commit(ctx.pvl));
+
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 3);
+    size_t expected[] = {0, 64, 512, 720, 1024+64, 1024+128};
+    size_t pos = pvl_header_size;
+    for (size_t i = 0; i < 3; i++) {
+        size_t span[2];
+        memcpy(span, ctx.iobuf+pos, sizeof(span));
+        assert((span[0] == expected[2*i]) && (span[1] == expected[(2*i)+1]));
+        pos += pvl_header_size + (span[1] - span[0]);
+    }
+}
+
+void test_stats_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_stats stats;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_stats(NULL, &stats) != 0);
+    assert(pvl_set_stats(ctx.pvl, NULL) != 0);
+    assert(pvl_get_stats(ctx.pvl, &stats) != 0);
+    assert(pvl_set_stats(ctx.pvl, &stats) == 0);
+    assert(pvl_set_stats(ctx.pvl, &stats) != 0);
+    assert(pvl_get_stats(NULL, &stats) != 0);
+    assert(pvl_get_stats(ctx.pvl, NULL) != 0);
+}
+
+uint64_t histogram_count(const uint64_t *histogram) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < PVL_STATS_BUCKETS; i++) {
+        count += histogram[i];
+    }
+    return count;
+}
+
+void test_stats_counters() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_stats collected;
+    struct pvl_stats stats;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_leak_cb(ctx.pvl, &ctx, noop_leak_cb) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(pvl_set_stats(ctx.pvl, &collected) == 0);
+
+    // Only successful marks are counted and only a sample of them is timed
+    for (size_t i = 0; i <= PVL_STATS_MARK_SAMPLE; i++) {
+        assert(!pvl_mark(ctx.pvl, ctx.main+i, 1));
+    }
+    assert(pvl_mark(ctx.pvl, ctx.main, 0));
+    memset(ctx.main, 1, 128);
+    ctx.main[512] = 1;
+    ctx.main[514] = 1;
+    assert(!pvl_commit(ctx.pvl));
+
+    assert(pvl_get_stats(ctx.pvl, &stats) == 0);
+    assert(stats.marks == PVL_STATS_MARK_SAMPLE+1);
+    assert(stats.marked_bytes == PVL_STATS_MARK_SAMPLE+1);
+    assert(histogram_count(stats.mark_latency) == 2);
+    assert(stats.commits == 1);
+    assert(histogram_count(stats.commit_latency) == 1);
+    assert(stats.changes_written == 1);
+    assert(stats.spans_written == 1);
+    assert(stats.bytes_written == ctx.iobuf_len);
+    assert(stats.header_bytes == 2*pvl_header_size);
+    assert(stats.leak_reports == 2);
+    assert(stats.leaked_bytes == 2);
+    assert(stats.changes_loaded == 0);
+    assert(histogram_count(stats.load_latency) == 0);
+
+    // A commit without marks writes nothing
+    assert(!pvl_commit(ctx.pvl));
+    assert(pvl_get_stats(ctx.pvl, &stats) == 0);
+    assert((stats.commits == 2) && (stats.changes_written == 1));
+
+    // Loads are timed when stats are set before the read handler
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_stats(ctx.pvl, &collected) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert(pvl_get_stats(ctx.pvl, &stats) == 0);
+    assert(stats.changes_loaded == 1);
+    assert(stats.bytes_loaded == ctx.iobuf_len);
+    assert(histogram_count(stats.load_latency) == 1);
+    assert(stats.commits == 0);
+}
+
+/* Accepts writes while they fit in the first iobuf_len bytes of the sink */
+int limited_write_cb(void *ctx, void *from, size_t length, size_t remaining) {
+    (void)(remaining);
+    test_ctx *t = (test_ctx*) ctx;
+    if ((t->iobuf_pos + length) > t->iobuf_len) {
+        return 1;
+    }
+    memcpy(t->iobuf+t->iobuf_pos, from, length);
+    t->iobuf_pos += length;
+    return 0;
+}
+
+typedef struct epoch_log {
+    uint64_t epoch;
+    size_t calls;
+    int result;
+} epoch_log;
+
+int epoch_cb(void *ctx, uint64_t epoch) {
+    epoch_log *log = (epoch_log*) ctx;
+    log->epoch = epoch;
+    log->calls++;
+    return log->result;
+}
+
+void test_analysis_set_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_analysis analysis;
+    struct pvl_advice advice;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, 1000, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_analysis(NULL, &analysis) != 0);
+    assert(pvl_set_analysis(ctx.pvl, NULL) != 0);
+    // Requires a mirror
+    assert(pvl_set_analysis(ctx.pvl, &analysis) != 0);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    // The length is not divisible in slices
+    assert(pvl_set_analysis(ctx.pvl, &analysis) != 0);
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_advise(ctx.pvl, 0, &advice) != 0);
+    assert(pvl_set_analysis(ctx.pvl, &analysis) == 0);
+    assert(pvl_set_analysis(ctx.pvl, &analysis) != 0);
+    assert(pvl_advise(NULL, 0, &advice) != 0);
+    assert(pvl_advise(ctx.pvl, 0, NULL) != 0);
+}
+
+void test_analysis_advise() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_analysis analysis;
+    struct pvl_advice advice;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, noop_write_cb) == 0);
+    assert(pvl_set_analysis(ctx.pvl, &analysis) == 0);
+
+    // Two spans of 128 bytes are committed for three changed bytes
+    ctx.main[0] = 1;
+    ctx.main[1] = 1;
+    ctx.main[600] = 1;
+    assert(!pvl_mark(ctx.pvl, ctx.main, 2));
+    assert(!pvl_mark(ctx.pvl, ctx.main+600, 1));
+    assert(!pvl_commit(ctx.pvl));
+    assert((analysis.commits == 1) && (analysis.changes == 1));
+    assert(analysis.committed_bytes == 256);
+    assert(analysis.changed_bytes == 3);
+    assert((analysis.mark_sizes[0] == 1) && (analysis.mark_sizes[1] == 1));
+    assert((analysis.mark_slices[0] == 1) && (analysis.mark_slices[9] == 1));
+    assert((analysis.chunks[0][0] == 2) && (analysis.runs[0][0] == 1));
+    assert((analysis.chunks[9][0] == 1) && (analysis.runs[9][0] == 1));
+    assert((analysis.chunks[0][9] == 1) && (analysis.chunks[9][9] == 1) && (analysis.runs[9][9] == 0));
+    assert((analysis.chunks[0][10] == 1) && (analysis.chunks[9][10] == 0));
+
+    // Without scan costs the smallest spans write the least
+    assert(pvl_advise(ctx.pvl, 0, &advice) == 0);
+    assert(advice.span_count == CTX_BUFFER_SIZE);
+    assert(advice.journal_bytes == 3+(2*pvl_header_size)+pvl_header_size);
+    assert(advice.scan_cost == CTX_BUFFER_SIZE);
+
+    assert(pvl_advise(ctx.pvl, 1, &advice) == 0);
+    assert(advice.span_count == 32);
+    assert(advice.journal_bytes == 64+(2*pvl_header_size)+pvl_header_size);
+    assert(advice.scan_cost == 32);
+    // Idle slices are best with a single span
+    assert((advice.slice_span_length[0] == 8) && (advice.slice_span_length[9] == 8));
+    assert(advice.slice_span_length[1] == 64);
+    assert(advice.split_journal_bytes == 8+8+(2*pvl_header_size)+pvl_header_size);
+
+    // Empty commits only count towards scanning
+    assert(!pvl_commit(ctx.pvl));
+    assert((analysis.commits == 2) && (analysis.changes == 1));
+}
+
+void test_analysis_uneven_length() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_analysis analysis;
+    struct pvl_advice advice;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, 768, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, noop_write_cb) == 0);
+    assert(pvl_set_analysis(ctx.pvl, &analysis) == 0);
+
+    // Only span lengths that divide the block and its slices are considered
+    ctx.main[0] = 1;
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(!pvl_commit(ctx.pvl));
+    assert(pvl_advise(ctx.pvl, 0, &advice) == 0);
+    assert(advice.span_count == 768);
+    assert(advice.slice_span_length[0] == 1);
+    assert(advice.slice_span_length[1] == 16);
+}
+
+void test_heatmap_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char region_at[pvl_region_sizeof(8)];
+    uint64_t heatmap[16];
+    assert(pvl_heatmap_sizeof(NULL) == 0);
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, 512, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_heatmap_sizeof(ctx.pvl) == 8*sizeof(uint64_t));
+    assert(pvl_set_heatmap(NULL, heatmap) != 0);
+    assert(pvl_set_heatmap(ctx.pvl, NULL) != 0);
+    assert(pvl_get_heatmap(ctx.pvl, heatmap, 0) != 0);
+    assert(pvl_set_heatmap(ctx.pvl, heatmap) == 0);
+    assert(pvl_set_heatmap(ctx.pvl, heatmap) != 0);
+    assert(pvl_get_heatmap(NULL, heatmap, 0) != 0);
+    assert(pvl_get_heatmap(ctx.pvl, NULL, 0) != 0);
+    assert(pvl_heatmap_csv(NULL, heatmap, stdout) != 0);
+    assert(pvl_heatmap_csv(ctx.pvl, NULL, stdout) != 0);
+    assert(pvl_heatmap_csv(ctx.pvl, heatmap, NULL) != 0);
+    // Regions cannot be added to a counted pvl
+    assert(pvl_add_region(ctx.pvl, region_at, ctx.main+512, 512, 8) != 0);
+}
+
+void test_heatmap_counts() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char table_at[pvl_region_sizeof(16)];
+    char header[64];
+    char table[256];
+    uint64_t heatmap[17];
+    uint64_t snapshot[17];
+    char csv[128] = {0};
+
+    ctx.pvl = pvl_init(ctx.pvl_at, header, sizeof(header), 1);
+    assert(ctx.pvl != NULL);
+    assert(pvl_add_region(ctx.pvl, table_at, table, sizeof(table), 16) == 0);
+    assert(pvl_heatmap_sizeof(ctx.pvl) == sizeof(heatmap));
+    assert(pvl_set_heatmap(ctx.pvl, heatmap) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, noop_write_cb) == 0);
+
+    assert(!pvl_mark(ctx.pvl, header, 1));
+    assert(!pvl_mark(ctx.pvl, table+20, 1));
+    assert(!pvl_commit(ctx.pvl));
+    assert(!pvl_mark(ctx.pvl, table+20, 1));
+    assert(!pvl_mark(ctx.pvl, table+40, 1));
+    assert(!pvl_commit(ctx.pvl));
+
+    assert(pvl_get_heatmap(ctx.pvl, snapshot, 0) == 0);
+    assert((snapshot[0] == 1) && (snapshot[1] == 0) && (snapshot[2] == 2) && (snapshot[3] == 1));
+
+    // Export keyed by offset in the combined block
+    FILE *file = tmpfile();
+    assert(file != NULL);
+    assert(pvl_heatmap_csv(ctx.pvl, snapshot, file) == 0);
+    rewind(file);
+    assert(fread(csv, 1, sizeof(csv)-1, file) > 0);
+    fclose(file);
+    assert(strcmp(csv, "offset,length,commits\n0,64,1\n80,16,2\n96,16,1\n") == 0);
+
+    // Failed writes are reported
+    file = fopen("/dev/null", "r");
+    assert(file != NULL);
+    assert(pvl_heatmap_csv(ctx.pvl, snapshot, file) != 0);
+    fclose(file);
+
+    // Reset after a snapshot
+    assert(pvl_get_heatmap(ctx.pvl, snapshot, 1) == 0);
+    assert(snapshot[2] == 2);
+    assert(pvl_get_heatmap(ctx.pvl, snapshot, 0) == 0);
+    assert(snapshot[2] == 0);
+}
+
+void test_heatmap_extents() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char extents[pvl_extents_sizeof(4)];
+    uint64_t heatmap[8];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_extents(ctx.pvl, extents, 4) == 0);
+    assert(pvl_set_heatmap(ctx.pvl, heatmap) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, noop_write_cb) == 0);
+
+    // An extent counts towards every span it overlaps
+    assert(!pvl_mark(ctx.pvl, ctx.main+120, 16));
+    assert(!pvl_commit(ctx.pvl));
+    assert((heatmap[0] == 1) && (heatmap[1] == 1) && (heatmap[2] == 0));
+}
+
+typedef struct trace_log {
+    enum pvl_phase phases[16];
+    _Bool ends[16];
+    uint64_t timestamps[16];
+    size_t count;
+} trace_log;
+
+void trace_cb(void *ctx, enum pvl_phase phase, _Bool end, uint64_t timestamp) {
+    trace_log *log = (trace_log*) ctx;
+    assert(log->count < 16);
+    log->phases[log->count] = phase;
+    log->ends[log->count] = end;
+    log->timestamps[log->count] = timestamp;
+    log->count++;
+}
+
+void assert_trace(trace_log *log, const enum pvl_phase *phases, size_t count) {
+    assert(log->count == 2*count);
+    for (size_t i = 0; i < log->count; i++) {
+        assert(log->phases[i] == phases[i/2]);
+        assert(log->ends[i] == (i % 2));
+        assert((i == 0) || (log->timestamps[i] >= log->timestamps[i-1]));
+    }
+    log->count = 0;
+}
+
+void test_trace_set_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    trace_log log = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_trace_cb(NULL, &log, trace_cb) != 0);
+    assert(pvl_set_trace_cb(ctx.pvl, &log, trace_cb) == 0);
+    assert(pvl_set_trace_cb(ctx.pvl, &log, trace_cb) != 0);
+}
+
+void test_trace_phases() {
+    start_test;
+    test_ctx ctx = {0};
+    trace_log log = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_leak_cb(ctx.pvl, &ctx, noop_leak_cb) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, limited_write_cb) == 0);
+    assert(pvl_set_trace_cb(ctx.pvl, &log, trace_cb) == 0);
+
+    // No change to write
+    assert(!pvl_commit(ctx.pvl));
+    const enum pvl_phase empty[] = {PVL_PHASE_LEAKS, PVL_PHASE_STAT};
+    assert_trace(&log, empty, 2);
+
+    // A failed write ends its phase
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(pvl_commit(ctx.pvl));
+    const enum pvl_phase failed[] = {PVL_PHASE_LEAKS, PVL_PHASE_STAT, PVL_PHASE_WRITE};
+    assert_trace(&log, failed, 3);
+
+    ctx.iobuf_len = sizeof(ctx.iobuf);
+    assert(!pvl_commit(ctx.pvl));
+    const enum pvl_phase full[] = {PVL_PHASE_LEAKS, PVL_PHASE_STAT, PVL_PHASE_WRITE, PVL_PHASE_APPLY};
+    assert_trace(&log, full, 4);
+    assert(!pvl_mark(ctx.pvl, ctx.main+512, 1));
+    assert(!pvl_commit(ctx.pvl));
+    assert_trace(&log, full, 4);
+
+    // Each loaded change is traced
+    ctx.iobuf_len = ctx.iobuf_pos;
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_trace_cb(ctx.pvl, &log, trace_cb) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    const enum pvl_phase load[] = {PVL_PHASE_LOAD, PVL_PHASE_LOAD};
+    assert_trace(&log, load, 2);
+}
+
+void test_shards_invalid() {
+    start_test;
+    alignas(max_align_t) char shards_at[pvl_shards_sizeof(4, 8)];
+    char main[1024];
+    epoch_log log = {0};
+
+    assert(pvl_shards_init(shards_at+1, main, sizeof(main), 4, 8) == NULL);
+    assert(pvl_shards_init(shards_at, main, sizeof(main), 0, 8) == NULL);
+    assert(pvl_shards_init(shards_at, main, sizeof(main)-2, 4, 8) == NULL);
+    assert(pvl_shards_init(shards_at, main, sizeof(main), 4, 3) == NULL);
+    struct pvl_shards *shards = pvl_shards_init(shards_at, main, sizeof(main), 4, 8);
+    assert(shards != NULL);
+
+    assert(pvl_shards_pvl(NULL, 0) == NULL);
+    assert(pvl_shards_pvl(shards, 4) == NULL);
+    assert(pvl_shards_pvl(shards, 3) != NULL);
+
+    assert(pvl_shards_set_read_cb(NULL, 0, NULL, noop_read_cb, 0) != 0);
+    assert(pvl_shards_set_read_cb(shards, 4, NULL, noop_read_cb, 0) != 0);
+    assert(pvl_shards_set_read_cb(shards, 0, NULL, noop_read_cb, 0) == 0);
+    assert(pvl_shards_set_read_cb(shards, 0, NULL, noop_read_cb, 0) != 0);
+
+    assert(pvl_shards_set_write_cb(NULL, 0, NULL, noop_write_cb) != 0);
+    assert(pvl_shards_set_write_cb(shards, 4, NULL, noop_write_cb) != 0);
+    assert(pvl_shards_set_write_cb(shards, 0, NULL, noop_write_cb) == 0);
+    assert(pvl_shards_set_write_cb(shards, 0, NULL, noop_write_cb) != 0);
+
+    assert(pvl_shards_set_epoch_cb(NULL, &log, epoch_cb) != 0);
+    assert(pvl_shards_set_epoch_cb(shards, &log, epoch_cb) == 0);
+    assert(pvl_shards_set_epoch_cb(shards, &log, epoch_cb) != 0);
+
+    assert(pvl_shards_start(NULL, 1) != 0);
+    assert(pvl_shards_start(shards, 0) != 0);
+    assert(pvl_shards_start(shards, 5) != 0);
+    assert(pvl_shards_start(shards, 1) == 0);
+    assert(pvl_shards_start(shards, 1) != 0);
+
+    assert(pvl_shards_mark(NULL, main, 1) != 0);
+    assert(pvl_shards_mark(shards, NULL, 1) != 0);
+    assert(pvl_shards_mark(shards, main, 0) != 0);
+    assert(pvl_shards_mark(shards, main-1, 2) != 0);
+    assert(pvl_shards_mark(shards, main+sizeof(main)-1, 2) != 0);
+
+    assert(pvl_shards_commit(NULL) != 0);
+    assert(pvl_shards_epoch(NULL) == 0);
+    assert(pvl_shards_epoch(shards) == 0);
+
+    pvl_shards_stop(NULL);
+    pvl_shards_stop(shards);
+}
+
+void test_shards_commit() {
+    start_test;
+    alignas(max_align_t) char shards_at[pvl_shards_sizeof(4, 8)];
+    char main[1024];
+    test_ctx sinks[4] = {0};
+    epoch_log log = {0};
+
+    struct pvl_shards *shards = pvl_shards_init(shards_at, main, sizeof(main), 4, 8);
+    assert(shards != NULL);
+    for (size_t i = 0; i < 4; i++) {
+        assert(pvl_shards_set_write_cb(shards, i, &sinks[i], buffer_write_cb) == 0);
+    }
+    assert(pvl_shards_set_epoch_cb(shards, &log, epoch_cb) == 0);
+    assert(pvl_shards_start(shards, 2) == 0);
+
+    // A mark across shards is split between them
+    memset(main, 1, sizeof(main));
+    assert(!pvl_shards_mark(shards, main+200, 100));
+    assert(!pvl_shards_mark(shards, main+1000, 24));
+    assert(!pvl_shards_commit(shards));
+    assert((log.calls == 1) && (log.epoch == 1));
+    assert(pvl_shards_epoch(shards) == 1);
+
+    // Every change is prefixed by its epoch, shards without changes write nothing
+    uint64_t epoch;
+    memcpy(&epoch, sinks[0].iobuf, sizeof(epoch));
+    assert(epoch == 1);
+    size_t *h_ptr = (size_t *) (sinks[0].iobuf+sizeof(epoch));
+    assert((h_ptr[0] == 1) && (h_ptr[1] == pvl_header_size+64));
+    memcpy(&epoch, sinks[1].iobuf, sizeof(epoch));
+    assert(epoch == 1);
+    assert(sinks[2].iobuf_len == 0);
+    memcpy(&epoch, sinks[3].iobuf, sizeof(epoch));
+    assert(epoch == 1);
+
+    memset(main, 2, 8);
+    assert(!pvl_shards_mark(shards, main, 8));
+    assert(!pvl_shards_commit(shards));
+    assert((log.calls == 2) && (log.epoch == 2));
+    memcpy(&epoch, sinks[0].iobuf+sizeof(epoch)+pvl_header_size+pvl_header_size+64, sizeof(epoch));
+    assert(epoch == 2);
+
+    // Epochs advance even without changes
+    assert(!pvl_shards_commit(shards));
+    assert((log.calls == 3) && (log.epoch == 3));
+    pvl_shards_stop(shards);
+
+    // Loading stops past the provided epoch
+    memset(main, 0, sizeof(main));
+    shards = pvl_shards_init(shards_at, main, sizeof(main), 4, 8);
+    assert(shards != NULL);
+    for (size_t i = 0; i < 4; i++) {
+        sinks[i].iobuf_pos = 0;
+        assert(pvl_shards_set_read_cb(shards, i, &sinks[i], buffer_read_cb, 1) == 0);
+    }
+    assert((main[0] == 0) && (main[191] == 0) && (main[192] == 1) && (main[319] == 1));
+    assert((main[320] == 0) && (main[991] == 0) && (main[992] == 1) && (main[1023] == 1));
+    // Epochs seen in the shards are not reused
+    assert(pvl_shards_epoch(shards) == 2);
+    pvl_shards_stop(shards);
+
+    memset(main, 0, sizeof(main));
+    shards = pvl_shards_init(shards_at, main, sizeof(main), 4, 8);
+    assert(shards != NULL);
+    for (size_t i = 0; i < 4; i++) {
+        sinks[i].iobuf_pos = 0;
+        assert(pvl_shards_set_read_cb(shards, i, &sinks[i], buffer_read_cb, 2) == 0);
+    }
+    assert((main[0] == 2) && (main[7] == 2) && (main[8] == 1) && (main[192] == 1));
+    assert(pvl_shards_epoch(shards) == 2);
+    pvl_shards_stop(shards);
+}
+
+void test_shards_write_failure() {
+    start_test;
+    alignas(max_align_t) char shards_at[pvl_shards_sizeof(2, 8)];
+    char main[512];
+    test_ctx sinks[2] = {0};
+    epoch_log log = {0};
+
+    struct pvl_shards *shards = pvl_shards_init(shards_at, main, sizeof(main), 2, 8);
+    assert(shards != NULL);
+    for (size_t i = 0; i < 2; i++) {
+        assert(pvl_shards_set_write_cb(shards, i, &sinks[i], limited_write_cb) == 0);
+    }
+
+    // Shards are committed in place without workers or an epoch handler
+    memset(main, 1, sizeof(main));
+    sinks[0].iobuf_len = sizeof(sinks[0].iobuf);
+    sinks[1].iobuf_len = sizeof(sinks[1].iobuf);
+    assert(!pvl_shards_mark(shards, main, sizeof(main)));
+    assert(!pvl_shards_commit(shards));
+    assert(pvl_shards_epoch(shards) == 1);
+
+    // Fail on the epoch and on the change header
+    assert(pvl_shards_set_epoch_cb(shards, &log, epoch_cb) == 0);
+    sinks[0].iobuf_pos = 0;
+    sinks[0].iobuf_len = 0;
+    sinks[1].iobuf_pos = 0;
+    sinks[1].iobuf_len = sizeof(uint64_t);
+    assert(!pvl_shards_mark(shards, main, sizeof(main)));
+    assert(pvl_shards_commit(shards));
+    assert(log.calls == 0);
+
+    // A failed change is written anew with its epoch
+    sinks[0].iobuf_pos = 0;
+    sinks[0].iobuf_len = sizeof(sinks[0].iobuf);
+    sinks[1].iobuf_pos = 0;
+    sinks[1].iobuf_len = sizeof(sinks[1].iobuf);
+    log.result = 1;
+    assert(pvl_shards_commit(shards));
+    assert((log.calls == 1) && (log.epoch == 3));
+    uint64_t epoch;
+    memcpy(&epoch, sinks[1].iobuf, sizeof(epoch));
+    assert(epoch == 3);
+    pvl_shards_stop(shards);
+}
+
+void test_auto_commit_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_auto_commit(NULL, 1, 1) != 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 0, 0) != 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 1, 0) == 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 1, 0) != 0);
+    assert(pvl_tick(NULL) != 0);
+    assert(pvl_auto_commit_failed(NULL) == 0);
+}
+
+void test_auto_commit_dirty() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.iobuf_len = sizeof(ctx.iobuf);
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, limited_write_cb) == 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 100, 0) == 0);
+
+    assert(!pvl_mark(ctx.pvl, ctx.main, 60));
+    assert(pvl_mark(ctx.pvl, ctx.main, 0));
+    assert(ctx.iobuf_pos == 0);
+    // Overlapping marks are counted again
+    assert(!pvl_mark(ctx.pvl, ctx.main, 60));
+    assert(ctx.iobuf_pos == pvl_header_size*2 + 64);
+    // Without a max age ticks do not commit
+    assert(!pvl_mark(ctx.pvl, ctx.main+512, 1));
+    assert(!pvl_tick(ctx.pvl));
+    const struct pvl_range ranges[] = {{ctx.main+600, 50}, {ctx.main+700, 50}};
+    assert(!pvl_mark_many(ctx.pvl, ranges, 2));
+    assert(ctx.iobuf_pos == pvl_header_size*4 + 64 + 256);
+    assert(pvl_mark_many(ctx.pvl, ranges, 0));
+
+    // A failed commit keeps the marks and backs off instead of failing the marks
+    size_t committed = ctx.iobuf_pos;
+    ctx.iobuf_len = ctx.iobuf_pos;
+    assert(!pvl_auto_commit_failed(ctx.pvl));
+    assert(!pvl_mark(ctx.pvl, ctx.main, 100));
+    assert(pvl_auto_commit_failed(ctx.pvl));
+    ctx.iobuf_len = sizeof(ctx.iobuf);
+    assert(!pvl_mark(ctx.pvl, ctx.main+900, 1));
+    assert(ctx.iobuf_pos == committed);
+
+    // The next tick retries it
+    assert(!pvl_tick(ctx.pvl));
+    assert(!pvl_auto_commit_failed(ctx.pvl));
+    size_t *h_ptr = (size_t *) (ctx.iobuf + committed);
+    assert(h_ptr[0] == 2);
+
+    // So does an explicit commit, which reports its own failure
+    ctx.iobuf_len = ctx.iobuf_pos;
+    assert(!pvl_mark(ctx.pvl, ctx.main, 100));
+    assert(pvl_auto_commit_failed(ctx.pvl));
+    assert(pvl_commit(ctx.pvl));
+    assert(!pvl_auto_commit_failed(ctx.pvl));
+}
+
+void test_auto_commit_age() {
+    start_test;
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 0, 1) == 0);
+    assert(!pvl_tick(ctx.pvl));
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(!pvl_mark(ctx.pvl, ctx.main+512, 1));
+    assert(ctx.iobuf_pos == 0);
+    while (ctx.iobuf_pos == 0) {
+        assert(!pvl_tick(ctx.pvl));
+    }
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 2);
+
+    // Marks younger than max_age are left for later
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 0, UINT64_MAX) == 0);
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(!pvl_tick(ctx.pvl));
+    assert(ctx.iobuf_pos == 0);
+}
+
+void test_flusher_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char at[pvl_flusher_sizeof() + 1];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_flusher_init(at+1, ctx.pvl) == NULL);
+    assert(pvl_flusher_init(at, NULL) == NULL);
+    assert(pvl_flusher_start(NULL, 1) != 0);
+    assert(pvl_flusher_stop(NULL) != 0);
+    assert(pvl_flusher_mark(NULL, ctx.main, 1) != 0);
+    assert(pvl_flusher_commit(NULL) != 0);
+
+    struct pvl_flusher *flusher = pvl_flusher_init(at, ctx.pvl);
+    assert(flusher != NULL);
+    assert(pvl_flusher_start(flusher, 0) != 0);
+    assert(pvl_flusher_stop(flusher) == 0);
+}
+
+void test_flusher_commit() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char at[pvl_flusher_sizeof()];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 0, 1) == 0);
+    struct pvl_flusher *flusher = pvl_flusher_init(at, ctx.pvl);
+    assert(flusher != NULL);
+    assert(pvl_flusher_start(flusher, 1000000) == 0);
+    assert(pvl_flusher_start(flusher, 1000000) != 0);
+
+    // The background thread commits the aged mark
+    assert(!pvl_flusher_mark(flusher, ctx.main, 1));
+    size_t pos = 0;
+    while (pos == 0) {
+        pvl_flusher_lock(flusher);
+        pos = ctx.iobuf_pos;
+        pvl_flusher_unlock(flusher);
+    }
+    assert(!pvl_flusher_mark(flusher, ctx.main+512, 1));
+    assert(!pvl_flusher_commit(flusher));
+    assert(pvl_flusher_stop(flusher) == 0);
+    assert(ctx.iobuf_pos == pvl_header_size*4 + 256);
+}
+
+void test_flusher_group() {
+    start_test;
+    test_ctx ctx = {0};
+    alignas(max_align_t) char at[pvl_flusher_sizeof()];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 0, 1) == 0);
+    struct pvl_flusher *flusher = pvl_flusher_init(at, ctx.pvl);
+    assert(flusher != NULL);
+    assert(pvl_flusher_start(flusher, 1000000) == 0);
+
+    // Aged marks are not committed while the lock is held across the group
+    struct timespec delay = {0, 10000000};
+    pvl_flusher_lock(flusher);
+    assert(!pvl_mark(ctx.pvl, ctx.main, 1));
+    assert(nanosleep(&delay, NULL) == 0);
+    assert(ctx.iobuf_pos == 0);
+    assert(!pvl_mark(ctx.pvl, ctx.main+512, 1));
+    pvl_flusher_unlock(flusher);
+
+    // The whole group is committed as a single change afterwards
+    size_t pos = 0;
+    while (pos == 0) {
+        pvl_flusher_lock(flusher);
+        pos = ctx.iobuf_pos;
+        pvl_flusher_unlock(flusher);
+    }
+    assert(pvl_flusher_stop(flusher) == 0);
+    size_t *h_ptr = (size_t *) ctx.iobuf;
+    assert(h_ptr[0] == 2);
+    assert(ctx.iobuf_pos == pvl_header_size*3 + 256);
+}
+
+void test_flusher_failure() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_stats stats = {0};
+    alignas(max_align_t) char at[pvl_flusher_sizeof()];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, limited_write_cb) == 0);
+    assert(pvl_set_auto_commit(ctx.pvl, 0, 1) == 0);
+    assert(pvl_set_stats(ctx.pvl, &stats) == 0);
+    struct pvl_flusher *flusher = pvl_flusher_init(at, ctx.pvl);
+    assert(flusher != NULL);
+    assert(pvl_flusher_start(flusher, 1000000) == 0);
+
+    assert(!pvl_flusher_mark(flusher, ctx.main, 1));
+    uint64_t commits = 0;
+    while (commits == 0) {
+        pvl_flusher_lock(flusher);
+        commits = stats.commits;
+        pvl_flusher_unlock(flusher);
+    }
+    assert(pvl_flusher_stop(flusher) != 0);
+}
+
+typedef struct restore_log {
+    test_ctx *ctx;
+    size_t calls;
+    size_t offset[8];
+    size_t length[8];
+    unsigned char pattern[8];
+    size_t pattern_size[8];
+    int result;
+} restore_log;
+
+/* Records each span and skips its content in the read buffer */
+int restore_cb(void *ctx, size_t offset, size_t length, const unsigned char *pattern,
+        size_t pattern_size, size_t remaining) {
+    (void)(remaining);
+    restore_log *log = (restore_log*) ctx;
+    log->offset[log->calls] = offset;
+    log->length[log->calls] = length;
+    log->pattern[log->calls] = pattern ? pattern[0] : 0;
+    log->pattern_size[log->calls] = pattern_size;
+    log->calls++;
+    if (pattern == NULL) {
+        log->ctx->iobuf_pos += length;
+    }
+    return log->result;
+}
+
+void test_restore_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    restore_log log = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_restore_cb(NULL, &log, restore_cb) != 0);
+    assert(pvl_set_restore_cb(ctx.pvl, &log, restore_cb) == 0);
+    assert(pvl_set_restore_cb(ctx.pvl, &log, restore_cb) != 0);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) != 0);
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_restore_cb(ctx.pvl, &log, restore_cb) != 0);
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, noop_read_cb) == 0);
+    assert(pvl_set_restore_cb(ctx.pvl, &log, restore_cb) != 0);
+}
+
+void test_restore_spans() {
+    start_test;
+    test_ctx ctx = {0};
+    restore_log log = {&ctx, 0, {0}, {0}, {0}, {0}, 0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    // A repeated byte, a repeated word and regular content
+    memset(ctx.main, 0x5a, 64);
+    const unsigned char word[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for (size_t i = 0; i < 64; i += sizeof(word)) {
+        memcpy(ctx.main+128+i, word, sizeof(word));
+    }
+    for (size_t i = 0; i < 64; i++) {
+        ctx.main[256+i] = (char) i;
+    }
+    assert(!pvl_mark(ctx.pvl, ctx.main, 64));
+    assert(!pvl_mark(ctx.pvl, ctx.main+128, 64));
+    assert(!pvl_mark(ctx.pvl, ctx.main+256, 64));
+    assert(!pvl_commit(ctx.pvl));
+    ctx.main[512] = 1;
+    assert(!pvl_mark(ctx.pvl, ctx.main+512, 1));
+    assert(!pvl_commit(ctx.pvl));
+
+    // Spans are passed on and main is left as it is
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_len = ctx.iobuf_pos;
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_restore_cb(ctx.pvl, &log, restore_cb) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert(ctx.iobuf_pos == ctx.iobuf_len);
+    assert(log.calls == 4);
+    const size_t offset[] = {0, 128, 256, 512};
+    const unsigned char pattern[] = {0x5a, 1, 0, 0};
+    const size_t pattern_size[] = {1, 8, 0, 0};
+    for (size_t i = 0; i < 4; i++) {
+        assert((log.offset[i] == offset[i]) && (log.length[i] == 64));
+        assert((log.pattern[i] == pattern[i]) && (log.pattern_size[i] == pattern_size[i]));
+    }
+    for (size_t i = 0; i < CTX_BUFFER_SIZE; i++) {
+        assert(ctx.main[i] == 0);
+    }
+
+    // A failed restore handler stops the load
+    log.calls = 0;
+    log.result = 1;
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_restore_cb(ctx.pvl, &log, restore_cb) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) != 0);
+    assert(log.calls == 1);
+}
+
+typedef struct counting_read {
+    test_ctx *ctx;
+    size_t calls;
+    size_t fail_at;
+} counting_read;
+
+/* Counts calls to buffer_read_cb and fails the fail_at-th one */
+int counting_read_cb(void *ctx, void *to, size_t length, size_t remaining) {
+    counting_read *c = (counting_read*) ctx;
+    c->calls++;
+    if (c->calls == c->fail_at) {
+        return 1;
+    }
+    return buffer_read_cb(c->ctx, to, length, remaining);
+}
+
+void test_load_buffer_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    char buffer[64];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_load_buffer(NULL, buffer, sizeof(buffer)) != 0);
+    assert(pvl_set_load_buffer(ctx.pvl, NULL, sizeof(buffer)) != 0);
+    assert(pvl_set_load_buffer(ctx.pvl, buffer, 0) != 0);
+    assert(pvl_set_load_buffer(ctx.pvl, buffer, sizeof(buffer)) == 0);
+    assert(pvl_set_load_buffer(ctx.pvl, buffer, sizeof(buffer)) != 0);
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, noop_read_cb) == 0);
+    assert(pvl_set_load_buffer(ctx.pvl, buffer, sizeof(buffer)) != 0);
+}
+
+void test_load_buffer_changes() {
+    start_test;
+    test_ctx ctx = {0};
+    char buffer[256];
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+
+    // A plain change with two spans, a compact one with a fill record and a large one
+    for (size_t i = 0; i < 64; i++) {
+        ctx.main[i] = (char) i;
+        ctx.main[512+i] = (char) (i * 3);
+    }
+    assert(!pvl_mark(ctx.pvl, ctx.main, 64));
+    assert(!pvl_mark(ctx.pvl, ctx.main+512, 64));
+    assert(!pvl_commit(ctx.pvl));
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    memset(ctx.main+128, 0x11, 64);
+    ctx.main[256] = 7;
+    assert(!pvl_mark(ctx.pvl, ctx.main+128, 64));
+    assert(!pvl_mark(ctx.pvl, ctx.main+256, 1));
+    assert(!pvl_commit(ctx.pvl));
+    for (size_t i = 0; i < 320; i++) {
+        ctx.main[640+i] = (char) (i * 7);
+    }
+    assert(!pvl_mark(ctx.pvl, ctx.main+640, 320));
+    assert(!pvl_commit(ctx.pvl));
+
+    // Whole changes are read at once, the large one span by span
+    char expected[CTX_BUFFER_SIZE];
+    memcpy(expected, ctx.main, CTX_BUFFER_SIZE);
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_len = ctx.iobuf_pos;
+    ctx.iobuf_pos = 0;
+    counting_read reads = {&ctx, 0, 0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_load_buffer(ctx.pvl, buffer, sizeof(buffer)) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &reads, counting_read_cb) == 0);
+    assert(!memcmp(ctx.main, expected, CTX_BUFFER_SIZE));
+    assert(reads.calls == (3 + 3 + 4 + 1));
+
+    // A failed bulk read stops the load before the change is applied
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.iobuf_pos = 0;
+    reads.calls = 0;
+    reads.fail_at = 6;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_load_buffer(ctx.pvl, buffer, sizeof(buffer)) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &reads, counting_read_cb) == 0);
+    assert(!memcmp(ctx.main, expected, 64) && (ctx.main[128] == 0));
+
+    // Restore handlers read span by span
+    restore_log log = {&ctx, 0, {0}, {0}, {0}, {0}, 0};
+    ctx.iobuf_pos = 0;
+    reads.calls = 0;
+    reads.fail_at = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_load_buffer(ctx.pvl, buffer, sizeof(buffer)) == 0);
+    assert(pvl_set_restore_cb(ctx.pvl, &log, restore_cb) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &reads, counting_read_cb) == 0);
+    assert((log.calls == 5) && (ctx.iobuf_pos == ctx.iobuf_len));
+}
+
+typedef struct apply_log {
+    size_t calls;
+    size_t offset[4];
+    size_t length[4];
+    size_t remaining[4];
+    char first[4];
+    size_t fail_at;
+} apply_log;
+
+/* Records each applied span and fails the fail_at-th call */
+int apply_cb(void *ctx, size_t offset, const char *from, size_t length, size_t remaining) {
+    apply_log *log = (apply_log*) ctx;
+    if (++log->calls == log->fail_at) {
+        return 1;
+    }
+    log->offset[log->calls-1] = offset;
+    log->length[log->calls-1] = length;
+    log->remaining[log->calls-1] = remaining;
+    log->first[log->calls-1] = from[0];
+    return 0;
+}
+
+void test_apply_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    apply_log log = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_apply_cb(NULL, &log, apply_cb) != 0);
+    assert(pvl_set_apply_cb(ctx.pvl, &log, NULL) != 0);
+    assert(pvl_set_apply_cb(ctx.pvl, &log, apply_cb) == 0);
+    assert(pvl_set_apply_cb(ctx.pvl, &log, apply_cb) != 0);
+
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, noop_read_cb) == 0);
+    assert(pvl_set_apply_cb(ctx.pvl, &log, apply_cb) != 0);
+}
+
+void test_apply_spans() {
+    start_test;
+    test_ctx ctx = {0};
+    apply_log log = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_compact(ctx.pvl) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, &ctx, buffer_write_cb) == 0);
+    assert(pvl_set_apply_cb(ctx.pvl, &log, apply_cb) == 0);
+
+    // A repeated byte and regular content
+    memset(ctx.main, 0x5a, 64);
+    for (size_t i = 0; i < 64; i++) {
+        ctx.main[256+i] = (char) (i+1);
+    }
+    assert(!pvl_mark(ctx.pvl, ctx.main, 64));
+    assert(!pvl_mark(ctx.pvl, ctx.main+256, 64));
+
+    // A failed apply keeps the marks and the commit is retried
+    log.fail_at = 1;
+    assert(pvl_commit(ctx.pvl) != 0);
+    assert(log.calls == 1);
+    log.calls = 0;
+    log.fail_at = 0;
+    assert(!pvl_commit(ctx.pvl));
+    assert(log.calls == 2);
+    assert((log.offset[0] == 0) && (log.length[0] == 64) && (log.remaining[0] == 1));
+    assert((log.offset[1] == 256) && (log.length[1] == 64) && (log.remaining[1] == 0));
+    assert((log.first[0] == 0x5a) && (log.first[1] == 1));
+
+    // Loaded spans are applied once they are in main, for both written changes
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    memset(&log, 0, sizeof(log));
+    ctx.iobuf_len = ctx.iobuf_pos;
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_apply_cb(ctx.pvl, &log, apply_cb) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert(log.calls == 4);
+    assert((log.offset[2] == 0) && (log.remaining[2] == 1) && (log.first[2] == 0x5a));
+    assert((log.offset[3] == 256) && (log.remaining[3] == 0) && (log.first[3] == 1));
+
+    // A failed apply fails the load
+    memset(&log, 0, sizeof(log));
+    log.fail_at = 2;
+    ctx.iobuf_pos = 0;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_apply_cb(ctx.pvl, &log, apply_cb) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) != 0);
+    assert(log.calls == 2);
+}
+
+void test_poll_invalid() {
+    start_test;
+    test_ctx ctx = {0};
+    assert(pvl_poll(NULL) != 0);
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 8);
+    assert(ctx.pvl != NULL);
+    assert(pvl_poll(ctx.pvl) != 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, noop_read_cb) == 0);
+    assert(pvl_poll(ctx.pvl) == 0);
+}
+
+void test_poll_changes() {
+    start_test;
+    test_ctx ctx = {0};
+    apply_log log = {0};
+    alignas(max_align_t) char primary_at[pvl_sizeof(16)];
+    char primary[CTX_BUFFER_SIZE] = {0};
+    struct pvl *pvl = pvl_init(primary_at, primary, CTX_BUFFER_SIZE, 16);
+    assert(pvl != NULL);
+    assert(pvl_set_compact(pvl) == 0);
+    assert(pvl_set_write_cb(pvl, &ctx, buffer_write_cb) == 0);
+
+    // A repeated byte in the first change and regular content in the second
+    memset(primary, 0x5a, 64);
+    assert(!pvl_mark(pvl, primary, 64));
+    assert(!pvl_commit(pvl));
+    size_t first = ctx.iobuf_len;
+    for (size_t i = 0; i < 64; i++) {
+        primary[256+i] = (char) (i+1);
+    }
+    assert(!pvl_mark(pvl, primary+256, 64));
+    assert(!pvl_commit(pvl));
+    size_t second = ctx.iobuf_len;
+
+    // The load stops at a partially written header
+    ctx.iobuf_pos = 0;
+    ctx.iobuf_len = first + 8;
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_mirror(ctx.pvl, ctx.mirror) == 0);
+    assert(pvl_set_apply_cb(ctx.pvl, &log, apply_cb) == 0);
+    assert(pvl_set_read_cb(ctx.pvl, &ctx, buffer_read_cb) == 0);
+    assert((log.calls == 1) && (ctx.iobuf_pos == first));
+    assert((ctx.main[63] == 0x5a) && (ctx.mirror[63] == 0x5a));
+    assert(pvl_poll(ctx.pvl) == 0);
+    assert((log.calls == 1) && (ctx.iobuf_pos == first));
+
+    // The header is kept while the content is incomplete
+    ctx.iobuf_len = second - 1;
+    assert(pvl_poll(ctx.pvl) == 0);
+    assert(pvl_poll(ctx.pvl) == 0);
+    assert((log.calls == 1) && (ctx.main[256] == 0) && (ctx.mirror[256] == 0));
+
+    // The change is applied once complete, to the mirror as well
+    ctx.iobuf_len = second;
+    assert(pvl_poll(ctx.pvl) == 0);
+    assert((log.calls == 2) && (ctx.iobuf_pos == second));
+    assert(!memcmp(ctx.main, primary, CTX_BUFFER_SIZE));
+    assert(!memcmp(ctx.mirror, primary, CTX_BUFFER_SIZE));
+
+    // Repeated bytes are polled as well, the sink shares its position with the reads
+    memset(primary+512, 0x33, 64);
+    assert(!pvl_mark(pvl, primary+512, 64));
+    assert(!pvl_commit(pvl));
+    ctx.iobuf_pos = second;
+    assert(pvl_poll(ctx.pvl) == 0);
+    assert((log.calls == 3) && (ctx.iobuf_pos == ctx.iobuf_len));
+    assert(!memcmp(ctx.main, primary, CTX_BUFFER_SIZE));
+    assert(!memcmp(ctx.mirror, primary, CTX_BUFFER_SIZE));
+
+    // Polls are timed like the initial load
+    struct pvl_stats stats;
+    assert(pvl_set_stats(ctx.pvl, &stats) == 0);
+    assert(pvl_poll(ctx.pvl) == 0);
+    assert(histogram_count(stats.load_latency) == 1);
+
+    // An invalid header stops the polls, each of which reports it
+    memset(ctx.iobuf+ctx.iobuf_len, 0, 2*sizeof(size_t));
+    ctx.iobuf_len += 2*sizeof(size_t);
+    assert(pvl_poll(ctx.pvl) != 0);
+    assert(pvl_poll(ctx.pvl) != 0);
+    assert((log.calls == 3) && (histogram_count(stats.load_latency) == 3));
+}
+
+void test_journal_invalid() {
+    start_test;
+    struct pvl_journal_config config = {0};
+    char byte = 0;
+    assert(pvl_journal_write(NULL, &byte, 1, 0) != 0);
+    assert(pvl_journal_write(&config, NULL, 1, 0) != 0);
+    assert(pvl_journal_write(&config, &byte, 0, 0) != 0);
+    assert(pvl_journal_write(&config, &byte, 1, 0) != 0);
+    assert(pvl_journal_read(NULL, &byte, 1, 0) != 0);
+    assert(pvl_journal_read(&config, &byte, 1, 0) != 0);
+
+    // Failed writes and reads are reported, a failed read is not the end of the journal
+    config.destination = fopen("/dev/null", "r");
+    assert(config.destination != NULL);
+    assert(pvl_journal_write(&config, &byte, 1, 0) != 0);
+    fclose(config.destination);
+    config.destination = fopen("/dev/null", "w");
+    assert(config.destination != NULL);
+    assert(pvl_journal_read(&config, &byte, 1, 0) == 1);
+    fclose(config.destination);
+}
+
+/* Append to the journal file without moving the position of its reader */
+void journal_append(FILE *file, const char *from, size_t length) {
+    long position = ftell(file);
+    assert(fseek(file, 0, SEEK_END) == 0);
+    assert(fwrite(from, 1, length, file) == length);
+    assert(fseek(file, position, SEEK_SET) == 0);
+}
+
+void test_journal_changes() {
+    start_test;
+    test_ctx ctx = {0};
+    struct pvl_journal_config config = {tmpfile()};
+    assert(config.destination != NULL);
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, &config, pvl_journal_write) == 0);
+    memset(ctx.main, 1, 64);
+    assert(!pvl_mark(ctx.pvl, ctx.main, 64));
+    assert(!pvl_commit(ctx.pvl));
+    size_t first = (2*pvl_header_size) + 64;
+
+    // A second change is appended in pieces from a memory sink
+    alignas(max_align_t) char primary_at[pvl_sizeof(16)];
+    char primary[CTX_BUFFER_SIZE] = {0};
+    struct pvl *pvl = pvl_init(primary_at, primary, CTX_BUFFER_SIZE, 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, &ctx, buffer_write_cb) == 0);
+    memset(primary+128, 2, 64);
+    assert(!pvl_mark(pvl, primary+128, 64));
+    assert(!pvl_commit(pvl));
+    journal_append(config.destination, ctx.iobuf, 5);
+
+    // The load stops at the partial header and leaves it unread
+    rewind(config.destination);
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_read_cb(ctx.pvl, &config, pvl_journal_read) == 0);
+    assert((ctx.main[63] == 1) && (ctx.main[128] == 0));
+    assert(ftell(config.destination) == (long) first);
+
+    // Polls follow the appended pieces until the change is complete
+    journal_append(config.destination, ctx.iobuf+5, pvl_header_size+3);
+    assert(pvl_poll(ctx.pvl) == 0);
+    assert(ftell(config.destination) == (long) (first + pvl_header_size));
+    assert(ctx.main[128] == 0);
+    journal_append(config.destination, ctx.iobuf+pvl_header_size+8, ctx.iobuf_len-pvl_header_size-8);
+    assert(pvl_poll(ctx.pvl) == 0);
+    assert(!memcmp(ctx.main+128, primary+128, 64));
+    assert(ftell(config.destination) == (long) (first + ctx.iobuf_len));
+    fclose(config.destination);
+}
+
+void test_journal_pipe() {
+    start_test;
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], "abc", 3) == 3);
+    close(fds[1]);
+    struct pvl_journal_config config = {fdopen(fds[0], "r")};
+    assert(config.destination != NULL);
+
+    // Pipes can neither be checked for the rest of a change nor rewound
+    size_t header[2];
+    assert(pvl_journal_read(&config, NULL, 0, 1) == 1);
+    assert(pvl_journal_read(&config, header, sizeof(header), 0) == 1);
+    assert(pvl_journal_read(&config, header, sizeof(header), 0) == EOF);
+    fclose(config.destination);
+}
+
+/* Whether userfaultfd can be used for registering main with a lazy restore */
+int lazy_available() {
+    int uffd = (int) syscall(SYS_userfaultfd, O_CLOEXEC);
+    return (uffd >= 0) && (close(uffd) == 0);
+}
+
+/* A fresh page aligned anonymous mapping */
+char *lazy_map(size_t length) {
+    char *main = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(main != MAP_FAILED);
+    return main;
+}
+
+void test_lazy_invalid() {
+    start_test;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *at = malloc(pvl_lazy_sizeof(4) + 1);
+    assert(at != NULL);
+    char *main = lazy_map(page);
+    FILE *journal = tmpfile();
+    assert(journal != NULL);
+    assert(pvl_lazy_sizeof(4) > pvl_lazy_sizeof(0));
+    assert(pvl_lazy_init(at+1, 4, journal, main, page) == NULL);
+    assert(pvl_lazy_init(at, 4, NULL, main, page) == NULL);
+    assert(pvl_lazy_init(at, 4, journal, NULL, page) == NULL);
+    assert(pvl_lazy_init(at, 4, journal, main, 0) == NULL);
+    assert(pvl_lazy_init(at, 4, journal, main+1, page) == NULL);
+    assert(pvl_lazy_init(at, 4, journal, main, page+1) == NULL);
+    assert(pvl_lazy_start(NULL) != 0);
+    assert(pvl_lazy_stop(NULL) != 0);
+
+    // Spans outside of main, long patterns and missing instances are rejected
+    const unsigned char pattern[9] = {0};
+    struct pvl_lazy *lazy = pvl_lazy_init(at, 4, journal, main, page);
+    assert(lazy != NULL);
+    assert(pvl_lazy_index(NULL, 0, 1, pattern, 1, 0) != 0);
+    assert(pvl_lazy_index(lazy, page, 1, pattern, 1, 0) != 0);
+    assert(pvl_lazy_index(lazy, 1, page, pattern, 1, 0) != 0);
+    assert(pvl_lazy_index(lazy, 0, 1, pattern, sizeof(pattern), 0) != 0);
+    assert(pvl_lazy_stop(lazy) == 0);
+
+    // Content cannot be indexed in a journal that cannot be told or sought
+    int fds[2];
+    assert(pipe(fds) == 0);
+    FILE *pipe_journal = fdopen(fds[0], "r");
+    assert(pipe_journal != NULL);
+    lazy = pvl_lazy_init(at, 4, pipe_journal, main, page);
+    assert(lazy != NULL);
+    assert(pvl_lazy_index(lazy, 0, 1, NULL, 0, 0) != 0);
+    fclose(pipe_journal);
+    close(fds[1]);
+
+    // Main must be mapped for registering it, a failed start is still stopped
+    if (lazy_available()) {
+        assert(munmap(main, page) == 0);
+        lazy = pvl_lazy_init(at, 4, journal, main, page);
+        assert(lazy != NULL);
+        assert(pvl_lazy_start(lazy) != 0);
+        assert(pvl_lazy_start(lazy) != 0);
+        assert(pvl_lazy_stop(lazy) == 0);
+    }
+    fclose(journal);
+    free(at);
+}
+
+void test_lazy_index() {
+    start_test;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *at = malloc(pvl_lazy_sizeof(4));
+    assert(at != NULL);
+    char *main = lazy_map(4*page);
+    FILE *journal = tmpfile();
+    assert(journal != NULL);
+    for (size_t i = 0; i < 3*page; i++) {
+        assert(fputc((int) ((i*7) & 0xff), journal) != EOF);
+    }
+
+    // Content over two pages, split by a pattern that is then partially overwritten
+    struct pvl_lazy *lazy = pvl_lazy_init(at, 4, journal, main, 4*page);
+    assert(lazy != NULL);
+    rewind(journal);
+    assert(pvl_lazy_index(lazy, 0, 2*page, NULL, 0, 0) == 0);
+    const unsigned char pattern[] = {1, 2, 3};
+    assert(pvl_lazy_index(lazy, page/2, 16, pattern, sizeof(pattern), 0) == 0);
+    assert(fseek(journal, (long) (2*page), SEEK_SET) == 0);
+    assert(pvl_lazy_index(lazy, page/4, 3*page/4, NULL, 0, 0) == 0);
+    assert(pvl_lazy_index(lazy, (3*page)+5, page-5, pattern, sizeof(pattern), 0) == 0);
+
+    // A piece that would split another one does not fit in a full index
+    assert(pvl_lazy_index(lazy, page+1, 1, pattern, 1, 0) != 0);
+
+    if (lazy_available()) {
+        assert(pvl_lazy_start(lazy) == 0);
+        assert(pvl_lazy_stop(lazy) == 0);
+        for (size_t i = 0; i < 4*page; i++) {
+            size_t position = i;
+            if ((i >= page/4) && (i < page)) {
+                position = (2*page) + i - (page/4);
+            }
+            unsigned char expected = (unsigned char) ((position*7) & 0xff);
+            if (i >= 2*page) {
+                expected = (i < (3*page)+5) ? 0 : pattern[(i - (3*page) - 5) % sizeof(pattern)];
+            }
+            assert((unsigned char) main[i] == expected);
+        }
+    }
+    assert(munmap(main, 4*page) == 0);
+    fclose(journal);
+    free(at);
+}
+
+void test_lazy_read_failure() {
+    start_test;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *at = malloc(pvl_lazy_sizeof(1));
+    assert(at != NULL);
+    char *main = lazy_map(page);
+    FILE *journal = tmpfile();
+    assert(journal != NULL);
+
+    // Content indexed past the end of the journal cannot be read
+    struct pvl_lazy *lazy = pvl_lazy_init(at, 1, journal, main, page);
+    assert(lazy != NULL);
+    assert(pvl_lazy_index(lazy, 0, page, NULL, 0, 0) == 0);
+    assert(pvl_lazy_start(lazy) == 0);
+    assert(pvl_lazy_stop(lazy) != 0);
+    assert(munmap(main, page) == 0);
+
+    // Neither can it be read from a journal that was not opened for reading
+    main = lazy_map(page);
+    lazy = pvl_lazy_init(at, 1, journal, main, page);
+    assert(lazy != NULL);
+    rewind(journal);
+    assert(pvl_lazy_index(lazy, 0, page, NULL, 0, 0) == 0);
+    int fd = open("/dev/null", O_WRONLY);
+    assert((fd >= 0) && (dup2(fd, fileno(journal)) >= 0));
+    close(fd);
+    assert(pvl_lazy_start(lazy) == 0);
+    assert(pvl_lazy_stop(lazy) != 0);
+    assert(munmap(main, page) == 0);
+    fclose(journal);
+    free(at);
+}
+
+void test_lazy_load() {
+    start_test;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t length = 256*page;
+    char *primary = lazy_map(length);
+    alignas(max_align_t) char primary_at[pvl_sizeof(256)];
+    struct pvl_journal_config config = {tmpfile()};
+    assert(config.destination != NULL);
+    struct pvl *pvl = pvl_init(primary_at, primary, length, 256);
+    assert(pvl != NULL);
+    assert(pvl_set_compact(pvl) == 0);
+    assert(pvl_set_write_cb(pvl, &config, pvl_journal_write) == 0);
+
+    // A filled block, then content over its pages and a pattern over the content
+    memset(primary, 0x11, length);
+    assert(!pvl_mark(pvl, primary, length));
+    assert(!pvl_commit(pvl));
+    for (size_t i = 0; i < 3*page; i++) {
+        primary[(10*page)+i] = (char) (i*13);
+    }
+    memset(primary+length-page, 0x22, page/2);
+    assert(!pvl_mark(pvl, primary+(10*page), 3*page));
+    assert(!pvl_mark(pvl, primary+length-page, page));
+    assert(!pvl_commit(pvl));
+    memset(primary+(11*page), 0x33, page);
+    assert(!pvl_mark(pvl, primary+(11*page), page));
+    assert(!pvl_commit(pvl));
+
+    // The load only indexes the spans, pages are restored on access and by the prefetcher
+    rewind(config.destination);
+    char *main = lazy_map(length);
+    char *at = malloc(pvl_lazy_sizeof(16));
+    assert(at != NULL);
+    struct pvl_lazy *lazy = pvl_lazy_init(at, 16, config.destination, main, length);
+    assert(lazy != NULL);
+    alignas(max_align_t) char pvl_at[pvl_sizeof(256)];
+    pvl = pvl_init(pvl_at, main, length, 256);
+    assert(pvl != NULL);
+    assert(pvl_set_restore_cb(pvl, lazy, pvl_lazy_index) == 0);
+    assert(pvl_set_read_cb(pvl, &config, pvl_journal_read) == 0);
+    assert(pvl_lazy_start(lazy) == 0);
+    assert(main[length-1] == primary[length-1]);
+    assert(main[(11*page)+1] == 0x33);
+    assert(pvl_lazy_stop(lazy) == 0);
+    assert(!memcmp(main, primary, length));
+    assert(munmap(main, length) == 0);
+    assert(munmap(primary, length) == 0);
+    fclose(config.destination);
+    free(at);
+}
+
+/* Create an empty temporary file, the template in path is replaced by its name */
+void temp_file(char *path) {
+    int fd = mkstemp(path);
+    assert((fd >= 0) && (close(fd) == 0));
+}
+
+/* Fill random ranges of main with random bytes, mark and commit them */
+void random_commit(struct pvl *pvl, char *main, size_t length) {
+    for (int ranges = 1 + (rand() % 4); ranges; ranges--) {
+        size_t size = 1 + ((size_t) rand() % 4096);
+        size_t offset = (size_t) rand() % (length - size);
+        for (size_t i = 0; i < size; i++) {
+            main[offset+i] = (char) rand();
+        }
+        assert(!pvl_mark(pvl, main+offset, size));
+    }
+    assert(!pvl_commit(pvl));
+}
+
+#define DIRECT_BLOCK 512
+#define DIRECT_STAGING 4096
+#define DIRECT_MAIN (64*1024)
+
+/* Reopen the direct journal at path and load it into a fresh instance over main */
+struct pvl *direct_reload(struct pvl_direct **direct, char *direct_at, char *pvl_at, const char *path,
+        char *main, int result) {
+    *direct = pvl_direct_open(direct_at, path, DIRECT_BLOCK, DIRECT_STAGING, 0);
+    assert(*direct != NULL);
+    memset(main, 0, DIRECT_MAIN);
+    struct pvl *pvl = pvl_init(pvl_at, main, DIRECT_MAIN, 64);
+    assert(pvl != NULL);
+    assert(pvl_set_read_cb(pvl, *direct, pvl_direct_read) == result);
+    assert(pvl_set_write_cb(pvl, *direct, pvl_direct_write) == 0);
+    return pvl;
+}
+
+void test_direct_invalid() {
+    start_test;
+    char path[] = "/tmp/pvl_direct_XXXXXX";
+    temp_file(path);
+    char *at = malloc(pvl_direct_sizeof(DIRECT_STAGING) + 1);
+    assert(at != NULL);
+    assert(pvl_direct_sizeof(DIRECT_STAGING) > DIRECT_STAGING);
+    assert(pvl_direct_open(at+1, path, DIRECT_BLOCK, DIRECT_STAGING, 0) == NULL);
+    assert(pvl_direct_open(at, NULL, DIRECT_BLOCK, DIRECT_STAGING, 0) == NULL);
+    assert(pvl_direct_open(at, path, 0, DIRECT_STAGING, 0) == NULL);
+    assert(pvl_direct_open(at, path, 3*DIRECT_BLOCK, DIRECT_STAGING, 0) == NULL);
+    assert(pvl_direct_open(at, path, DIRECT_BLOCK, 0, 0) == NULL);
+    assert(pvl_direct_open(at, path, 2*DIRECT_STAGING, DIRECT_STAGING, 0) == NULL);
+    assert(pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING+DIRECT_BLOCK, 0) == NULL);
+    assert(pvl_direct_open(at, "/nonexistent/journal", DIRECT_BLOCK, DIRECT_STAGING, 0) == NULL);
+    assert(pvl_direct_close(NULL) != 0);
+
+    char byte = 0;
+    struct pvl_direct *direct = pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING, 0);
+    assert(direct != NULL);
+    assert(pvl_direct_write(NULL, &byte, 1, 0) != 0);
+    assert(pvl_direct_write(direct, NULL, 1, 0) != 0);
+    assert(pvl_direct_write(direct, &byte, 0, 0) != 0);
+    assert(pvl_direct_read(NULL, &byte, 1, 0) != 0);
+    assert(pvl_direct_close(direct) == 0);
+    free(at);
+    unlink(path);
+}
+
+void test_direct_round_trip() {
+    start_test;
+    char path[] = "/tmp/pvl_direct_XXXXXX";
+    temp_file(path);
+    char *at = malloc(pvl_direct_sizeof(DIRECT_STAGING));
+    assert(at != NULL);
+    alignas(max_align_t) char pvl_at[pvl_sizeof(64)];
+    static char main[DIRECT_MAIN];
+    static char expected[DIRECT_MAIN];
+    srand(43);
+
+    // Randomized commits round-trip byte for byte across reopening, durably or not
+    struct pvl_direct *direct = pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING, 1);
+    assert(direct != NULL);
+    memset(main, 0, DIRECT_MAIN);
+    struct pvl *pvl = pvl_init(pvl_at, main, DIRECT_MAIN, 64);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, direct, pvl_direct_write) == 0);
+    for (int i = 0; i < 60; i++) {
+        random_commit(pvl, main, DIRECT_MAIN);
+    }
+    assert(pvl_direct_close(direct) == 0);
+    memcpy(expected, main, DIRECT_MAIN);
+
+    // Changes are padded to whole blocks, which the reader skips
+    struct stat st;
+    assert((stat(path, &st) == 0) && ((st.st_size % DIRECT_BLOCK) == 0));
+    pvl = direct_reload(&direct, at, pvl_at, path, main, 0);
+    assert(!memcmp(main, expected, DIRECT_MAIN));
+
+    // Appending continues after the loaded changes
+    for (int i = 0; i < 20; i++) {
+        random_commit(pvl, main, DIRECT_MAIN);
+    }
+    assert(pvl_direct_close(direct) == 0);
+    memcpy(expected, main, DIRECT_MAIN);
+    pvl = direct_reload(&direct, at, pvl_at, path, main, 0);
+    assert(!memcmp(main, expected, DIRECT_MAIN));
+    assert(pvl_direct_close(direct) == 0);
+    free(at);
+    unlink(path);
+}
+
+void test_direct_full_staging() {
+    start_test;
+    char path[] = "/tmp/pvl_direct_XXXXXX";
+    temp_file(path);
+    char *at = malloc(pvl_direct_sizeof(DIRECT_STAGING));
+    assert(at != NULL);
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    size_t span_length = DIRECT_STAGING - (4*sizeof(size_t));
+    static char main[16*(DIRECT_STAGING - (4*sizeof(size_t)))];
+
+    // A change that exactly fills a staging buffer needs no padding
+    struct pvl_direct *direct = pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING, 0);
+    assert(direct != NULL);
+    struct pvl *pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, direct, pvl_direct_write) == 0);
+    memset(main+span_length, 7, span_length);
+    assert(!pvl_mark(pvl, main+span_length, span_length));
+    assert(!pvl_commit(pvl));
+    assert(pvl_direct_close(direct) == 0);
+    struct stat st;
+    assert((stat(path, &st) == 0) && (st.st_size == DIRECT_STAGING));
+
+    memset(main, 0, sizeof(main));
+    direct = pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING, 0);
+    assert(direct != NULL);
+    pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_read_cb(pvl, direct, pvl_direct_read) == 0);
+    assert((main[span_length] == 7) && (main[(2*span_length)-1] == 7) && (main[2*span_length] == 0));
+    assert(pvl_direct_close(direct) == 0);
+    free(at);
+    unlink(path);
+}
+
+void test_direct_torn_change() {
+    start_test;
+    char path[] = "/tmp/pvl_direct_XXXXXX";
+    temp_file(path);
+    char *at = malloc(pvl_direct_sizeof(DIRECT_STAGING));
+    assert(at != NULL);
+    alignas(max_align_t) char pvl_at[pvl_sizeof(64)];
+    static char main[DIRECT_MAIN];
+    static char expected[DIRECT_MAIN];
+
+    struct pvl_direct *direct = pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING, 0);
+    assert(direct != NULL);
+    memset(main, 0, DIRECT_MAIN);
+    struct pvl *pvl = pvl_init(pvl_at, main, DIRECT_MAIN, 64);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, direct, pvl_direct_write) == 0);
+    memset(main, 1, 100);
+    assert(!pvl_mark(pvl, main, 100));
+    assert(!pvl_commit(pvl));
+    memcpy(expected, main, DIRECT_MAIN);
+    memset(main+2048, 2, 2000);
+    assert(!pvl_mark(pvl, main+2048, 2000));
+    assert(!pvl_commit(pvl));
+    assert(pvl_direct_close(direct) == 0);
+
+    // The load stops before a torn trailing change, each change of one span takes three blocks
+    assert(truncate(path, (3*DIRECT_BLOCK)+100) == 0);
+    pvl = direct_reload(&direct, at, pvl_at, path, main, 0);
+    assert(!memcmp(main, expected, DIRECT_MAIN));
+
+    // Appending replaces the torn change
+    memset(main+4096, 3, 10);
+    assert(!pvl_mark(pvl, main+4096, 10));
+    assert(!pvl_commit(pvl));
+    assert(pvl_direct_close(direct) == 0);
+    memcpy(expected, main, DIRECT_MAIN);
+    struct stat st;
+    assert((stat(path, &st) == 0) && (st.st_size == 6*DIRECT_BLOCK));
+    pvl = direct_reload(&direct, at, pvl_at, path, main, 0);
+    assert(!memcmp(main, expected, DIRECT_MAIN));
+    assert(pvl_direct_close(direct) == 0);
+
+    // A journal that shrinks after opening fails the load within a change
+    direct = pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING, 0);
+    assert(direct != NULL);
+    assert(truncate(path, (3*DIRECT_BLOCK)+(2*sizeof(size_t))) == 0);
+    pvl = pvl_init(pvl_at, main, DIRECT_MAIN, 64);
+    assert(pvl != NULL);
+    assert(pvl_set_read_cb(pvl, direct, pvl_direct_read) != 0);
+    assert(pvl_direct_close(direct) == 0);
+    free(at);
+    unlink(path);
+}
+
+void test_direct_write_failure() {
+    start_test;
+    char path[] = "/tmp/pvl_direct_XXXXXX";
+    temp_file(path);
+    char *at = malloc(pvl_direct_sizeof(DIRECT_STAGING));
+    assert(at != NULL);
+    alignas(max_align_t) char pvl_at[pvl_sizeof(64)];
+    static char main[DIRECT_MAIN];
+    static char expected[DIRECT_MAIN];
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit small = {1, limit.rlim_max};
+    signal(SIGXFSZ, SIG_IGN);
+
+    // Appending to an unread file pads it to a block first, which fails past the file size limit
+    FILE *unread = fopen(path, "w");
+    assert((unread != NULL) && (fputs("data", unread) >= 0) && (fclose(unread) == 0));
+    struct pvl_direct *direct = pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING, 0);
+    assert(direct != NULL);
+    memset(main, 0, DIRECT_MAIN);
+    struct pvl *pvl = pvl_init(pvl_at, main, DIRECT_MAIN, 64);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, direct, pvl_direct_write) == 0);
+    memset(main, 1, 100);
+    assert(!pvl_mark(pvl, main, 100));
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(pvl_commit(pvl) != 0);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    assert(!pvl_commit(pvl));
+    assert(pvl_direct_close(direct) == 0);
+    struct stat st;
+    assert((stat(path, &st) == 0) && (st.st_size == 4*DIRECT_BLOCK));
+
+    // Start over with an empty journal
+    assert(truncate(path, 0) == 0);
+    direct = pvl_direct_open(at, path, DIRECT_BLOCK, DIRECT_STAGING, 0);
+    assert(direct != NULL);
+    pvl = pvl_init(pvl_at, main, DIRECT_MAIN, 64);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, direct, pvl_direct_write) == 0);
+    assert(!pvl_mark(pvl, main, 100));
+    assert(!pvl_commit(pvl));
+
+    // A short write fails a change that fits in one staging buffer, and the change is truncated
+    memset(main+1024, 2, 1000);
+    assert(!pvl_mark(pvl, main+1024, 1000));
+    small.rlim_cur = 4*DIRECT_BLOCK;
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(pvl_commit(pvl) != 0);
+    assert((stat(path, &st) == 0) && (st.st_size == 3*DIRECT_BLOCK));
+
+    // A failed write is also reported while a larger change is being staged
+    memset(main+8192, 3, 3*DIRECT_STAGING);
+    assert(!pvl_mark(pvl, main+8192, 3*DIRECT_STAGING));
+    assert(pvl_commit(pvl) != 0);
+    assert((stat(path, &st) == 0) && (st.st_size == 3*DIRECT_BLOCK));
+
+    // The failed changes are written anew once the limit is lifted
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    assert(!pvl_commit(pvl));
+    assert(pvl_direct_close(direct) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    memcpy(expected, main, DIRECT_MAIN);
+    pvl = direct_reload(&direct, at, pvl_at, path, main, 0);
+    assert(!memcmp(main, expected, DIRECT_MAIN));
+    assert(pvl_direct_close(direct) == 0);
+    free(at);
+    unlink(path);
+}
+
+/* Whether io_uring is permitted, any other setup failure fails the tests */
+int uring_available() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = (int) syscall(__NR_io_uring_setup, 1, &params);
+    int error = (ring_fd < 0) ? errno : 0;
+    assert((error == 0) | (error == ENOSYS) | (error == EPERM));
+    return (ring_fd >= 0) && (close(ring_fd) == 0);
+}
+
+void test_uring_invalid() {
+    start_test;
+    size_t depth = 1 << 16;
+    char *at = malloc(pvl_uring_sizeof(depth, 64) + 1);
+    assert(at != NULL);
+    FILE *journal = tmpfile();
+    assert(journal != NULL);
+    int fd = fileno(journal);
+    assert(pvl_uring_sizeof(2, 64) > pvl_uring_sizeof(1, 64));
+    assert(pvl_uring_open(at+1, fd, 2, 64, 0) == NULL);
+    assert(pvl_uring_open(at, -1, 2, 64, 0) == NULL);
+    assert(pvl_uring_open(at, fd, 0, 64, 0) == NULL);
+    assert(pvl_uring_open(at, fd, 2, 0, 0) == NULL);
+    assert(pvl_uring_open(at, fd, 2, 64, 0x04) == NULL);
+
+    // Pipes cannot be appended to at an offset and rings have a maximum size
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(pvl_uring_open(at, fds[1], 2, 64, 0) == NULL);
+    close(fds[0]);
+    close(fds[1]);
+    assert(pvl_uring_open(at, fd, depth, 64, 0) == NULL);
+
+    char byte = 0;
+    struct pvl_uring *uring = pvl_uring_open(at, fd, 2, 64, 0);
+    assert(uring != NULL);
+    assert(pvl_uring_write(NULL, &byte, 1, 0) != 0);
+    assert(pvl_uring_write(uring, NULL, 1, 0) != 0);
+    assert(pvl_uring_write(uring, &byte, 0, 0) != 0);
+    assert(pvl_uring_durable(NULL) == 0);
+    assert(pvl_uring_sync(NULL) != 0);
+    assert(pvl_uring_close(NULL) != 0);
+    assert(pvl_uring_close(uring) == 0);
+    fclose(journal);
+    free(at);
+}
+
+/* Commit through a ring with two 64 byte slots and load the journal back */
+void uring_commits(unsigned int flags) {
+    char *at = malloc(pvl_uring_sizeof(2, 64));
+    assert(at != NULL);
+    struct pvl_journal_config config = {tmpfile()};
+    assert(config.destination != NULL);
+    struct pvl_uring *uring = pvl_uring_open(at, fileno(config.destination), 2, 64, flags);
+    assert(uring != NULL);
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    struct pvl *pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, uring, pvl_uring_write) == 0);
+
+    // Each change takes both slots, more commits than slots are in flight
+    for (int i = 0; i < 10; i++) {
+        memset(main+(64*i), i+1, 10);
+        assert(!pvl_mark(pvl, main+(64*i), 10));
+        assert(!pvl_commit(pvl));
+    }
+
+    // A change larger than all slots wraps around them
+    memset(main+640, 11, 192);
+    assert(!pvl_mark(pvl, main+640, 192));
+    assert(!pvl_commit(pvl));
+    assert(pvl_uring_sync(uring) == 0);
+    assert(pvl_uring_durable(uring) == 11);
+    assert(pvl_uring_close(uring) == 0);
+
+    char expected[1024];
+    memcpy(expected, main, sizeof(main));
+    memset(main, 0, sizeof(main));
+    rewind(config.destination);
+    pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_read_cb(pvl, &config, pvl_journal_read) == 0);
+    assert(!memcmp(main, expected, sizeof(main)));
+    fclose(config.destination);
+    free(at);
+}
+
+void test_uring_commits() {
+    start_test;
+    uring_commits(0);
+    uring_commits(PVL_URING_FIXED);
+    uring_commits(PVL_URING_SQPOLL);
+    uring_commits(PVL_URING_SQPOLL | PVL_URING_FIXED);
+}
+
+void test_uring_failure() {
+    start_test;
+    char path[] = "/tmp/pvl_uring_XXXXXX";
+    temp_file(path);
+    char *at = malloc(pvl_uring_sizeof(2, 64));
+    assert(at != NULL);
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+
+    // A failed write is reported once reaped and by every later call
+    struct pvl_uring *uring = pvl_uring_open(at, fd, 2, 64, 0);
+    assert(uring != NULL);
+    struct pvl *pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, uring, pvl_uring_write) == 0);
+    main[0] = 1;
+    assert(!pvl_mark(pvl, main, 1));
+    assert(!pvl_commit(pvl));
+    assert(pvl_uring_sync(uring) != 0);
+    assert(!pvl_mark(pvl, main, 1));
+    assert(pvl_commit(pvl) != 0);
+    assert(pvl_uring_durable(uring) == 0);
+    assert(pvl_uring_close(uring) != 0);
+
+    // A change that wraps around the slots fails once its first writes complete
+    uring = pvl_uring_open(at, fd, 2, 64, 0);
+    assert(uring != NULL);
+    pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, uring, pvl_uring_write) == 0);
+    assert(!pvl_mark(pvl, main, 192));
+    assert(pvl_commit(pvl) != 0);
+    assert(pvl_uring_close(uring) != 0);
+    close(fd);
+
+    // A short write past the file size limit fails the ring as well
+    fd = open(path, O_WRONLY);
+    assert(fd >= 0);
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit small = {100, limit.rlim_max};
+    signal(SIGXFSZ, SIG_IGN);
+    uring = pvl_uring_open(at, fd, 2, 4096, 0);
+    assert(uring != NULL);
+    pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, uring, pvl_uring_write) == 0);
+    assert(!pvl_mark(pvl, main, 128));
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(!pvl_commit(pvl));
+    assert(pvl_uring_sync(uring) != 0);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    assert(pvl_uring_close(uring) != 0);
+    close(fd);
+    unlink(path);
+    free(at);
+}
+
+/* Create an empty temporary directory, the template in path is replaced by its name */
+void temp_dir(char *path) {
+    assert(mkdtemp(path) != NULL);
+}
+
+/* Remove a temporary directory and the files in it */
+void remove_dir(const char *path) {
+    DIR *dir = opendir(path);
+    assert(dir != NULL);
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+        unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+    closedir(dir);
+    assert(rmdir(path) == 0);
+}
+
+/* The path of the segment with sequence number seq in directory */
+void segment_path(char *path, const char *directory, uint64_t seq) {
+    snprintf(path, 64, "%s/%016" PRIx64 ".segment", directory, seq);
+}
+
+/* Fill a 64 byte span of main with value, mark and commit it */
+int span_commit(struct pvl *pvl, char *main, size_t span, char value) {
+    memset(main+(64*span), value, 64);
+    assert(!pvl_mark(pvl, main+(64*span), 64));
+    return pvl_commit(pvl);
+}
+
+/* Open the segmented journal in directory, optionally load it into a fresh instance over main */
+struct pvl *segment_reopen(struct pvl_segment **segment, char *segment_at, char *pvl_at, const char *directory,
+        char *main, int load) {
+    *segment = pvl_segment_open(segment_at, directory, 1024, 256, 0);
+    assert(*segment != NULL);
+    memset(main, 0, 1024);
+    struct pvl *pvl = pvl_init(pvl_at, main, 1024, 16);
+    assert(pvl != NULL);
+    if (load) {
+        assert(pvl_set_read_cb(pvl, *segment, pvl_segment_read) == 0);
+    }
+    assert(pvl_set_write_cb(pvl, *segment, pvl_segment_write) == 0);
+    return pvl;
+}
+
+/* Check that the manifest in directory lists the segments from first to last */
+void check_manifest(const char *directory, const char *expected) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/manifest", directory);
+    FILE *manifest = fopen(path, "r");
+    assert(manifest != NULL);
+    char text[64] = {0};
+    assert(fgets(text, sizeof(text), manifest) != NULL);
+    assert(!strcmp(text, expected));
+    fclose(manifest);
+}
+
+void test_segment_invalid() {
+    start_test;
+    char directory[] = "/tmp/pvl_segment_XXXXXX";
+    temp_dir(directory);
+    alignas(max_align_t) char at[pvl_segment_sizeof(256) + 1];
+    assert(pvl_segment_sizeof(256) > 256);
+    assert(pvl_segment_open(at+1, directory, 1024, 256, 0) == NULL);
+    assert(pvl_segment_open(at, NULL, 1024, 256, 0) == NULL);
+    assert(pvl_segment_open(at, directory, 0, 256, 0) == NULL);
+    assert(pvl_segment_open(at, directory, 1024, 0, 0) == NULL);
+    assert(pvl_segment_open(at, "/nonexistent/journal", 1024, 256, 0) == NULL);
+    assert(pvl_segment_close(NULL) != 0);
+    assert(pvl_segment_rotate(NULL) != 0);
+    assert(pvl_segment_current(NULL) == 0);
+    assert(pvl_segment_trim(NULL, 1) != 0);
+
+    // Manifests that cannot be read or do not list a valid range of segments are rejected
+    char path[64];
+    snprintf(path, sizeof(path), "%s/manifest", directory);
+    const char *manifests[] = {"", "garbage\n", "0 0\n", "3 1\n"};
+    for (size_t i = 0; i < 4; i++) {
+        FILE *manifest = fopen(path, "w");
+        assert((manifest != NULL) && (fputs(manifests[i], manifest) >= 0) && (fclose(manifest) == 0));
+        assert(pvl_segment_open(at, directory, 1024, 256, 0) == NULL);
+    }
+    assert((unlink(path) == 0) && (mkdir(path, 0700) == 0));
+    assert(pvl_segment_open(at, directory, 1024, 256, 0) == NULL);
+    assert(rmdir(path) == 0);
+
+    // A listed segment that is missing fails the read
+    FILE *manifest = fopen(path, "w");
+    assert((manifest != NULL) && (fputs("1 1\n", manifest) >= 0) && (fclose(manifest) == 0));
+    struct pvl_segment *segment = pvl_segment_open(at, directory, 1024, 256, 0);
+    assert(segment != NULL);
+    size_t header[2];
+    assert(pvl_segment_read(NULL, header, sizeof(header), 0) != 0);
+    assert(pvl_segment_read(segment, header, sizeof(header), 0) == 1);
+
+    // A change must start with its header
+    char bytes[2*sizeof(header)] = {0};
+    assert(pvl_segment_write(NULL, bytes, sizeof(header), 0) != 0);
+    assert(pvl_segment_write(segment, NULL, sizeof(header), 0) != 0);
+    assert(pvl_segment_write(segment, bytes, 0, 0) != 0);
+    assert(pvl_segment_write(segment, bytes, sizeof(bytes), 0) != 0);
+    assert(pvl_segment_close(segment) == 0);
+    remove_dir(directory);
+}
+
+void test_segment_rotation() {
+    start_test;
+    char directory[] = "/tmp/pvl_segment_XXXXXX";
+    temp_dir(directory);
+    alignas(max_align_t) char segment_at[pvl_segment_sizeof(256)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    char expected[1024];
+
+    // Changes of 96 bytes start a new 1024 byte segment when they do not fit in the current one
+    struct pvl_segment *segment = pvl_segment_open(segment_at, directory, 1024, 256, 1);
+    assert(segment != NULL);
+    assert(pvl_segment_current(segment) == 0);
+    struct pvl *pvl = pvl_init(pvl_at, main, 1024, 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, segment, pvl_segment_write) == 0);
+    for (int i = 0; i < 25; i++) {
+        assert(span_commit(pvl, main, (size_t) i % 16, (char) (i+1)) == 0);
+    }
+    assert(pvl_segment_current(segment) == 3);
+
+    // Explicit rotation, and a change larger than a segment extends its own one
+    assert(pvl_segment_rotate(segment) == 0);
+    assert(span_commit(pvl, main, 3, 26) == 0);
+    assert(pvl_segment_current(segment) == 4);
+    memset(main, 27, 1024);
+    assert(!pvl_mark(pvl, main, 1024));
+    assert(!pvl_commit(pvl));
+    assert(pvl_segment_current(segment) == 5);
+    assert(span_commit(pvl, main, 5, 28) == 0);
+    assert(pvl_segment_current(segment) == 6);
+    assert(pvl_segment_close(segment) == 0);
+    check_manifest(directory, "1 6\n");
+    memcpy(expected, main, sizeof(main));
+
+    // The load streams across the segments and skips their zeroed tails
+    pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+    assert(pvl_segment_current(segment) == 0);
+
+    // Appending resumes in the last segment
+    assert(span_commit(pvl, main, 6, 29) == 0);
+    assert(pvl_segment_current(segment) == 6);
+    assert(pvl_segment_close(segment) == 0);
+    memcpy(expected, main, sizeof(main));
+    pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+    assert(pvl_segment_close(segment) == 0);
+    remove_dir(directory);
+}
+
+void test_segment_resume() {
+    start_test;
+    char directory[] = "/tmp/pvl_segment_XXXXXX";
+    temp_dir(directory);
+    alignas(max_align_t) char segment_at[pvl_segment_sizeof(256)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    char expected[1024];
+    char path[64];
+    char moved[64];
+
+    // Two changes in each of four segments
+    struct pvl_segment *segment;
+    struct pvl *pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 0);
+    for (int i = 0; i < 8; i++) {
+        assert(span_commit(pvl, main, (size_t) i, (char) (i+1)) == 0);
+        if (i == 3) {
+            memcpy(expected, main, sizeof(main));
+        }
+        if (i % 2) {
+            assert(pvl_segment_rotate(segment) == 0);
+        }
+    }
+    assert(pvl_segment_close(segment) == 0);
+
+    // A torn header at the end of the first segment moves the reader on to the next one
+    segment_path(path, directory, 1);
+    assert(truncate(path, (2*96)+8) == 0);
+
+    // An invalid header in the third segment stops the load
+    segment_path(path, directory, 3);
+    FILE *file = fopen(path, "r+");
+    size_t header[2] = {0, 5};
+    assert((file != NULL) && (fwrite(header, sizeof(header), 1, file) == 1) && (fclose(file) == 0));
+    pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+
+    // Resuming fails without a manifest or the segment to append to
+    snprintf(moved, sizeof(moved), "%s/manifest.tmp", directory);
+    assert(mkdir(moved, 0700) == 0);
+    assert(span_commit(pvl, main, 9, 10) != 0);
+    assert(rmdir(moved) == 0);
+    snprintf(moved, sizeof(moved), "%s/moved", directory);
+    assert(rename(path, moved) == 0);
+    assert(span_commit(pvl, main, 9, 10) != 0);
+    assert(rename(moved, path) == 0);
+
+    // Appending resumes at the invalid header and drops the segments after it
+    assert(span_commit(pvl, main, 9, 10) == 0);
+    assert(pvl_segment_current(segment) == 3);
+    check_manifest(directory, "1 3\n");
+    segment_path(path, directory, 4);
+    assert(access(path, F_OK) != 0);
+    assert(pvl_segment_close(segment) == 0);
+    memcpy(expected, main, sizeof(main));
+    pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+    assert(pvl_segment_close(segment) == 0);
+    remove_dir(directory);
+}
+
+void test_segment_truncated_read() {
+    start_test;
+    char directory[] = "/tmp/pvl_segment_XXXXXX";
+    temp_dir(directory);
+    alignas(max_align_t) char segment_at[pvl_segment_sizeof(256)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    char path[64];
+    segment_path(path, directory, 1);
+    struct pvl_segment *segment;
+    struct pvl *pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 0);
+    assert(span_commit(pvl, main, 0, 1) == 0);
+    assert(span_commit(pvl, main, 1, 2) == 0);
+    assert(pvl_segment_close(segment) == 0);
+
+    // Content past the end of the segment cannot be read, nor content that was truncated after opening
+    size_t header[2];
+    char content[2048];
+    segment = pvl_segment_open(segment_at, directory, 1024, 256, 0);
+    assert(segment != NULL);
+    assert(pvl_segment_read(segment, header, sizeof(header), 0) == 0);
+    assert(pvl_segment_read(segment, NULL, 0, 80) == 0);
+    assert(pvl_segment_read(segment, content, sizeof(content), 0) == 1);
+    assert(truncate(path, 56) == 0);
+    assert(pvl_segment_read(segment, content, 80, 0) == 1);
+    assert(pvl_segment_close(segment) == 0);
+
+    // Neither can the header of the next change
+    segment = pvl_segment_open(segment_at, directory, 1024, 256, 0);
+    assert(segment != NULL);
+    assert(truncate(path, 1024) == 0);
+    assert(pvl_segment_read(segment, header, sizeof(header), 0) == 0);
+    assert(pvl_segment_read(segment, content, 80, 0) == 0);
+    assert(truncate(path, 96) == 0);
+    assert(pvl_segment_read(segment, header, sizeof(header), 0) == 1);
+    assert(pvl_segment_close(segment) == 0);
+    remove_dir(directory);
+}
+
+void test_segment_trim() {
+    start_test;
+    char directory[] = "/tmp/pvl_segment_XXXXXX";
+    temp_dir(directory);
+    alignas(max_align_t) char segment_at[pvl_segment_sizeof(256)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    char expected[1024];
+    char path[64];
+    struct pvl_segment *segment;
+    struct pvl *pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 0);
+    for (int i = 0; i < 4; i++) {
+        assert(pvl_segment_rotate(segment) == 0);
+        memset(main, i+1, 1024);
+        assert(!pvl_mark(pvl, main, 1024));
+        assert(!pvl_commit(pvl));
+    }
+    assert(pvl_segment_trim(segment, 1) == 0);
+    assert(pvl_segment_trim(segment, 5) != 0);
+
+    // The manifest is updated before the dropped segments are unlinked
+    segment_path(path, directory, 2);
+    assert((unlink(path) == 0) && (mkdir(path, 0700) == 0));
+    assert(pvl_segment_trim(segment, 3) != 0);
+    check_manifest(directory, "3 4\n");
+    assert(rmdir(path) == 0);
+    segment_path(path, directory, 1);
+    assert(access(path, F_OK) != 0);
+
+    // A manifest that cannot be replaced keeps the segments
+    snprintf(path, sizeof(path), "%s/manifest.tmp", directory);
+    assert(mkdir(path, 0700) == 0);
+    assert(pvl_segment_trim(segment, 4) != 0);
+    check_manifest(directory, "3 4\n");
+    assert(rmdir(path) == 0);
+    assert(pvl_segment_close(segment) == 0);
+
+    // Loading starts at the first segment that is kept
+    memcpy(expected, main, sizeof(main));
+    pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+    assert(pvl_segment_close(segment) == 0);
+    remove_dir(directory);
+}
+
+void test_segment_write_failure() {
+    start_test;
+    char directory[] = "/tmp/pvl_segment_XXXXXX";
+    temp_dir(directory);
+    alignas(max_align_t) char segment_at[pvl_segment_sizeof(256)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    char expected[1024];
+    char path[64];
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit small = {100, limit.rlim_max};
+    signal(SIGXFSZ, SIG_IGN);
+
+    // A segment that cannot be created fails the commit until it can
+    segment_path(path, directory, 1);
+    assert(mkdir(path, 0700) == 0);
+    struct pvl_segment *segment;
+    struct pvl *pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 0);
+    assert(span_commit(pvl, main, 0, 1) != 0);
+    assert(rmdir(path) == 0);
+    assert(!pvl_commit(pvl));
+
+    // So does a manifest that cannot be replaced, the preallocated segment is kept for the retry
+    snprintf(path, sizeof(path), "%s/manifest.tmp", directory);
+    assert(mkdir(path, 0700) == 0);
+    assert(pvl_segment_rotate(segment) == 0);
+    assert(span_commit(pvl, main, 1, 2) != 0);
+    assert(rmdir(path) == 0);
+    assert(!pvl_commit(pvl));
+    assert(pvl_segment_current(segment) == 2);
+
+    // Writes past the file size limit fail at the end of a change and while staging a larger one
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(span_commit(pvl, main, 2, 3) != 0);
+    memset(main+256, 4, 256);
+    assert(!pvl_mark(pvl, main+256, 256));
+    assert(pvl_commit(pvl) != 0);
+
+    // A failed preallocation of the next segment is retried at the following rotation
+    assert(pvl_segment_rotate(segment) == 0);
+    assert(pvl_commit(pvl) != 0);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    assert(pvl_segment_rotate(segment) == 0);
+    assert(!pvl_commit(pvl));
+    assert(pvl_segment_current(segment) == 4);
+    assert(pvl_segment_close(segment) == 0);
+    memcpy(expected, main, sizeof(main));
+    pvl = segment_reopen(&segment, segment_at, pvl_at, directory, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+    assert(pvl_segment_close(segment) == 0);
+    remove_dir(directory);
+}
+
+/* Open the mapped journal at path, optionally load it into a fresh instance over main */
+struct pvl *mapped_reopen(struct pvl_mapped **mapped, char *mapped_at, char *pvl_at, const char *path,
+        char *main, int load) {
+    *mapped = pvl_mapped_open(mapped_at, path, 4096, 0);
+    assert(*mapped != NULL);
+    memset(main, 0, 1024);
+    struct pvl *pvl = pvl_init(pvl_at, main, 1024, 16);
+    assert(pvl != NULL);
+    if (load) {
+        assert(pvl_set_read_cb(pvl, *mapped, pvl_mapped_read) == 0);
+    }
+    assert(pvl_set_write_cb(pvl, *mapped, pvl_mapped_write) == 0);
+    return pvl;
+}
+
+void test_mapped_invalid() {
+    start_test;
+    char path[] = "/tmp/pvl_mapped_XXXXXX";
+    temp_file(path);
+    alignas(max_align_t) char at[pvl_mapped_sizeof() + 1];
+    assert(pvl_mapped_open(at+1, path, 4096, 0) == NULL);
+    assert(pvl_mapped_open(at, NULL, 4096, 0) == NULL);
+    assert(pvl_mapped_open(at, path, 0, 0) == NULL);
+    assert(pvl_mapped_open(at, "/nonexistent/journal", 4096, 0) == NULL);
+    assert(pvl_mapped_close(NULL) != 0);
+    assert(pvl_mapped_sync(NULL) != 0);
+
+    // The file cannot be preallocated past the file size limit
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit small = {100, limit.rlim_max};
+    signal(SIGXFSZ, SIG_IGN);
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(pvl_mapped_open(at, path, 4096, 0) == NULL);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+
+    size_t header[2] = {1, 8};
+    char bytes[8192] = {0};
+    struct pvl_mapped *mapped = pvl_mapped_open(at, path, 4096, 0);
+    assert(mapped != NULL);
+    assert(pvl_mapped_write(NULL, header, sizeof(header), 0) != 0);
+    assert(pvl_mapped_write(mapped, NULL, sizeof(header), 0) != 0);
+    assert(pvl_mapped_write(mapped, header, 0, 0) != 0);
+    assert(pvl_mapped_read(NULL, header, sizeof(header), 0) != 0);
+
+    // A change must start with its header and not be longer than announced
+    assert(pvl_mapped_write(mapped, bytes, sizeof(header)+1, 0) != 0);
+    assert(pvl_mapped_write(mapped, header, sizeof(header), 8) == 0);
+    assert(pvl_mapped_write(mapped, bytes, sizeof(bytes), 0) != 0);
+    assert(pvl_mapped_read(mapped, header, sizeof(header), 0) == EOF);
+    assert(pvl_mapped_close(mapped) == 0);
+
+    // Content past the end of the journal cannot be read, a full journal ends after its last change
+    size_t content = 4096 - sizeof(header);
+    mapped = pvl_mapped_open(at, path, 4096, 0);
+    assert(mapped != NULL);
+    header[0] = 1;
+    header[1] = content;
+    assert(pvl_mapped_write(mapped, header, sizeof(header), content) == 0);
+    assert(pvl_mapped_write(mapped, bytes, content, 0) == 0);
+    assert(pvl_mapped_read(mapped, header, sizeof(header), 0) == 0);
+    assert(pvl_mapped_read(mapped, NULL, 0, content) == 0);
+    assert(pvl_mapped_read(mapped, bytes, sizeof(bytes), 0) == 1);
+    assert(pvl_mapped_read(mapped, bytes, content, 0) == 0);
+    assert(pvl_mapped_read(mapped, header, sizeof(header), 0) == EOF);
+    assert(pvl_mapped_close(mapped) == 0);
+    unlink(path);
+}
+
+void test_mapped_append() {
+    start_test;
+    char path[] = "/tmp/pvl_mapped_XXXXXX";
+    temp_file(path);
+    alignas(max_align_t) char mapped_at[pvl_mapped_sizeof()];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    char expected[1024];
+
+    // Changes of 96 bytes outgrow the 4096 byte file and mapping, and are synced in a batch
+    struct pvl_mapped *mapped;
+    struct pvl *pvl = mapped_reopen(&mapped, mapped_at, pvl_at, path, main, 0);
+    for (int i = 0; i < 50; i++) {
+        assert(span_commit(pvl, main, (size_t) i % 16, (char) (i+1)) == 0);
+    }
+    assert(pvl_mapped_sync(mapped) == 0);
+    assert(pvl_mapped_sync(mapped) == 0);
+    assert(pvl_mapped_close(mapped) == 0);
+    struct stat st;
+    assert((stat(path, &st) == 0) && (st.st_size == 8192));
+    memcpy(expected, main, sizeof(main));
+    pvl = mapped_reopen(&mapped, mapped_at, pvl_at, path, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+    assert(pvl_mapped_close(mapped) == 0);
+
+    // Without loading, appending starts after the last complete change
+    mapped = pvl_mapped_open(mapped_at, path, 4096, 1);
+    assert(mapped != NULL);
+    pvl = pvl_init(pvl_at, main, 1024, 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, mapped, pvl_mapped_write) == 0);
+    assert(span_commit(pvl, main, 2, 51) == 0);
+    assert(pvl_mapped_close(mapped) == 0);
+
+    // A header with more content than the file holds ends the walk and is overwritten
+    FILE *file = fopen(path, "r+");
+    assert(file != NULL);
+    size_t header[2] = {1, 1 << 20};
+    assert((fseek(file, 51*96, SEEK_SET) == 0) && (fwrite(header, sizeof(header), 1, file) == 1));
+    assert(fclose(file) == 0);
+    mapped = pvl_mapped_open(mapped_at, path, 4096, 0);
+    assert(mapped != NULL);
+    pvl = pvl_init(pvl_at, main, 1024, 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, mapped, pvl_mapped_write) == 0);
+    assert(span_commit(pvl, main, 3, 52) == 0);
+    assert(pvl_mapped_close(mapped) == 0);
+    memcpy(expected, main, sizeof(main));
+    pvl = mapped_reopen(&mapped, mapped_at, pvl_at, path, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+    assert(pvl_mapped_close(mapped) == 0);
+    unlink(path);
+}
+
+void test_mapped_write_failure() {
+    start_test;
+    char path[] = "/tmp/pvl_mapped_XXXXXX";
+    temp_file(path);
+    alignas(max_align_t) char mapped_at[pvl_mapped_sizeof()];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    char expected[1024];
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit small = {100, limit.rlim_max};
+    signal(SIGXFSZ, SIG_IGN);
+
+    // Appending cannot start when the file cannot be preallocated again
+    struct pvl_mapped *mapped;
+    struct pvl *pvl = mapped_reopen(&mapped, mapped_at, pvl_at, path, main, 0);
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(span_commit(pvl, main, 0, 1) != 0);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    assert(!pvl_commit(pvl));
+
+    // Neither can the file grow past the limit
+    small.rlim_cur = 4096;
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    memset(main, 2, 1024);
+    assert(!pvl_mark(pvl, main, 1024));
+    for (int i = 0; i < 3; i++) {
+        assert(!pvl_commit(pvl));
+        assert(!pvl_mark(pvl, main, 1024));
+    }
+    assert(pvl_commit(pvl) != 0);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    assert(!pvl_commit(pvl));
+    assert(pvl_mapped_close(mapped) == 0);
+    memcpy(expected, main, sizeof(main));
+    pvl = mapped_reopen(&mapped, mapped_at, pvl_at, path, main, 1);
+    assert(!memcmp(main, expected, sizeof(main)));
+    assert(pvl_mapped_close(mapped) == 0);
+    unlink(path);
+}
+
+/* Open a backing over the data file and redo log, optionally loading it and applying commits */
+struct pvl *backing_reopen(struct pvl_backing **backing, char *backing_at, char *pvl_at, const char *data,
+        const char *log, int load) {
+    *backing = pvl_backing_open(backing_at, data, log, 1024, 64);
+    assert(*backing != NULL);
+    struct pvl *pvl = pvl_init(pvl_at, pvl_backing_main(*backing), 1024, 16);
+    assert(pvl != NULL);
+    if (load) {
+        assert(pvl_set_apply_cb(pvl, *backing, pvl_backing_apply) == 0);
+        assert(pvl_set_read_cb(pvl, *backing, pvl_backing_read) == 0);
+    }
+    assert(pvl_set_write_cb(pvl, *backing, pvl_backing_write) == 0);
+    return pvl;
+}
+
+/* Check that the data file holds expected and that the redo log is size bytes long */
+void check_backing(const char *data, const char *log, const char *expected, off_t size) {
+    char bytes[1024];
+    int fd = open(data, O_RDONLY);
+    assert((fd >= 0) && (pread(fd, bytes, sizeof(bytes), 0) == sizeof(bytes)) && (close(fd) == 0));
+    assert(!memcmp(bytes, expected, sizeof(bytes)));
+    struct stat st;
+    assert((stat(log, &st) == 0) && (st.st_size == size));
+}
+
+/* Replace the descriptor that the process holds on path with one opened with flags */
+void reopen_fd(const char *path, int flags) {
+    struct stat expected, st;
+    assert(stat(path, &expected) == 0);
+    int found = -1;
+    for (int fd = 0; fd < 1024; fd++) {
+        if ((fstat(fd, &st) == 0) && (st.st_dev == expected.st_dev) && (st.st_ino == expected.st_ino)) {
+            found = fd;
+        }
+    }
+    int fd = open(path, flags);
+    assert((found >= 0) && (fd >= 0) && (dup2(fd, found) == found) && (close(fd) == 0));
+}
+
+void test_backing_invalid() {
+    start_test;
+    char data[] = "/tmp/pvl_data_XXXXXX";
+    char log[] = "/tmp/pvl_log_XXXXXX";
+    temp_file(data);
+    temp_file(log);
+    alignas(max_align_t) char at[pvl_backing_sizeof(64) + 1];
+    assert(pvl_backing_open(at+1, data, log, 1024, 64) == NULL);
+    assert(pvl_backing_open(at, NULL, log, 1024, 64) == NULL);
+    assert(pvl_backing_open(at, data, NULL, 1024, 64) == NULL);
+    assert(pvl_backing_open(at, data, log, 0, 64) == NULL);
+    assert(pvl_backing_open(at, data, log, 1024, 0) == NULL);
+    assert(pvl_backing_open(at, "/nonexistent/data", log, 1024, 64) == NULL);
+    assert(pvl_backing_main(NULL) == NULL);
+    assert(pvl_backing_close(NULL) != 0);
+
+    // The data file cannot be extended past the file size limit
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit small = {100, limit.rlim_max};
+    signal(SIGXFSZ, SIG_IGN);
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(pvl_backing_open(at, data, log, 1024, 64) == NULL);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    assert(pvl_backing_open(at, data, "/nonexistent/log", 1024, 64) == NULL);
+
+    // Nor can spans be applied past it
+    char bytes[64] = {0};
+    struct pvl_backing *backing = pvl_backing_open(at, data, log, 1024, 64);
+    assert(backing != NULL);
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(pvl_backing_apply(backing, 512, bytes, sizeof(bytes), 0) != 0);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+
+    assert(pvl_backing_write(NULL, bytes, sizeof(bytes), 0) != 0);
+    assert(pvl_backing_write(backing, NULL, sizeof(bytes), 0) != 0);
+    assert(pvl_backing_write(backing, bytes, 0, 0) != 0);
+    assert(pvl_backing_read(NULL, bytes, sizeof(bytes), 0) != 0);
+    assert(pvl_backing_apply(NULL, 0, bytes, sizeof(bytes), 0) != 0);
+    assert(pvl_backing_apply(backing, 0, NULL, sizeof(bytes), 0) != 0);
+    assert(pvl_backing_apply(backing, 1024, bytes, 1, 0) != 0);
+    assert(pvl_backing_apply(backing, 1000, bytes, sizeof(bytes), 0) != 0);
+
+    // An empty redo log ends at once
+    assert(pvl_backing_read(backing, bytes, 16, 0) == EOF);
+    assert(pvl_backing_close(backing) == 0);
+
+    // A partial change in the redo log cannot be read
+    FILE *file = fopen(log, "w");
+    assert((file != NULL) && (fwrite(bytes, 24, 1, file) == 1) && (fclose(file) == 0));
+    backing = pvl_backing_open(at, data, log, 1024, 64);
+    assert(backing != NULL);
+    assert(pvl_backing_read(backing, NULL, 0, 32) != 0);
+    assert(pvl_backing_read(backing, bytes, 16, 8) == 0);
+    assert(pvl_backing_read(backing, NULL, 0, 8) == 0);
+    assert(pvl_backing_read(backing, bytes, 16, 0) != 0);
+
+    // Nor a redo log that shrank since it was opened
+    assert(truncate(log, 16) == 0);
+    assert(pvl_backing_read(backing, bytes, 8, 0) != 0);
+    assert(pvl_backing_close(backing) == 0);
+    unlink(data);
+    unlink(log);
+}
+
+void test_backing_commits() {
+    start_test;
+    char data[] = "/tmp/pvl_data_XXXXXX";
+    char log[] = "/tmp/pvl_log_XXXXXX";
+    temp_file(data);
+    temp_file(log);
+    alignas(max_align_t) char backing_at[pvl_backing_sizeof(64)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char expected[1024];
+
+    // Each commit reaches the data file and empties the redo log
+    struct pvl_backing *backing;
+    struct pvl *pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 1);
+    char *main = pvl_backing_main(backing);
+    for (int i = 0; i < 20; i++) {
+        assert(span_commit(pvl, main, (size_t) (i*7) % 16, (char) (i+1)) == 0);
+        memcpy(expected, main, sizeof(expected));
+        check_backing(data, log, expected, 0);
+    }
+    memset(main, 'x', 1024);
+    assert(!pvl_mark(pvl, main, 1024));
+    assert(!pvl_commit(pvl));
+    memcpy(expected, main, sizeof(expected));
+    check_backing(data, log, expected, 0);
+    assert(pvl_backing_close(backing) == 0);
+
+    // The data file is mapped as main when reopened
+    pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 1);
+    assert(!memcmp(pvl_backing_main(backing), expected, sizeof(expected)));
+    assert(pvl_backing_close(backing) == 0);
+    check_backing(data, log, expected, 0);
+    unlink(data);
+    unlink(log);
+}
+
+void test_backing_recovery() {
+    start_test;
+    char data[] = "/tmp/pvl_data_XXXXXX";
+    char log[] = "/tmp/pvl_log_XXXXXX";
+    temp_file(data);
+    temp_file(log);
+    alignas(max_align_t) char backing_at[pvl_backing_sizeof(64)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char zeros[1024] = {0};
+    char expected[1024];
+
+    // A change that was synced to the redo log but not applied stays pending
+    struct pvl_backing *backing;
+    struct pvl *pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 0);
+    assert(span_commit(pvl, pvl_backing_main(backing), 3, 7) == 0);
+    memcpy(expected, pvl_backing_main(backing), sizeof(expected));
+    assert(pvl_backing_close(backing) == 0);
+    check_backing(data, log, zeros, 96);
+
+    // Nothing is written before it is loaded
+    pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 0);
+    assert(span_commit(pvl, pvl_backing_main(backing), 4, 8) != 0);
+    assert(pvl_backing_close(backing) == 0);
+    check_backing(data, log, zeros, 96);
+
+    // Loading replays it into main and the data file, closing recycles the redo log
+    pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 1);
+    assert(!memcmp(pvl_backing_main(backing), expected, sizeof(expected)));
+    assert(pvl_backing_close(backing) == 0);
+    check_backing(data, log, expected, 0);
+
+    // As does the first commit after the load
+    pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 0);
+    assert(span_commit(pvl, pvl_backing_main(backing), 5, 9) == 0);
+    memcpy(expected, pvl_backing_main(backing), sizeof(expected));
+    assert(pvl_backing_close(backing) == 0);
+    pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 1);
+    assert(span_commit(pvl, pvl_backing_main(backing), 6, 10) == 0);
+    memcpy(expected, pvl_backing_main(backing), sizeof(expected));
+    check_backing(data, log, expected, 0);
+    assert(pvl_backing_close(backing) == 0);
+    unlink(data);
+    unlink(log);
+}
+
+void test_backing_write_failure() {
+    start_test;
+    char data[] = "/tmp/pvl_data_XXXXXX";
+    char log[] = "/tmp/pvl_log_XXXXXX";
+    temp_file(data);
+    temp_file(log);
+    alignas(max_align_t) char backing_at[pvl_backing_sizeof(64)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char expected[1024] = {0};
+
+    // A change cut short by the file size limit is dropped from the redo log and retried
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit small = {64, limit.rlim_max};
+    signal(SIGXFSZ, SIG_IGN);
+    struct pvl_backing *backing;
+    struct pvl *pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 1);
+    char *main = pvl_backing_main(backing);
+    assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    assert(span_commit(pvl, main, 0, 1) != 0);
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    check_backing(data, log, expected, 0);
+    assert(!pvl_commit(pvl));
+    memcpy(expected, main, sizeof(expected));
+    check_backing(data, log, expected, 0);
+
+    // A change that cannot be dropped fails every later write
+    reopen_fd(log, O_RDONLY);
+    assert(span_commit(pvl, main, 1, 2) != 0);
+    reopen_fd(log, O_RDWR);
+    assert(pvl_commit(pvl) != 0);
+    assert(pvl_backing_close(backing) == 0);
+
+    // A loaded redo log that cannot be emptied fails the commit and the close
+    pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 0);
+    assert(span_commit(pvl, pvl_backing_main(backing), 2, 3) == 0);
+    assert(pvl_backing_close(backing) == 0);
+    pvl = backing_reopen(&backing, backing_at, pvl_at, data, log, 1);
+    reopen_fd(log, O_RDONLY);
+    assert(span_commit(pvl, pvl_backing_main(backing), 3, 4) != 0);
+    assert(pvl_backing_close(backing) != 0);
+    unlink(data);
+    unlink(log);
+}
+
+#define SNAPSHOT_MAIN ((size_t) 9 << 20)
+
+/* Commit value over length bytes of main at offset */
+void snapshot_commit(struct pvl *pvl, char *main, size_t offset, size_t length, char value) {
+    memset(main+offset, value, length);
+    assert(!pvl_mark(pvl, main+offset, length));
+    assert(!pvl_commit(pvl));
+}
+
+void test_snapshot_invalid() {
+    start_test;
+    alignas(max_align_t) char at[pvl_snapshot_sizeof() + 1];
+    char long_path[PATH_MAX] = {0};
+    memset(long_path, 'a', sizeof(long_path) - 1);
+    assert(pvl_snapshot_init(at+1, "/tmp/snapshot") == NULL);
+    assert(pvl_snapshot_init(at, NULL) == NULL);
+    assert(pvl_snapshot_init(at, "") == NULL);
+    assert(pvl_snapshot_init(at, long_path) == NULL);
+    assert(pvl_snapshot_init(at, "snapshot") != NULL);
+    assert(pvl_snapshot_init(at, "/snapshot") != NULL);
+
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    struct pvl *pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    struct pvl_snapshot *snapshot = pvl_snapshot_init(at, "/tmp/snapshot");
+    assert(snapshot != NULL);
+    assert(pvl_snapshot_start(NULL, pvl, main, sizeof(main), 0) != 0);
+    assert(pvl_snapshot_start(snapshot, NULL, main, sizeof(main), 0) != 0);
+    assert(pvl_snapshot_start(snapshot, pvl, NULL, sizeof(main), 0) != 0);
+    assert(pvl_snapshot_start(snapshot, pvl, main, 0, 0) != 0);
+    assert(pvl_snapshot_busy(NULL) == 0);
+    assert(pvl_snapshot_busy(snapshot) == 0);
+    assert(pvl_snapshot_wait(NULL) != 0);
+    assert(pvl_snapshot_wait(snapshot) == 0);
+
+    // Nothing is forked when the pending changes cannot be committed
+    char path[] = "/tmp/pvl_journal_XXXXXX";
+    temp_file(path);
+    struct pvl_journal_config config = {fopen(path, "r")};
+    assert(config.destination != NULL);
+    assert(pvl_set_write_cb(pvl, &config, pvl_journal_write) == 0);
+    assert(!pvl_mark(pvl, main, 64));
+    assert(pvl_snapshot_start(snapshot, pvl, main, sizeof(main), 0) != 0);
+    assert(pvl_snapshot_busy(snapshot) == 0);
+    fclose(config.destination);
+    unlink(path);
+
+    uint64_t position;
+    assert(pvl_snapshot_load(NULL, main, sizeof(main), &position) != 0);
+    assert(pvl_snapshot_load(path, NULL, sizeof(main), &position) != 0);
+    assert(pvl_snapshot_load(path, main, sizeof(main), NULL) != 0);
+    assert(pvl_snapshot_load(path, main, sizeof(main), &position) != 0);
+}
+
+void test_snapshot_round_trip() {
+    start_test;
+    char directory[] = "/tmp/pvl_snapshot_XXXXXX";
+    temp_dir(directory);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/snapshot", directory);
+    alignas(max_align_t) char at[pvl_snapshot_sizeof()];
+    char *pvl_at = malloc(pvl_sizeof(144));
+    char *main = calloc(1, SNAPSHOT_MAIN);
+    char *loaded = malloc(SNAPSHOT_MAIN);
+    char *expected = malloc(SNAPSHOT_MAIN);
+    assert((pvl_at != NULL) && (main != NULL) && (loaded != NULL) && (expected != NULL));
+    struct pvl_journal_config config = {tmpfile()};
+    assert(config.destination != NULL);
+    struct pvl *pvl = pvl_init(pvl_at, main, SNAPSHOT_MAIN, 144);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, &config, pvl_journal_write) == 0);
+    snapshot_commit(pvl, main, 0, 4096, 1);
+    uint64_t position = (uint64_t) ftell(config.destination);
+
+    // The change marked before starting is committed after the position and held by the snapshot
+    struct pvl_snapshot *snapshot = pvl_snapshot_init(at, path);
+    assert(snapshot != NULL);
+    memset(main + SNAPSHOT_MAIN - 4096, 2, 4096);
+    assert(!pvl_mark(pvl, main + SNAPSHOT_MAIN - 4096, 4096));
+    assert(pvl_snapshot_start(snapshot, pvl, main, SNAPSHOT_MAIN, position) == 0);
+    memcpy(expected, main, SNAPSHOT_MAIN);
+
+    // Commits after the fork are not
+    snapshot_commit(pvl, main, 4096, 4096, 3);
+    assert(pvl_snapshot_wait(snapshot) == 0);
+    assert(pvl_snapshot_busy(snapshot) == 0);
+    assert(pvl_snapshot_wait(snapshot) == 0);
+    uint64_t loaded_position = 0;
+    assert(pvl_snapshot_load(path, loaded, SNAPSHOT_MAIN, &loaded_position) == 0);
+    assert(loaded_position == position);
+    assert(!memcmp(loaded, expected, SNAPSHOT_MAIN));
+
+    // Replaying the journal from the position catches up with main
+    assert(fseek(config.destination, (long) position, SEEK_SET) == 0);
+    pvl = pvl_init(pvl_at, loaded, SNAPSHOT_MAIN, 144);
+    assert(pvl != NULL);
+    assert(pvl_set_read_cb(pvl, &config, pvl_journal_read) == 0);
+    assert(!memcmp(loaded, main, SNAPSHOT_MAIN));
+
+    // A snapshot of another length, with a different magic or cut short is rejected
+    assert(pvl_snapshot_load(path, loaded, SNAPSHOT_MAIN - 4096, &loaded_position) != 0);
+    assert(truncate(path, SNAPSHOT_MAIN) == 0);
+    assert(pvl_snapshot_load(path, loaded, SNAPSHOT_MAIN, &loaded_position) != 0);
+    FILE *file = fopen(path, "r+");
+    assert((file != NULL) && (fwrite("pvlsnap0", 8, 1, file) == 1) && (fclose(file) == 0));
+    assert(pvl_snapshot_load(path, loaded, SNAPSHOT_MAIN, &loaded_position) != 0);
+    assert(truncate(path, 8) == 0);
+    assert(pvl_snapshot_load(path, loaded, SNAPSHOT_MAIN, &loaded_position) != 0);
+    assert(loaded_position == position);
+    fclose(config.destination);
+    remove_dir(directory);
+    free(expected);
+    free(loaded);
+    free(main);
+    free(pvl_at);
+}
+
+void test_snapshot_failure() {
+    start_test;
+    char directory[] = "/tmp/pvl_snapshot_XXXXXX";
+    temp_dir(directory);
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/snapshot", directory);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/snapshot.tmp", directory);
+    alignas(max_align_t) char at[pvl_snapshot_sizeof()];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    /* larger than a pipe buffer so that the child blocks writing it to a fifo */
+    size_t length = (size_t) 1 << 20;
+    char *main = malloc(length);
+    char *bytes = malloc(24 + length);
+    assert((main != NULL) && (bytes != NULL));
+    memset(main, 1, length);
+    struct pvl *pvl = pvl_init(pvl_at, main, length, 16);
+    assert(pvl != NULL);
+    uint64_t position = 0;
+
+    // The child fails to create the snapshot next to a missing path
+    struct pvl_snapshot *snapshot = pvl_snapshot_init(at, "/nonexistent/snapshot");
+    assert(snapshot != NULL);
+    assert(pvl_snapshot_start(snapshot, pvl, main, length, 0) == 0);
+    assert(pvl_snapshot_wait(snapshot) != 0);
+
+    // Or to write it to a fifo that is closed by its reader
+    snapshot = pvl_snapshot_init(at, path);
+    assert(snapshot != NULL);
+    assert(mkfifo(tmp_path, 0600) == 0);
+    signal(SIGPIPE, SIG_IGN);
+    assert(pvl_snapshot_start(snapshot, pvl, main, length, 0) == 0);
+    signal(SIGPIPE, SIG_DFL);
+    int fd = open(tmp_path, O_RDONLY);
+    assert((fd >= 0) && (close(fd) == 0));
+    assert(pvl_snapshot_wait(snapshot) != 0);
+    assert(access(tmp_path, F_OK) != 0);
+
+    // Or to rename it over a directory
+    assert(mkdir(path, 0700) == 0);
+    char inner[PATH_MAX];
+    snprintf(inner, sizeof(inner), "%s/snapshot/inner", directory);
+    assert(mkdir(inner, 0700) == 0);
+    assert(pvl_snapshot_start(snapshot, pvl, main, length, 0) == 0);
+    assert(pvl_snapshot_wait(snapshot) != 0);
+    assert(access(tmp_path, F_OK) != 0);
+    assert((rmdir(inner) == 0) && (rmdir(path) == 0));
+
+    // A snapshot is busy until its child exits, which a fifo holds up until read
+    assert(mkfifo(tmp_path, 0600) == 0);
+    assert(pvl_snapshot_start(snapshot, pvl, main, length, 7) == 0);
+    assert(pvl_snapshot_busy(snapshot) != 0);
+    assert(pvl_snapshot_start(snapshot, pvl, main, length, 8) != 0);
+    fd = open(tmp_path, O_RDONLY);
+    assert(fd >= 0);
+    size_t read_bytes = 0;
+    for (ssize_t done = 1; done > 0; read_bytes += (size_t) done) {
+        done = read(fd, bytes + read_bytes, 24 + length - read_bytes);
+        assert(done >= 0);
+    }
+    assert(close(fd) == 0);
+    assert(read_bytes == 24 + length);
+    assert(!memcmp(bytes, "pvlsnap1", 8) && !memcmp(bytes + 24, main, length));
+    while (pvl_snapshot_busy(snapshot));
+    assert(pvl_snapshot_wait(snapshot) != 0); /* a fifo cannot be synced */
+
+    // A child that is reaped elsewhere fails the snapshot
+    assert(pvl_snapshot_start(snapshot, pvl, main, length, 9) == 0);
+    int status = 0;
+    assert(wait(&status) > 0);
+    assert(pvl_snapshot_wait(snapshot) != 0);
+    assert(pvl_snapshot_load(path, main, length, &position) == 0);
+    assert(position == 9);
+    remove_dir(directory);
+    free(bytes);
+    free(main);
+}
+
+/* Load the stream of a follower into a fresh instance over replicated, returns the load result */
+int follower_load(struct pvl_follower *follower, char *pvl_at, char *replicated) {
+    memset(replicated, 0, 1024);
+    struct pvl *pvl = pvl_init(pvl_at, replicated, 1024, 16);
+    assert(pvl != NULL);
+    return pvl_set_read_cb(pvl, follower, pvl_follower_read);
+}
+
+void test_replica_invalid() {
+    start_test;
+    alignas(max_align_t) char at[pvl_replica_sizeof(1) + 1];
+    assert(pvl_replica_init(at+1, 1, NULL, NULL) == NULL);
+    assert(pvl_replica_init(at, 0, NULL, NULL) == NULL);
+    struct pvl_replica *replica = pvl_replica_init(at, 1, NULL, NULL);
+    assert(replica != NULL);
+    assert(pvl_replica_add(NULL, 0, 0) != 0);
+    assert(pvl_replica_add(replica, -1, 0) != 0);
+    assert(pvl_replica_add(replica, 0, -1) != 0);
+    assert(pvl_replica_close(NULL) != 0);
+    char bytes[16] = {0};
+    assert(pvl_replica_write(NULL, bytes, sizeof(bytes), 0) != 0);
+    assert(pvl_replica_write(replica, NULL, sizeof(bytes), 0) != 0);
+    assert(pvl_replica_write(replica, bytes, 0, 0) != 0);
+    assert(pvl_replica_sequence(NULL) == 0);
+    assert(pvl_replica_wait(NULL, 0, 0, 0) != 0);
+
+    // Followers are added at change boundaries, up to the capacity
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert(pvl_replica_write(replica, bytes, sizeof(bytes), 8) == 0);
+    assert(pvl_replica_add(replica, sv[0], sv[0]) != 0);
+    assert(pvl_replica_write(replica, bytes, 8, 0) == 0);
+    assert(pvl_replica_sequence(replica) == 1);
+    assert(pvl_replica_add(replica, sv[0], sv[0]) == 0);
+    assert(pvl_replica_add(replica, sv[1], sv[1]) != 0);
+    assert(pvl_replica_wait(replica, 1, 1, 0) == 0);
+    assert(pvl_replica_close(replica) == 0);
+    assert(pvl_replica_close(replica) == 0);
+    assert(close(sv[1]) == 0);
+
+    alignas(max_align_t) char follower_at[pvl_follower_sizeof(8) + 1];
+    assert(pvl_follower_init(follower_at+1, 0, 0, 8, 0) == NULL);
+    assert(pvl_follower_init(follower_at, -1, 0, 8, 0) == NULL);
+    assert(pvl_follower_init(follower_at, 0, -1, 8, 0) == NULL);
+    assert(pvl_follower_init(follower_at, 0, 0, 0, 0) == NULL);
+    assert(pvl_follower_read(NULL, bytes, 8, 0) != 0);
+    assert(pvl_follower_sequence(NULL) == 0);
+
+    // Content is read from the received change only as far as it goes
+    int stream[2];
+    assert(pipe(stream) == 0);
+    assert(write(stream[1], bytes, 8) == 8);
+    assert(close(stream[1]) == 0);
+    struct pvl_follower *follower = pvl_follower_init(follower_at, stream[0], stream[0], 8, 0);
+    assert(follower != NULL);
+    assert(pvl_follower_read(follower, NULL, 0, 8) == 0);
+    assert(pvl_follower_read(follower, bytes, 16, 0) != 0);
+    assert(pvl_follower_read(follower, bytes, 8, 0) == 0);
+    assert(pvl_follower_read(follower, bytes, 16, 0) == EOF);
+    assert(pvl_follower_sequence(follower) == 0);
+    assert(close(stream[0]) == 0);
+}
+
+void test_replica_stream() {
+    start_test;
+    alignas(max_align_t) char replica_at[pvl_replica_sizeof(3)];
+    alignas(max_align_t) char follower_at[pvl_follower_sizeof(1024)];
+    alignas(max_align_t) char pvl_at[pvl_sizeof(16)];
+    alignas(max_align_t) char follower_pvl_at[pvl_sizeof(16)];
+    char main[1024] = {0};
+    char replicated[1024];
+    int sv[2], tv[2], stream[2], acks[2];
+    assert((socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) && (socketpair(AF_UNIX, SOCK_STREAM, 0, tv) == 0));
+    assert((pipe(stream) == 0) && (pipe(acks) == 0));
+    struct pvl_journal_config config = {tmpfile()};
+    assert(config.destination != NULL);
+
+    // The primary tees each commit to its journal and to a socket, a pipe and another socket follower
+    struct pvl_replica *replica = pvl_replica_init(replica_at, 3, &config, pvl_journal_write);
+    assert(replica != NULL);
+    assert(pvl_replica_add(replica, sv[0], sv[0]) == 0);
+    assert(pvl_replica_add(replica, stream[1], acks[0]) == 0);
+    assert(pvl_replica_add(replica, tv[0], tv[0]) == 0);
+    struct pvl *pvl = pvl_init(pvl_at, main, sizeof(main), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_write_cb(pvl, replica, pvl_replica_write) == 0);
+    for (int i = 0; i < 3; i++) {
+        assert(span_commit(pvl, main, (size_t) i*5, (char) (i+1)) == 0);
+    }
+    assert(pvl_replica_sequence(replica) == 3);
+    assert(pvl_replica_wait(replica, 3, 1, 10) != 0);
+
+    // The socket follower applies them until the stream ends, acknowledging each
+    assert(shutdown(sv[0], SHUT_WR) == 0);
+    struct pvl_follower *follower = pvl_follower_init(follower_at, sv[1], sv[1], 1024, 0);
+    assert(follower != NULL);
+    assert(follower_load(follower, follower_pvl_at, replicated) == 0);
+    assert(!memcmp(replicated, main, sizeof(main)));
+    assert(pvl_follower_sequence(follower) == 3);
+    assert(pvl_replica_wait(replica, 3, 1, -1) == 0);
+
+    // A follower that closes its end is dropped while waiting
+    assert(close(tv[1]) == 0);
+    assert(pvl_replica_wait(replica, 3, 3, -1) != 0);
+
+    // As is one that cannot be sent to, the rest keep receiving changes
+    assert(span_commit(pvl, main, 15, 4) == 0);
+    assert(pvl_replica_wait(replica, 4, 1, 0) != 0);
+    assert(pvl_replica_close(replica) == 0);
+    assert(close(sv[1]) == 0);
+
+    // The pipe follower applies all of them, even though its acknowledgements fail
+    signal(SIGPIPE, SIG_IGN);
+    follower = pvl_follower_init(follower_at, stream[0], acks[1], 1024, 0);
+    assert(follower != NULL);
+    assert(follower_load(follower, follower_pvl_at, replicated) == 0);
+    signal(SIGPIPE, SIG_DFL);
+    assert(!memcmp(replicated, main, sizeof(main)));
+    assert(pvl_follower_sequence(follower) == 4);
+    assert((close(stream[0]) == 0) && (close(acks[1]) == 0));
+
+    // And so does the journal
+    rewind(config.destination);
+    pvl = pvl_init(follower_pvl_at, replicated, sizeof(replicated), 16);
+    assert(pvl != NULL);
+    assert(pvl_set_read_cb(pvl, &config, pvl_journal_read) == 0);
+    assert(!memcmp(replicated, main, sizeof(main)));
+    fclose(config.destination);
+}
+
+void test_replica_failure() {
+    start_test;
+    alignas(max_align_t) char replica_at[pvl_replica_sizeof(2)];
+    alignas(max_align_t) char follower_at[pvl_follower_sizeof(1024)];
+    alignas(max_align_t) char follower_pvl_at[pvl_sizeof(16)];
+    char replicated[1024];
+    test_ctx ctx = {0};
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    int sv[2];
+
+    // A change larger than the follower buffer ends its load without applying it
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    struct pvl_replica *replica = pvl_replica_init(replica_at, 1, NULL, NULL);
+    assert(replica != NULL);
+    assert(pvl_replica_add(replica, sv[0], sv[0]) == 0);
+    assert(pvl_set_write_cb(ctx.pvl, replica, pvl_replica_write) == 0);
+    memset(ctx.main, 1, CTX_BUFFER_SIZE);
+    assert(!pvl_mark(ctx.pvl, ctx.main, CTX_BUFFER_SIZE));
+    assert(!pvl_commit(ctx.pvl));
+    assert(shutdown(sv[0], SHUT_WR) == 0);
+    struct pvl_follower *follower = pvl_follower_init(follower_at, sv[1], sv[1], 64, 0);
+    assert(follower != NULL);
+    assert((follower_load(follower, follower_pvl_at, replicated) == 0) && (replicated[0] == 0));
+    assert(pvl_follower_sequence(follower) == 0);
+    assert(pvl_replica_close(replica) == 0);
+    assert(close(sv[1]) == 0);
+
+    // So does a stream that ends part way through a change
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    replica = pvl_replica_init(replica_at, 1, NULL, NULL);
+    assert(replica != NULL);
+    assert(pvl_replica_add(replica, sv[0], sv[0]) == 0);
+    size_t header[2] = {1, 80};
+    assert(pvl_replica_write(replica, header, sizeof(header), 80) == 0);
+    assert(pvl_replica_write(replica, ctx.main, 40, 40) == 0);
+    assert(shutdown(sv[0], SHUT_WR) == 0);
+    follower = pvl_follower_init(follower_at, sv[1], sv[1], 1024, 0);
+    assert(follower != NULL);
+    assert((follower_load(follower, follower_pvl_at, replicated) == 0) && (replicated[0] == 0));
+    assert(pvl_replica_close(replica) == 0);
+    assert(close(sv[1]) == 0);
+
+    // Or a stream that cannot be read
+    int stream[2];
+    assert(pipe(stream) == 0);
+    follower = pvl_follower_init(follower_at, stream[1], stream[1], 1024, 0);
+    assert(follower != NULL);
+    assert((follower_load(follower, follower_pvl_at, replicated) == 0) && (replicated[0] == 0));
+    assert((close(stream[0]) == 0) && (close(stream[1]) == 0));
+
+    // A journal failure at the start of a change keeps the followers
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    replica = pvl_replica_init(replica_at, 1, &ctx, limited_write_cb);
+    assert(replica != NULL);
+    assert(pvl_replica_add(replica, sv[0], sv[0]) == 0);
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, replica, pvl_replica_write) == 0);
+    memset(ctx.main, 0, CTX_BUFFER_SIZE);
+    assert(span_commit(ctx.pvl, ctx.main, 0, 1) != 0);
+    assert(pvl_replica_wait(replica, 0, 1, 0) == 0);
+
+    // One part way through drops them all, they are added again to resync
+    ctx.iobuf_len = 2*sizeof(size_t);
+    assert(pvl_commit(ctx.pvl) != 0);
+    assert(pvl_replica_wait(replica, 0, 1, 0) != 0);
+    follower = pvl_follower_init(follower_at, sv[1], sv[1], 1024, 0);
+    assert(follower != NULL);
+    assert((follower_load(follower, follower_pvl_at, replicated) == 0) && (replicated[0] == 0));
+    assert(close(sv[1]) == 0);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert(pvl_replica_add(replica, sv[0], sv[0]) == 0);
+    ctx.iobuf_pos = 0;
+    ctx.iobuf_len = CTX_BUFFER_SIZE;
+    assert(pvl_commit(ctx.pvl) == 0);
+    assert(shutdown(sv[0], SHUT_WR) == 0);
+    follower = pvl_follower_init(follower_at, sv[1], sv[1], 1024, 0);
+    assert(follower != NULL);
+    assert(follower_load(follower, follower_pvl_at, replicated) == 0);
+    assert(!memcmp(replicated, ctx.main, CTX_BUFFER_SIZE));
+    assert(pvl_replica_close(replica) == 0);
+    assert(close(sv[1]) == 0);
+
+    // A follower whose acknowledgements cannot be read is dropped
+    int acks[2];
+    assert((socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) && (pipe(acks) == 0));
+    assert(close(acks[0]) == 0);
+    replica = pvl_replica_init(replica_at, 2, NULL, NULL);
+    assert(replica != NULL);
+    assert(pvl_replica_add(replica, sv[0], acks[1]) == 0);
+    ctx.pvl = pvl_init(ctx.pvl_at, ctx.main, CTX_BUFFER_SIZE, 16);
+    assert(ctx.pvl != NULL);
+    assert(pvl_set_write_cb(ctx.pvl, replica, pvl_replica_write) == 0);
+    assert(span_commit(ctx.pvl, ctx.main, 1, 2) == 0);
+    assert(pvl_replica_wait(replica, 1, 1, -1) != 0);
+    assert(close(sv[1]) == 0);
+
+    // Waiting fails when the followers cannot be polled
+    int tv[2];
+    assert((socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) && (socketpair(AF_UNIX, SOCK_STREAM, 0, tv) == 0));
+    assert(pvl_replica_add(replica, sv[0], sv[0]) == 0);
+    assert(pvl_replica_add(replica, tv[0], tv[0]) == 0);
+    assert(span_commit(ctx.pvl, ctx.main, 2, 3) == 0);
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    struct rlimit small = {1, limit.rlim_max};
+    assert(setrlimit(RLIMIT_NOFILE, &small) == 0);
+    assert(pvl_replica_wait(replica, 2, 2, -1) != 0);
+    assert(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+    assert(pvl_replica_close(replica) == 0);
+    assert((close(sv[1]) == 0) && (close(tv[1]) == 0));
+}
+
+int main() {
+    {
+        test_init_misalignment();
+        test_init_alignment();
+        test_init_zero_marks();
+        test_init_null_main();
+        test_init_non_null_main();
+        test_init_zero_length();
+        test_init_non_zero_length();
+        test_init_non_divisible_spans();
+        test_init_main_mirror_overlap();
+        test_init_main_mirror_no_overlap();
+        test_init_mirror_main_overlap();
+        test_init_mirror_main_no_overlap();
+
+        test_mark_pvl_null();
+        test_mark_mark_null();
+        test_mark_zero_length();
+        test_mark_before_main();
+        test_mark_mark_main_overlap();
+        test_mark_main_mark_overlap();
+        test_mark_after_main();
+        test_mark_start_of_main();
+        test_mark_middle_of_main();
+        test_mark_end_of_main();
+        test_mark_all_of_main();
+        test_mark_extra_marks();
+
+        test_commit_pvl_null();
+        test_commit_no_mark();
+        test_commit_single_mark();
+        test_commit_max_marks();
+        test_commit_over_max_marks();
+
+        test_set_read_cb_null_pvl();
+        test_set_write_cb_null_pvl();
+        test_set_mirror_null_pvl();
+        test_set_leak_cb_null_pvl();
+
+        test_set_read_cb_twice();
+        test_set_write_cb_twice();
+        test_set_mirror_twice();
+        test_set_leak_cb_twice();
+
+		test_init_leak_no_mirror();
+    }
+
+    {
+        test_basic_commit();
+        test_basic_commit_mirror();
+
+        test_read_failure_01();
+        test_read_failure_02();
+
+        test_read_partial_failure_01();
+        test_read_partial_failure_02();
+
+        test_write_no_marks();
+
+        test_write_failure_01();
+        test_write_failure_02();
+        test_write_failure_03();
+
+        test_invalid_change_header_01();
+        test_invalid_change_header_02();
+        test_invalid_change_header_03();
+        test_invalid_change_header_04();
+
+        test_invalid_span_header_01();
+        test_invalid_span_header_02();
+        test_invalid_span_header_03();
+        test_mark_span_boundary();
+        test_commit_clears_spans();
+        test_load_span_at_end();
+        test_write_remaining_hint();
+    }
+
+    {
+        test_leak_detected();
+        test_leak_no_leak();
+        test_leak_range_tail();
+    }
+
+    {
+        test_extents_set_invalid();
+        test_extents_commit();
+        test_extents_over_capacity();
+        test_extents_leak_detected();
+    }
+
+    {
+        test_coalesce_set_invalid();
+        test_coalesce_spans();
+        test_coalesce_extents();
+        test_coalesce_compact();
+    }
+
+    {
+        test_compact_set_invalid();
+        test_compact_spans();
+        test_compact_extents();
+        test_compact_invalid_tag();
+        test_compact_invalid_flags();
+        test_compact_invalid_delta();
+        test_compact_invalid_length();
+        test_compact_invalid_header();
+
+        test_fill_records();
+        test_fill_short_word();
+        test_fill_invalid_flags();
+        test_fill_invalid_pattern();
+        test_fill_read_failure();
+    }
+
+    {
+        test_add_region_invalid();
+        test_regions_mark();
+        test_regions_commit();
+        test_regions_compact_extents();
+        test_regions_compact_extents_fill();
+        test_regions_invalid_span();
+        test_regions_span_after_end();
+    }
+
+    {
+        test_mark_many_invalid();
+        test_mark_many_merge();
+        test_mark_many_extents();
+
+        test_view_invalid();
+        test_view_mark();
+    }
+
+    {
+        test_stats_invalid();
+        test_stats_counters();
+
+        test_trace_set_invalid();
+        test_trace_phases();
+
+        test_analysis_set_invalid();
+        test_analysis_advise();
+        test_analysis_uneven_length();
+
+        test_heatmap_invalid();
+        test_heatmap_counts();
+        test_heatmap_extents();
+    }
+
+    {
+        test_shards_invalid();
+        test_shards_commit();
+        test_shards_write_failure();
+    }
+
+    {
+        test_auto_commit_invalid();
+        test_auto_commit_dirty();
+        test_auto_commit_age();
+
+        test_flusher_invalid();
+        test_flusher_commit();
+        test_flusher_group();
+        test_flusher_failure();
+
+        test_restore_invalid();
+        test_restore_spans();
+
+        test_load_buffer_invalid();
+        test_load_buffer_changes();
+
+        test_apply_invalid();
+        test_apply_spans();
+
+        test_poll_invalid();
+        test_poll_changes();
+    }
+
+    {
+        test_journal_invalid();
+        test_journal_changes();
+        test_journal_pipe();
+    }
+
+    {
+        test_lazy_invalid();
+        test_lazy_index();
+        if (lazy_available()) {
+            test_lazy_read_failure();
+            test_lazy_load();
+        }
+    }
+
+    {
+        test_direct_invalid();
+        test_direct_round_trip();
+        test_direct_full_staging();
+        test_direct_torn_change();
+        test_direct_write_failure();
+    }
+
+    {
+        test_segment_invalid();
+        test_segment_rotation();
+        test_segment_resume();
+        test_segment_truncated_read();
+        test_segment_trim();
+        test_segment_write_failure();
+    }
+
+    {
+        test_mapped_invalid();
+        test_mapped_append();
+        test_mapped_write_failure();
+    }
+    {
+        test_backing_invalid();
+        test_backing_commits();
+        test_backing_recovery();
+        test_backing_write_failure();
+    }
+    {
+        test_snapshot_invalid();
+        test_snapshot_round_trip();
+        test_snapshot_failure();
+    }
+    {
+        test_replica_invalid();
+        test_replica_stream();
+        test_replica_failure();
+    }
+
+    if (uring_available()) {
+        test_uring_invalid();
+        test_uring_commits();
+        test_uring_failure();
     }
 
     {
 		test_bitset_basic();
 		test_bitset_range();
+		test_bitset_clear_range_bounds();
 	}
 
 	{
@@ -0,0 +1,354 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * io_uring journal writer for libpvl (Linux, implementation)
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/* How long an idle submission queue polling thread keeps polling, in milliseconds */
+#define PVL_URING_SQ_IDLE 1000
+
+/* Completions of fdatasync carry this bit in their user data, writes carry the slot index */
+#define PVL_URING_SYNC 0x01u
+
+struct pvl_uring_slot {
+	size_t length;
+	_Bool busy; /* queued or in flight */
+};
+
+struct pvl_uring {
+	int fd;
+	int ring_fd;
+	unsigned int flags;
+	size_t depth;
+	size_t staging_size;
+	unsigned char *staging;
+	/* submission queue, tail is published once a chain is complete */
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_flags;
+	unsigned int *sq_array;
+	unsigned int sq_local;
+	unsigned int queued;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	/* completion queue, in the same mapping */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* the slot being filled and the journal offset of the next write */
+	size_t next;
+	size_t fill;
+	size_t busy;
+	off_t offset;
+	_Bool in_change;
+	/* commits are durable in order, done flags are kept per commit modulo depth */
+	uint64_t commits;
+	uint64_t durable;
+	int failed;
+	_Bool *done;
+	struct pvl_uring_slot slots[];
+};
+
+static void pvl_uring_release(struct pvl_uring *uring);
+static void pvl_uring_enter(struct pvl_uring *uring, unsigned int min_complete);
+static struct io_uring_sqe *pvl_uring_sqe(struct pvl_uring *uring);
+static void pvl_uring_publish(struct pvl_uring *uring);
+static void pvl_uring_reap(struct pvl_uring *uring);
+static void pvl_uring_wait(struct pvl_uring *uring);
+static void pvl_uring_queue_write(struct pvl_uring *uring);
+
+size_t pvl_uring_sizeof(size_t depth, size_t staging_size) {
+	/* Slots, done flags and the staging area aligned to the page size */
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	return sizeof(struct pvl_uring) + (depth * (sizeof(struct pvl_uring_slot) + sizeof(_Bool)))
+		+ (depth * staging_size) + page_size;
+}
+
+struct pvl_uring *pvl_uring_open(char *at, int fd, size_t depth, size_t staging_size, unsigned int flags) {
+	/* Check for alignment */
+	if (((uintptr_t) at) % alignof(max_align_t)) {
+		return NULL;
+	}
+	if ((fd < 0) || (depth == 0) || (staging_size == 0) || (flags & ~(PVL_URING_SQPOLL | PVL_URING_FIXED))) {
+		return NULL;
+	}
+
+	struct pvl_uring *uring = (struct pvl_uring*) at;
+	memset(uring, 0, sizeof(struct pvl_uring) + (depth * sizeof(struct pvl_uring_slot)));
+	uring->fd = fd;
+	uring->flags = flags;
+	uring->depth = depth;
+	uring->staging_size = staging_size;
+	uring->done = (_Bool*) &uring->slots[depth];
+	memset(uring->done, 0, depth * sizeof(_Bool));
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	uintptr_t staging = (uintptr_t) &uring->done[depth];
+	uring->staging = (unsigned char*) (staging + ((page_size - (staging % page_size)) % page_size));
+	uring->sq_ptr = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+
+	uring->offset = lseek(fd, 0, SEEK_END);
+	if (uring->offset < 0) {
+		return NULL;
+	}
+
+	/* Each slot takes a write and each commit an fdatasync */
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	if (flags & PVL_URING_SQPOLL) {
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = PVL_URING_SQ_IDLE;
+	}
+	uring->ring_fd = (int) syscall(__NR_io_uring_setup, (unsigned int) (2 * depth), &params);
+	if (uring->ring_fd >= 0) {
+		/* IORING_OP_WRITE needs Linux 5.6, which maps both rings at once (IORING_FEAT_SINGLE_MMAP) */
+		size_t sq_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+		size_t cq_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+		uring->sq_size = (sq_size > cq_size) ? sq_size : cq_size;
+		uring->sq_ptr = mmap(NULL, uring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				uring->ring_fd, IORING_OFF_SQ_RING);
+		uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+		uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				uring->ring_fd, IORING_OFF_SQES);
+	}
+	struct iovec iov = {.iov_base = uring->staging, .iov_len = depth * staging_size};
+	if ((uring->ring_fd < 0) || (uring->sq_ptr == MAP_FAILED) || (uring->sqes == MAP_FAILED)
+			|| ((flags & PVL_URING_FIXED)
+				&& (syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0))) {
+		pvl_uring_release(uring);
+		return NULL;
+	}
+
+	char *sq = (char*) uring->sq_ptr;
+	uring->sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+	uring->sq_mask = (unsigned int*) (sq + params.sq_off.ring_mask);
+	uring->sq_flags = (unsigned int*) (sq + params.sq_off.flags);
+	uring->sq_array = (unsigned int*) (sq + params.sq_off.array);
+	uring->sq_local = *uring->sq_tail;
+	uring->cq_head = (unsigned int*) (sq + params.cq_off.head);
+	uring->cq_tail = (unsigned int*) (sq + params.cq_off.tail);
+	uring->cq_mask = (unsigned int*) (sq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe*) (sq + params.cq_off.cqes);
+	return uring;
+}
+
+int pvl_uring_write(void *ctx, void *from, size_t length, size_t remaining) {
+	if ((ctx == NULL) || (from == NULL) || (length == 0)) {
+		return 1;
+	}
+	struct pvl_uring *uring = (struct pvl_uring*)(ctx);
+	pvl_uring_reap(uring);
+
+	/* Bound the commits in flight by the done flags */
+	while ((! uring->in_change) && (! uring->failed) && ((uring->commits - uring->durable) >= uring->depth)) {
+		pvl_uring_wait(uring);
+	}
+	if (uring->failed) {
+		return 1;
+	}
+	uring->in_change = 1;
+
+	const unsigned char *bytes = (const unsigned char*) from;
+	while (length && (! uring->failed)) {
+		struct pvl_uring_slot *slot = &uring->slots[uring->next];
+		if (slot->busy) {
+			/* The change wraps around the slots - submit it so far and let it complete,
+			   so that its fdatasync is still ordered after all of its writes */
+			pvl_uring_publish(uring);
+			while ((! uring->failed) && uring->busy) {
+				pvl_uring_wait(uring);
+			}
+			continue;
+		}
+		size_t chunk = uring->staging_size - uring->fill;
+		if (chunk > length) {
+			chunk = length;
+		}
+		memcpy(uring->staging + (uring->next * uring->staging_size) + uring->fill, bytes, chunk);
+		uring->fill += chunk;
+		bytes += chunk;
+		length -= chunk;
+		if (uring->fill == uring->staging_size) {
+			pvl_uring_queue_write(uring);
+		}
+	}
+	if (uring->failed) {
+		return 1;
+	}
+	if (remaining) {
+		return 0;
+	}
+
+	/* Close the chain with an fdatasync and submit it without waiting */
+	if (uring->fill) {
+		pvl_uring_queue_write(uring);
+	}
+	struct io_uring_sqe *sqe = pvl_uring_sqe(uring);
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = uring->fd;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	sqe->user_data = (uring->commits << 1) | PVL_URING_SYNC;
+	uring->sq_local++;
+	uring->queued++;
+	uring->commits++;
+	uring->in_change = 0;
+	pvl_uring_publish(uring);
+	return uring->failed;
+}
+
+uint64_t pvl_uring_durable(struct pvl_uring *uring) {
+	if (uring == NULL) {
+		return 0;
+	}
+	pvl_uring_reap(uring);
+	return uring->durable;
+}
+
+int pvl_uring_sync(struct pvl_uring *uring) {
+	if (uring == NULL) {
+		return 1;
+	}
+	pvl_uring_reap(uring);
+	while ((! uring->failed) && ((uring->durable < uring->commits) || uring->busy)) {
+		pvl_uring_wait(uring);
+	}
+	return uring->failed;
+}
+
+int pvl_uring_close(struct pvl_uring *uring) {
+	if (uring == NULL) {
+		return 1;
+	}
+	int result = pvl_uring_sync(uring);
+	pvl_uring_release(uring);
+	return result;
+}
+
+static void pvl_uring_release(struct pvl_uring *uring) {
+	if (uring->sqes != MAP_FAILED) {
+		munmap(uring->sqes, uring->sqes_size);
+	}
+	if (uring->sq_ptr != MAP_FAILED) {
+		munmap(uring->sq_ptr, uring->sq_size);
+	}
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+	}
+}
+
+/* Submit the published entries and optionally wait for completions, a failure is sticky */
+static void pvl_uring_enter(struct pvl_uring *uring, unsigned int min_complete) {
+	unsigned int to_submit = uring->queued;
+	unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	if (uring->flags & PVL_URING_SQPOLL) {
+		/* The polling thread submits on its own and only needs waking up once idle */
+		to_submit = 0;
+		uring->queued = 0;
+		flags |= (__atomic_load_n(uring->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+			? IORING_ENTER_SQ_WAKEUP : 0;
+		if (flags == 0) {
+			return;
+		}
+	}
+	/* Interrupted calls are retried by the waiting loops and by the next submission */
+	long result = syscall(__NR_io_uring_enter, uring->ring_fd, to_submit, min_complete, flags, NULL, 0);
+	uring->failed |= (result < 0) & (errno != EINTR);
+	uring->queued -= (result > 0) ? (unsigned int) result : 0;
+}
+
+/*
+ * Returns a cleared submission queue entry at the unpublished tail. The queue
+ * has room for a write per slot and an fdatasync per commit in flight, so it
+ * cannot be full even with a polling thread that is behind.
+ */
+static struct io_uring_sqe *pvl_uring_sqe(struct pvl_uring *uring) {
+	unsigned int index = uring->sq_local & *uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	uring->sq_array[index] = index;
+	return sqe;
+}
+
+/* Make the queued entries visible to the kernel and submit them */
+static void pvl_uring_publish(struct pvl_uring *uring) {
+	__atomic_store_n(uring->sq_tail, uring->sq_local, __ATOMIC_RELEASE);
+	pvl_uring_enter(uring, 0);
+}
+
+static void pvl_uring_reap(struct pvl_uring *uring) {
+	unsigned int head = *uring->cq_head;
+	unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+		uint64_t data = cqe->user_data;
+		if (data & PVL_URING_SYNC) {
+			if (cqe->res < 0) {
+				uring->failed = 1;
+			} else {
+				uring->done[(data >> 1) % uring->depth] = 1;
+			}
+			continue;
+		}
+		struct pvl_uring_slot *slot = &uring->slots[data >> 1];
+		if ((cqe->res < 0) || ((size_t) cqe->res != slot->length)) {
+			uring->failed = 1;
+		}
+		slot->busy = 0;
+		uring->busy--;
+	}
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	while ((uring->durable < uring->commits) && uring->done[uring->durable % uring->depth]) {
+		uring->done[uring->durable % uring->depth] = 0;
+		uring->durable++;
+	}
+}
+
+/* Wait for at least one completion and reap it */
+static void pvl_uring_wait(struct pvl_uring *uring) {
+	pvl_uring_enter(uring, 1);
+	pvl_uring_reap(uring);
+}
+
+/* Queue a linked write of the slot being filled and move on to the next one */
+static void pvl_uring_queue_write(struct pvl_uring *uring) {
+	struct pvl_uring_slot *slot = &uring->slots[uring->next];
+	struct io_uring_sqe *sqe = pvl_uring_sqe(uring);
+	unsigned char *from = uring->staging + (uring->next * uring->staging_size);
+	sqe->opcode = (uring->flags & PVL_URING_FIXED) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = uring->fd;
+	sqe->addr = (uintptr_t) from;
+	sqe->len = (unsigned int) uring->fill;
+	sqe->off = (uint64_t) uring->offset;
+	sqe->buf_index = 0;
+	sqe->user_data = (uint64_t) uring->next << 1;
+	uring->sq_local++;
+	uring->queued++;
+
+	slot->length = uring->fill;
+	slot->busy = 1;
+	uring->busy++;
+	uring->offset += (off_t) uring->fill;
+	uring->next = (uring->next + 1) % uring->depth;
+	uring->fill = 0;
+}
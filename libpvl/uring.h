@@ -0,0 +1,67 @@
+/*
+ * Copyright 2021 Stanislav Paskalev <spaskalev@protonmail.com>
+ */
+
+/*
+ * io_uring journal writer for libpvl (Linux)
+ *
+ * The write handler packs each change into staging slots and submits it as
+ * a chain of linked writes followed by an fdatasync, with a single
+ * io_uring_enter call or none at all with a submission queue polling thread.
+ * It does not wait for the chain to complete, so that several commits can be
+ * in flight. Completions are reaped on later calls and a commit is durable
+ * once it and every commit before it have completed.
+ *
+ * The journal has the same format as the FILE journal, read it with the
+ * handlers of journal.h. No liburing is needed, the ring is set up with raw
+ * system calls.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Use a kernel thread for polling the submission queue */
+#define PVL_URING_SQPOLL 0x01u
+
+/* Register the staging slots with the kernel and write with fixed buffers */
+#define PVL_URING_FIXED 0x02u
+
+struct pvl_uring;
+
+/* Returns the size of an io_uring journal writer with depth staging slots of staging_size bytes */
+size_t pvl_uring_sizeof(size_t depth, size_t staging_size);
+
+/*
+ * Initialize an io_uring journal writer at the provided location.
+ *
+ * Ensure that it is aligned to max_align_t. Do not copy after initialization.
+ *
+ * Passed parameters
+ * at                 - Pointer to where the writer should be initialized
+ * fd                 - The journal file descriptor, appended to from its current end
+ * depth              - The number of staging slots and of commits in flight
+ * staging_size       - The size of each staging slot
+ * flags              - A combination of PVL_URING_* flags
+ *
+ * Returns
+ * pvl_uring*         - A valid pointer in the case of success, NULL otherwise.
+ */
+struct pvl_uring *pvl_uring_open(char *at, int fd, size_t depth, size_t staging_size, unsigned int flags);
+
+/*
+ * Write handler, see write_callback in pvl.h
+ *
+ * A failed write or fdatasync leaves a gap in the journal. It is reported
+ * by every later call and the journal must be recovered by loading it anew.
+ */
+int pvl_uring_write(void *ctx, void *from, size_t length, size_t remaining);
+
+/* Reap completions and return the number of durable commits */
+uint64_t pvl_uring_durable(struct pvl_uring *uring);
+
+/* Wait until all submitted commits are durable, returns non-zero on failure */
+int pvl_uring_sync(struct pvl_uring *uring);
+
+/* Wait for all submitted commits and release the ring. It does not close fd. */
+int pvl_uring_close(struct pvl_uring *uring);